@@ -33,7 +33,10 @@ CREATE TYPE dna (
     OUTPUT = dna_out,
     RECEIVE = dna_recv,
     SEND = dna_send,
-    INTERNALLENGTH = VARIABLE
+    INTERNALLENGTH = VARIABLE,
+    -- long sequences are moved out of line uncompressed (they are already
+    -- 2-bit packed) so they can be read in slices
+    STORAGE = external
 );
 
 COMMENT ON TYPE dna IS 'dna';
@@ -70,11 +73,138 @@ CREATE OR REPLACE FUNCTION size(dna)
   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 
+CREATE OR REPLACE FUNCTION reverse_complement(dna)
+  RETURNS dna
+  AS 'MODULE_PATHNAME', 'reverse_complement'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
 CREATE OR REPLACE FUNCTION dna_len(dna)
   RETURNS integer
   AS 'MODULE_PATHNAME', 'dna_len'
   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
+/******************************************************************************
+ Sequence files of the server (superusers, pg_read_server_files to read them
+ and pg_write_server_files to write them)
+ ******************************************************************************/
+
+/*Records of a FASTA file of the server, possibly gzip-compressed*/
+CREATE OR REPLACE FUNCTION read_fasta(path text, skip_invalid boolean DEFAULT false)
+  RETURNS TABLE(id text, sequence dna)
+  AS 'MODULE_PATHNAME', 'read_fasta'
+  LANGUAGE C VOLATILE STRICT;
+
+/*Records of a FASTQ file of the server, possibly gzip-compressed*/
+CREATE OR REPLACE FUNCTION read_fastq(path text, skip_invalid boolean DEFAULT false)
+  RETURNS TABLE(id text, sequence dna, quality text)
+  AS 'MODULE_PATHNAME', 'read_fastq'
+  LANGUAGE C VOLATILE STRICT;
+
+/*Writes the rows to a FASTA file, line_width bases per line (60 by default,
+  0 for one line), and returns their number*/
+CREATE OR REPLACE FUNCTION write_fasta_transfn(internal, path text, id text, sequence dna)
+  RETURNS internal
+  AS 'MODULE_PATHNAME', 'write_fasta_transfn'
+  LANGUAGE C VOLATILE;
+
+CREATE OR REPLACE FUNCTION write_fasta_transfn(internal, path text, id text, sequence dna,
+                                               line_width integer)
+  RETURNS internal
+  AS 'MODULE_PATHNAME', 'write_fasta_transfn'
+  LANGUAGE C VOLATILE;
+
+CREATE OR REPLACE FUNCTION write_fasta_finalfn(internal)
+  RETURNS bigint
+  AS 'MODULE_PATHNAME', 'write_fasta_finalfn'
+  LANGUAGE C VOLATILE;
+
+CREATE AGGREGATE write_fasta(path text, id text, sequence dna) (
+  SFUNC = write_fasta_transfn,
+  STYPE = internal,
+  FINALFUNC = write_fasta_finalfn,
+  FINALFUNC_MODIFY = READ_WRITE
+);
+
+CREATE AGGREGATE write_fasta(path text, id text, sequence dna, line_width integer) (
+  SFUNC = write_fasta_transfn,
+  STYPE = internal,
+  FINALFUNC = write_fasta_finalfn,
+  FINALFUNC_MODIFY = READ_WRITE
+);
+
+  /***************************************************************************************/
+  /***************************************************************************************/
+  /***************************************************************************************/
+
+/*READ TYPE*/
+/******************************************************************************
+ Input/Output ('SEQUENCE QUALITIES', qualities in Phred+33 and binned)
+ ******************************************************************************/
+
+CREATE OR REPLACE FUNCTION read_in(cstring)
+  RETURNS read
+  AS 'MODULE_PATHNAME', 'read_in'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION read_out(read)
+  RETURNS cstring
+  AS 'MODULE_PATHNAME', 'read_out'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION read_recv(internal)
+  RETURNS read
+  AS 'MODULE_PATHNAME', 'read_recv'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION read_send(read)
+  RETURNS bytea
+  AS 'MODULE_PATHNAME', 'read_send'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE TYPE read (
+    INPUT = read_in,
+    OUTPUT = read_out,
+    RECEIVE = read_recv,
+    SEND = read_send,
+    INTERNALLENGTH = VARIABLE,
+    ALIGNMENT = int4,
+    STORAGE = extended
+);
+
+COMMENT ON TYPE read IS 'read';
+
+/******************************************************************************
+ Read functions
+ ******************************************************************************/
+
+/*Read from its bases and qualities, e.g. read(sequence::text, quality) from read_fastq*/
+CREATE OR REPLACE FUNCTION read(text, text)
+  RETURNS read
+  AS 'MODULE_PATHNAME', 'read_make'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION read_len(read)
+  RETURNS integer
+  AS 'MODULE_PATHNAME', 'read_len'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+/*Bases, N included*/
+CREATE OR REPLACE FUNCTION read_seq(read)
+  RETURNS text
+  AS 'MODULE_PATHNAME', 'read_seq'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+/*Qualities in Phred+33 (binned values)*/
+CREATE OR REPLACE FUNCTION read_qual(read)
+  RETURNS text
+  AS 'MODULE_PATHNAME', 'read_qual'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION mean_quality(read)
+  RETURNS double precision
+  AS 'MODULE_PATHNAME', 'mean_quality'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
   /***************************************************************************************/
   /***************************************************************************************/
   /***************************************************************************************/
@@ -105,12 +235,20 @@ CREATE OR REPLACE FUNCTION kmer_send(kmer)
   AS 'MODULE_PATHNAME'
   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
+/*Planner statistics: most common kmers and per-position base frequencies*/
+CREATE OR REPLACE FUNCTION kmer_typanalyze(internal)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME'
+  LANGUAGE C STRICT PARALLEL SAFE;
+
 CREATE TYPE kmer (
     INPUT = kmer_in,
     OUTPUT = kmer_out,
     RECEIVE = kmer_recv,
     SEND = kmer_send,
-    INTERNALLENGTH = VARIABLE
+    ANALYZE = kmer_typanalyze,
+    INTERNALLENGTH = 16,
+    ALIGNMENT = double
 );
 
 COMMENT ON TYPE kmer IS 'kmer';
@@ -152,6 +290,12 @@ CREATE OR REPLACE FUNCTION kmer_len(kmer)
   AS 'MODULE_PATHNAME', 'kmer_len'
   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
+/*Smallest of the kmer and its reverse complement*/
+CREATE OR REPLACE FUNCTION canonical(kmer)
+  RETURNS kmer
+  AS 'MODULE_PATHNAME', 'canonical'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
 
 /******************************************************************************
  * Operators
@@ -167,21 +311,163 @@ CREATE OR REPLACE FUNCTION kmer_equals(kmer,kmer)
  /*Equals operator*/
 CREATE OPERATOR = (
     LEFTARG = kmer, RIGHTARG = kmer,
-    PROCEDURE = kmer_equals
+    PROCEDURE = kmer_equals,
+    COMMUTATOR = =, NEGATOR = <>,
+    RESTRICT = eqsel, JOIN = eqjoinsel,
+    HASHES, MERGES
 );
 
-/*Starts with function operator*/
+/*Planner support: index conditions and selectivity of the prefix tests*/
+CREATE OR REPLACE FUNCTION starts_with_support(internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'starts_with_support'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_starts_with_support(internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'kmer_starts_with_support'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+/*Starts with function: does kmer (second argument) start with prefix*/
 CREATE OR REPLACE FUNCTION starts_with(kmer, kmer)
     RETURNS boolean
     AS 'MODULE_PATHNAME', 'starts_with'
-    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT starts_with_support;
+
+/*Starts with function operator: does kmer (first argument) start with prefix*/
+CREATE OR REPLACE FUNCTION kmer_starts_with(kmer, kmer)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'kmer_starts_with'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+    SUPPORT kmer_starts_with_support;
+
+/*Selectivity of kmer ^@ prefix, from the kmer statistics*/
+CREATE OR REPLACE FUNCTION kmer_prefix_sel(internal, oid, internal, integer)
+    RETURNS float8
+    AS 'MODULE_PATHNAME', 'kmer_prefix_sel'
+    LANGUAGE C STABLE STRICT PARALLEL SAFE;
 
 /*Starts with operator*/
 CREATE OPERATOR ^@ (
     LEFTARG = kmer, RIGHTARG = kmer,
-    PROCEDURE = starts_with
+    PROCEDURE = kmer_starts_with,
+    RESTRICT = kmer_prefix_sel, JOIN = matchingjoinsel
+);
+
+/*Hamming distance: mismatches, plus the difference of the lengths*/
+CREATE OR REPLACE FUNCTION hamming_distance(kmer, kmer)
+    RETURNS integer
+    AS 'MODULE_PATHNAME', 'hamming_distance'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR <-> (
+    LEFTARG = kmer, RIGHTARG = kmer,
+    PROCEDURE = hamming_distance,
+    COMMUTATOR = <->
+);
+
+/*Query of the %> operator: a kmer and the number of mismatches allowed*/
+CREATE TYPE kmer_budget AS (query kmer, mismatches integer);
+
+/*Within a number of mismatches (Hamming distance) of the query*/
+CREATE OR REPLACE FUNCTION within_mismatches(kmer, kmer_budget)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'within_mismatches'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR %> (
+    LEFTARG = kmer, RIGHTARG = kmer_budget,
+    PROCEDURE = within_mismatches,
+    RESTRICT = matchingsel, JOIN = matchingjoinsel
+);
+
+/*Ordering (lexicographic order of the sequences)*/
+CREATE OR REPLACE FUNCTION kmer_cmp(kmer, kmer)
+    RETURNS integer
+    AS 'MODULE_PATHNAME', 'kmer_cmp'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_lt(kmer, kmer)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'kmer_lt'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_le(kmer, kmer)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'kmer_le'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_gt(kmer, kmer)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'kmer_gt'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_ge(kmer, kmer)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'kmer_ge'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_ne(kmer, kmer)
+    RETURNS boolean
+    AS 'MODULE_PATHNAME', 'kmer_ne'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_sortsupport(internal)
+    RETURNS void
+    AS 'MODULE_PATHNAME', 'kmer_sortsupport'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR < (
+    LEFTARG = kmer, RIGHTARG = kmer,
+    PROCEDURE = kmer_lt,
+    COMMUTATOR = >, NEGATOR = >=,
+    RESTRICT = scalarltsel, JOIN = scalarltjoinsel
+);
+
+CREATE OPERATOR <= (
+    LEFTARG = kmer, RIGHTARG = kmer,
+    PROCEDURE = kmer_le,
+    COMMUTATOR = >=, NEGATOR = >,
+    RESTRICT = scalarlesel, JOIN = scalarlejoinsel
+);
+
+CREATE OPERATOR > (
+    LEFTARG = kmer, RIGHTARG = kmer,
+    PROCEDURE = kmer_gt,
+    COMMUTATOR = <, NEGATOR = <=,
+    RESTRICT = scalargtsel, JOIN = scalargtjoinsel
 );
 
+CREATE OPERATOR >= (
+    LEFTARG = kmer, RIGHTARG = kmer,
+    PROCEDURE = kmer_ge,
+    COMMUTATOR = <=, NEGATOR = <,
+    RESTRICT = scalargesel, JOIN = scalargejoinsel
+);
+
+CREATE OPERATOR <> (
+    LEFTARG = kmer, RIGHTARG = kmer,
+    PROCEDURE = kmer_ne,
+    COMMUTATOR = <>, NEGATOR = =,
+    RESTRICT = neqsel, JOIN = neqjoinsel
+);
+
+/*
+ * Equal kmers are bitwise identical (btequalimage), so the index can store a
+ * repeated kmer once with the list of its rows (deduplication).
+ */
+CREATE OPERATOR CLASS kmer_btree_ops
+DEFAULT FOR TYPE kmer USING btree AS
+    OPERATOR 1 <,
+    OPERATOR 2 <=,
+    OPERATOR 3 =,
+    OPERATOR 4 >=,
+    OPERATOR 5 >,
+    FUNCTION 1 kmer_cmp(kmer, kmer),
+    FUNCTION 2 kmer_sortsupport(internal),
+    FUNCTION 4 btequalimage(oid);
+
 
   /***************************************************************************************/
   /***************************************************************************************/
@@ -197,6 +483,100 @@ CREATE OR REPLACE FUNCTION generate_kmers(IN dna, IN integer, OUT f kmer)
     AS 'MODULE_PATHNAME', 'generate_kmers'
     LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
+CREATE OR REPLACE FUNCTION generate_canonical_kmers(IN dna, IN integer, OUT f kmer)
+    RETURNS SETOF kmer
+    AS 'MODULE_PATHNAME', 'generate_canonical_kmers'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+/*Kmers of a read without N and with every quality at least min_quality*/
+CREATE OR REPLACE FUNCTION generate_kmers(IN read, IN integer, min_quality integer, OUT f kmer)
+    RETURNS SETOF kmer
+    AS 'MODULE_PATHNAME', 'generate_read_kmers'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+/*Number of occurrences of every distinct kmer of a sequence*/
+CREATE OR REPLACE FUNCTION kmer_counts(dna, k integer, canonical boolean DEFAULT false)
+    RETURNS TABLE(kmer kmer, count bigint)
+    AS 'MODULE_PATHNAME', 'kmer_counts'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+/*Kmer counts over all the rows of a group, computed in parallel when possible.
+  The result is a single array, so it holds at most 16M distinct kmers (1 GB / 64):
+  kmer_counts_query below has no such limit*/
+CREATE TYPE kmer_count AS (kmer kmer, count bigint);
+
+CREATE OR REPLACE FUNCTION kmer_count_agg_transfn(internal, dna, integer)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'kmer_count_agg_transfn'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_count_agg_transfn(internal, dna, integer, boolean)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'kmer_count_agg_transfn'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_count_agg_combine(internal, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'kmer_count_agg_combine'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_count_agg_serialize(internal)
+    RETURNS bytea
+    AS 'MODULE_PATHNAME', 'kmer_count_agg_serialize'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_count_agg_deserialize(bytea, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'kmer_count_agg_deserialize'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_count_agg_finalfn(internal)
+    RETURNS kmer_count[]
+    AS 'MODULE_PATHNAME', 'kmer_count_agg_finalfn'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE kmer_count_agg(dna, integer) (
+    SFUNC = kmer_count_agg_transfn,
+    STYPE = internal,
+    FINALFUNC = kmer_count_agg_finalfn,
+    COMBINEFUNC = kmer_count_agg_combine,
+    SERIALFUNC = kmer_count_agg_serialize,
+    DESERIALFUNC = kmer_count_agg_deserialize,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE kmer_count_agg(dna, integer, canonical boolean) (
+    SFUNC = kmer_count_agg_transfn,
+    STYPE = internal,
+    FINALFUNC = kmer_count_agg_finalfn,
+    COMBINEFUNC = kmer_count_agg_combine,
+    SERIALFUNC = kmer_count_agg_serialize,
+    DESERIALFUNC = kmer_count_agg_deserialize,
+    PARALLEL = SAFE
+);
+
+/*Kmer counts over the dna values returned by a query (one dna column), e.g.
+  kmer_counts_query('SELECT sequence FROM dna_sequences', 13, true).
+  The counts are returned as rows, so their number is not limited*/
+CREATE OR REPLACE FUNCTION kmer_counts_query(query text, k integer, canonical boolean DEFAULT false)
+    RETURNS TABLE(kmer kmer, count bigint)
+    AS 'MODULE_PATHNAME', 'kmer_counts_query'
+    LANGUAGE C VOLATILE STRICT;
+
+/*Kmers of smallest hash in every window of w kmers (positions are 1-based)*/
+CREATE OR REPLACE FUNCTION generate_minimizers(dna, k integer, w integer,
+                                               canonical boolean DEFAULT false)
+    RETURNS TABLE(kmer kmer, "position" integer)
+    AS 'MODULE_PATHNAME', 'generate_minimizers'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+/*Closed syncmers: kmers whose smallest s-mer is at one of their ends*/
+CREATE OR REPLACE FUNCTION generate_syncmers(dna, k integer, s integer,
+                                             canonical boolean DEFAULT false)
+    RETURNS TABLE(kmer kmer, "position" integer)
+    AS 'MODULE_PATHNAME', 'generate_syncmers'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
 
  /***************************************************************************************/
   /***************************************************************************************/
@@ -233,7 +613,8 @@ CREATE TYPE qkmer (
     OUTPUT = qkmer_out,
     RECEIVE = qkmer_recv,
     SEND = qkmer_send,
-    INTERNALLENGTH = VARIABLE
+    INTERNALLENGTH = 24,
+    ALIGNMENT = double
 );
 
 COMMENT ON TYPE qkmer IS 'qkmer';
@@ -267,18 +648,69 @@ CREATE OR REPLACE FUNCTION qkmer_len(qkmer)
   AS 'MODULE_PATHNAME', 'qkmer_len'
   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
+/*Planner support: index conditions, selectivity and simplification of the qkmer tests*/
+CREATE OR REPLACE FUNCTION contains_support(internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME', 'contains_support'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION contained_by_support(internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME', 'contained_by_support'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
 /*contains function */
 CREATE OR REPLACE FUNCTION contains(qkmer, kmer) 
   RETURNS boolean
   AS 'MODULE_PATHNAME', 'contains'
-  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+  SUPPORT contains_support;
+
+/*Selectivity of qkmer @> kmer and of kmer <@ qkmer, from the kmer statistics*/
+CREATE OR REPLACE FUNCTION kmer_contains_sel(internal, oid, internal, integer)
+  RETURNS float8
+  AS 'MODULE_PATHNAME', 'kmer_contains_sel'
+  LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_contained_sel(internal, oid, internal, integer)
+  RETURNS float8
+  AS 'MODULE_PATHNAME', 'kmer_contained_sel'
+  LANGUAGE C STABLE STRICT PARALLEL SAFE;
 
 /*contains with operator*/
 CREATE OPERATOR @> (
     LEFTARG = qkmer, RIGHTARG = kmer,
-    PROCEDURE = contains
+    PROCEDURE = contains,
+    COMMUTATOR = <@,
+    RESTRICT = kmer_contains_sel, JOIN = matchingjoinsel
+);
+
+/*kmer matched by a qkmer, commutator of @> used by the indexes*/
+CREATE OR REPLACE FUNCTION contained_by(kmer, qkmer)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME', 'contained_by'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+  SUPPORT contained_by_support;
+
+CREATE OPERATOR <@ (
+    LEFTARG = kmer, RIGHTARG = qkmer,
+    PROCEDURE = contained_by,
+    COMMUTATOR = @>,
+    RESTRICT = kmer_contained_sel, JOIN = matchingjoinsel
 );
 
+/*Statistics of the compiled pattern cache used by contains (current backend)*/
+CREATE OR REPLACE FUNCTION qkmer_cache_stats(OUT hits bigint, OUT misses bigint,
+                                             OUT hit_rate float8)
+  RETURNS record
+  AS 'MODULE_PATHNAME', 'qkmer_cache_stats'
+  LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
+
+CREATE OR REPLACE FUNCTION qkmer_cache_reset()
+  RETURNS void
+  AS 'MODULE_PATHNAME', 'qkmer_cache_reset'
+  LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
+
 /******************************************************************************
  * Lenght functions for all the types
  ******************************************************************************/
@@ -306,21 +738,27 @@ CREATE FUNCTION kmer_hash(kmer)
   AS 'MODULE_PATHNAME', 'kmer_hash'
   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
+CREATE FUNCTION kmer_hash_extended(kmer, bigint)
+  RETURNS bigint
+  AS 'MODULE_PATHNAME', 'kmer_hash_extended'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
 CREATE OPERATOR CLASS kmer_hash_ops
 DEFAULT FOR TYPE Kmer USING hash AS
     OPERATOR 1 =,
-    FUNCTION 1 kmer_hash(kmer);
+    FUNCTION 1 kmer_hash(kmer),
+    FUNCTION 2 kmer_hash_extended(kmer, bigint);
 
 /********************* EXTRA CASTS *******************************/
 
 CREATE OR REPLACE FUNCTION kmer(dna)
   RETURNS kmer
-  AS 'MODULE_PATHNAME', 'kmer_cast_to_dna'
+  AS 'MODULE_PATHNAME', 'dna_cast_to_kmer'
   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 CREATE OR REPLACE FUNCTION dna(kmer)
-  RETURNS text
-  AS 'MODULE_PATHNAME', 'dna_cast_to_kmer'
+  RETURNS dna
+  AS 'MODULE_PATHNAME', 'kmer_cast_to_dna'
   LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 
@@ -360,13 +798,167 @@ AS
         STORAGE kmer, 
         OPERATOR        1       =  (kmer, kmer) ,
         OPERATOR        2       ^@ (kmer, kmer), 
-        OPERATOR        3       @> (qkmer, kmer),
+        OPERATOR        3       <@ (kmer, qkmer),
+        OPERATOR        4       <-> (kmer, kmer) FOR ORDER BY integer_ops,
+        OPERATOR        5       %> (kmer, kmer_budget),
+        FUNCTION        1 my_config(internal, internal),
+        FUNCTION        2 my_choose(internal, internal),
+        FUNCTION        3 my_picksplit(internal, internal),
+        FUNCTION        4 my_inner_consistent(internal, internal),
+        FUNCTION        5 my_leaf_consistent(internal, internal);
+
+
+/*Four-way radix tree over the packed nucleotides (leaves store whole kmers)*/
+CREATE OR REPLACE FUNCTION kmer_radix_config(internal, internal)
+    RETURNS void
+    AS 'MODULE_PATHNAME', 'spg_kmer_radix_config'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_radix_choose(internal, internal)
+    RETURNS void
+    AS 'MODULE_PATHNAME', 'spg_kmer_radix_choose'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_radix_picksplit(internal, internal)
+    RETURNS void
+    AS 'MODULE_PATHNAME', 'spg_kmer_radix_picksplit'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_radix_inner_consistent(internal, internal)
+    RETURNS void
+    AS 'MODULE_PATHNAME', 'spg_kmer_radix_inner_consistent'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kmer_radix_leaf_consistent(internal, internal)
+    RETURNS bool
+    AS 'MODULE_PATHNAME', 'spg_kmer_radix_leaf_consistent'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR CLASS kmer_radix_ops
+FOR TYPE kmer USING spgist
+AS
+        OPERATOR        1       =  (kmer, kmer),
+        OPERATOR        2       ^@ (kmer, kmer),
+        OPERATOR        3       <@ (kmer, qkmer),
+        FUNCTION        1 kmer_radix_config(internal, internal),
+        FUNCTION        2 kmer_radix_choose(internal, internal),
+        FUNCTION        3 kmer_radix_picksplit(internal, internal),
+        FUNCTION        4 kmer_radix_inner_consistent(internal, internal),
+        FUNCTION        5 kmer_radix_leaf_consistent(internal, internal);
+
+/*SP-GiST with a bulk build for the operator classes above: the kmers are
+  sorted (in parallel up to max_parallel_maintenance_workers) and the tree is
+  written bottom-up, with pages filled up to the fillfactor. Scans, inserts
+  and vacuums are those of SP-GiST*/
+CREATE OR REPLACE FUNCTION kmer_spgist_handler(internal)
+    RETURNS index_am_handler
+    AS 'MODULE_PATHNAME', 'kmer_spgist_handler'
+    LANGUAGE C;
+
+CREATE ACCESS METHOD kmer_spgist TYPE INDEX HANDLER kmer_spgist_handler;
+
+CREATE OPERATOR CLASS kmer_index_support
+DEFAULT FOR TYPE kmer USING kmer_spgist
+AS
+        STORAGE kmer,
+        OPERATOR        1       =  (kmer, kmer) ,
+        OPERATOR        2       ^@ (kmer, kmer),
+        OPERATOR        3       <@ (kmer, qkmer),
+        OPERATOR        4       <-> (kmer, kmer) FOR ORDER BY integer_ops,
+        OPERATOR        5       %> (kmer, kmer_budget),
         FUNCTION        1 my_config(internal, internal),
         FUNCTION        2 my_choose(internal, internal),
         FUNCTION        3 my_picksplit(internal, internal),
         FUNCTION        4 my_inner_consistent(internal, internal),
         FUNCTION        5 my_leaf_consistent(internal, internal);
 
+CREATE OPERATOR CLASS kmer_radix_ops
+FOR TYPE kmer USING kmer_spgist
+AS
+        OPERATOR        1       =  (kmer, kmer),
+        OPERATOR        2       ^@ (kmer, kmer),
+        OPERATOR        3       <@ (kmer, qkmer),
+        FUNCTION        1 kmer_radix_config(internal, internal),
+        FUNCTION        2 kmer_radix_choose(internal, internal),
+        FUNCTION        3 kmer_radix_picksplit(internal, internal),
+        FUNCTION        4 kmer_radix_inner_consistent(internal, internal),
+        FUNCTION        5 kmer_radix_leaf_consistent(internal, internal);
+
+/*Dna containment: the kmer or sequence occurs in the dna*/
+CREATE OR REPLACE FUNCTION contains(dna, kmer)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME', 'dna_contains_kmer'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION contains(dna, dna)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME', 'dna_contains_dna'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
+CREATE OPERATOR @> (
+    LEFTARG = dna, RIGHTARG = kmer,
+    PROCEDURE = contains,
+    RESTRICT = matchingsel, JOIN = matchingjoinsel
+);
 
+CREATE OPERATOR @> (
+    LEFTARG = dna, RIGHTARG = dna,
+    PROCEDURE = contains,
+    RESTRICT = matchingsel, JOIN = matchingjoinsel
+);
+
+/*
+  A pattern written as a literal ('ANGTA' @> kmer) could be a qkmer or a dna.
+  Unknown literals resolve to text first, and these overloads keep the qkmer
+  meaning it had before the dna ones; they are inlined into qkmer @> kmer, so
+  the planner support and the indexes still apply.
+*/
+CREATE OR REPLACE FUNCTION contains(text, kmer)
+  RETURNS boolean
+  AS 'SELECT contains($1::qkmer, $2)'
+  LANGUAGE SQL IMMUTABLE STRICT PARALLEL SAFE;
 
+CREATE OPERATOR @> (
+    LEFTARG = text, RIGHTARG = kmer,
+    PROCEDURE = contains,
+    RESTRICT = matchingsel, JOIN = matchingjoinsel
+);
+
+/*GIN index of dna by its kmers, option k: length of the indexed kmers (default 8)*/
+CREATE OR REPLACE FUNCTION dna_gin_extract_value(dna, internal, internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME', 'dna_gin_extract_value'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION dna_gin_extract_query(dna, internal, int2, internal, internal, internal, internal)
+  RETURNS internal
+  AS 'MODULE_PATHNAME', 'dna_gin_extract_query'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION dna_gin_consistent(internal, int2, dna, int4, internal, internal, internal, internal)
+  RETURNS boolean
+  AS 'MODULE_PATHNAME', 'dna_gin_consistent'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION dna_gin_triconsistent(internal, int2, dna, int4, internal, internal, internal)
+  RETURNS "char"
+  AS 'MODULE_PATHNAME', 'dna_gin_triconsistent'
+  LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION dna_gin_options(internal)
+  RETURNS void
+  AS 'MODULE_PATHNAME', 'dna_gin_options'
+  LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OPERATOR CLASS dna_kmer_ops
+DEFAULT FOR TYPE dna USING gin
+AS
+        OPERATOR        1       @> (dna, kmer),
+        OPERATOR        2       @> (dna, dna),
+        FUNCTION        1 btint8cmp(int8, int8),
+        FUNCTION        2 dna_gin_extract_value(dna, internal, internal),
+        FUNCTION        3 dna_gin_extract_query(dna, internal, int2, internal, internal, internal, internal),
+        FUNCTION        4 dna_gin_consistent(internal, int2, dna, int4, internal, internal, internal, internal),
+        FUNCTION        6 dna_gin_triconsistent(internal, int2, dna, int4, internal, internal, internal),
+        FUNCTION        7 dna_gin_options(internal),
+        STORAGE         int8;
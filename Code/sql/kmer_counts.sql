@@ -0,0 +1,16 @@
+CREATE EXTENSION IF NOT EXISTS dna_seq;
+
+CREATE TEMP TABLE s (s dna);
+INSERT INTO s VALUES ('ACGTACGTTA'), ('TTACG'), (NULL), ('A');
+
+-- kmer_counts_query returns rows, so it is not bounded like kmer_count_agg
+SELECT * FROM kmer_counts_query('SELECT s FROM s', 3) ORDER BY kmer;
+SELECT count(*) FROM (
+  SELECT * FROM kmer_counts_query('SELECT s FROM s', 3, true)
+  EXCEPT
+  SELECT (unnest(kmer_count_agg(s, 3, true))).* FROM s
+) d;
+
+-- the query must return one dna column and cannot modify the database
+SELECT * FROM kmer_counts_query('SELECT 1', 3);
+SELECT * FROM kmer_counts_query('DELETE FROM s RETURNING s', 3);
@@ -0,0 +1,43 @@
+CREATE EXTENSION IF NOT EXISTS dna_seq;
+
+-- kmers of 1 to 14 bases, one of them repeated over many leaf pages, and nulls
+CREATE TABLE kmer_build AS
+  SELECT CASE WHEN i % 50 = 0 THEN NULL
+              WHEN i % 7 = 0 THEN 'ACGTA'
+              ELSE translate(substr(md5(i::text), 1, 1 + i % 14),
+                             '0123456789abcdef', 'ACGTACGTACGTACGT')
+         END::kmer AS k
+  FROM generate_series(1, 20000) i;
+
+CREATE TEMP VIEW kmer_build_check AS
+  SELECT (SELECT count(*) FROM kmer_build WHERE k = 'ACGTA') AS eq,
+         (SELECT count(*) FROM kmer_build WHERE k ^@ 'AC') AS prefix,
+         (SELECT count(*) FROM kmer_build WHERE k <@ 'ANGT'::qkmer) AS pattern,
+         (SELECT count(*) FROM kmer_build WHERE k %> ('ACGTACG', 1)::kmer_budget) AS within,
+         (SELECT count(*) FROM kmer_build WHERE k IS NULL) AS nulls,
+         (SELECT sum(d) FROM (SELECT k <-> 'ACGTACGTAC' AS d FROM kmer_build
+                              ORDER BY k <-> 'ACGTACGTAC' LIMIT 1000) n) AS nearest;
+SELECT * FROM kmer_build_check;
+
+-- kmer_spgist sorts the kmers (in parallel if it can) and writes the tree
+SET max_parallel_maintenance_workers = 2;
+ALTER TABLE kmer_build SET (parallel_workers = 2);
+CREATE INDEX kmer_build_text ON kmer_build USING kmer_spgist (k);
+RESET max_parallel_maintenance_workers;
+SET enable_seqscan = off;
+EXPLAIN (COSTS OFF) SELECT * FROM kmer_build WHERE k ^@ 'AC';
+SELECT * FROM kmer_build_check;
+DROP INDEX kmer_build_text;
+
+CREATE INDEX kmer_build_radix ON kmer_build USING kmer_spgist (k kmer_radix_ops)
+  WITH (fillfactor = 100);
+SELECT * FROM kmer_build_check;
+
+-- the index takes later rows as any SP-GiST index
+INSERT INTO kmer_build SELECT k FROM kmer_build WHERE k ^@ 'T';
+INSERT INTO kmer_build VALUES ('ACGTA'), (NULL);
+SELECT * FROM kmer_build_check;
+RESET enable_seqscan;
+SELECT * FROM kmer_build_check;
+
+DROP TABLE kmer_build CASCADE;
@@ -0,0 +1,10 @@
+CREATE EXTENSION IF NOT EXISTS dna_seq;
+
+-- long reads are toasted instead of failing with "row is too big"
+-- (the qualities 5 and ? come back as 7 and B, the values of their bins)
+CREATE TEMP TABLE r (r read);
+INSERT INTO r SELECT read(repeat('ACGTN', 6000), repeat('I#5?', 7500));
+SELECT read_len(r), mean_quality(r) FROM r;
+SELECT read_seq(r) = repeat('ACGTN', 6000) AS seq_ok,
+       read_qual(r) = repeat('I#7B', 7500) AS qual_ok  -- binned qualities
+FROM r;
@@ -0,0 +1,12 @@
+CREATE EXTENSION IF NOT EXISTS dna_seq;
+
+-- rows are written line_width bases per line (relative paths are in the data directory)
+SELECT write_fasta('write_fasta_test.fa', id, sequence, 4)
+FROM (VALUES ('r1', 'ACGTACGTAC'::dna), ('r2', 'TTGCA'::dna)) v(id, sequence);
+SELECT id, sequence FROM read_fasta('write_fasta_test.fa');
+
+-- without any row, the file is still created empty, replacing the previous output
+SELECT write_fasta('write_fasta_test.fa', id, sequence)
+FROM (VALUES ('r1', 'ACGTACGTAC'::dna)) v(id, sequence) WHERE false;
+SELECT size FROM pg_stat_file('write_fasta_test.fa');
+SELECT count(*) FROM read_fasta('write_fasta_test.fa');
@@ -4,8 +4,11 @@
 #include <stdlib.h>
 
 #include "varatt.h" 
+#include "access/detoast.h"
 #include "utils/builtins.h"
 #include "libpq/pqformat.h"
+#include "port/pg_bitutils.h"
+#include "utils/guc.h"
 
 #include "dna.h"
 
@@ -16,51 +19,252 @@ PG_MODULE_MAGIC; /*Checks for incompatibilities*/
 
 /*DNA CREATION*/
 
-/* Utility function to validate a DNA sequence that is also used to validate the dna string for kmers*/
+const char dna_nucleotides[4] = {'A', 'C', 'G', 'T'};
+
+bool dna_soft_masked = false;
+
+void
+_PG_init(void)
+{
+  DefineCustomBoolVariable("dna_seq.soft_masked",
+                           "Accepts lower-case (soft-masked) nucleotides in dna and kmer input.",
+                           "Soft-masked bases are stored like upper-case ones, the mask is not kept.",
+                           &dna_soft_masked, false, PGC_USERSET, 0,
+                           NULL, NULL, NULL);
+  MarkGUCPrefixReserved("dna_seq");
+}
+
 static void
+dna_invalid_nucleotide(const char* str, int32 offset)
+{
+  ereport(ERROR,
+          (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+           errmsg("Error: Invalid nucleotide '%c' in sequence.\n", str[offset]),
+           errdetail("Invalid character at offset %d.", offset)));
+}
+
+/*
+ * Validation and packing of the characters of a sequence, in one pass. Each
+ * implementation returns the offset of the first invalid character, or len
+ * when all are valid, in which case the packed bases are in data (unless it
+ * is NULL). With soft_masked, bit 5 (the ASCII case bit) is cleared before
+ * the test; the 2-bit code of a letter does not depend on its case.
+ */
+typedef int32 (*dna_pack_fn) (const char* str, int32 len, uint8* data, bool soft_masked);
+
+static int32
+dna_pack_scalar(const char* str, int32 len, uint8* data, bool soft_masked)
+{
+  uint8 case_mask = soft_masked ? 0xDF : 0xFF;
+  uint8 byte = 0;
+
+  for (int32 i = 0; i < len; i++) {
+    uint8 c = (uint8) str[i] & case_mask;
+
+    if (c != 'A' && c != 'C' && c != 'G' && c != 'T')
+      return i;
+    byte = byte << 2 | NUCLEOTIDE_CODE(c);
+    if ((i & 3) == 3) {
+      if (data != NULL)
+        data[i >> 2] = byte;
+      byte = 0;
+    }
+  }
+  if ((len & 3) != 0 && data != NULL)
+    data[len >> 2] = byte << (2 * (4 - (len & 3)));
+  return len;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define DNA_USE_X86_SIMD
+#include <immintrin.h>
+
+/*
+ * 16 characters at a time: PCMPESTRI finds the first character outside the
+ * nucleotide set, the codes are then combined four by four into bytes by
+ * multiply-adds (64 * b0 + 16 * b1 + 4 * b2 + b3) and gathered by a shuffle.
+ */
+static int32 __attribute__((target("sse4.2")))
+dna_pack_sse42(const char* str, int32 len, uint8* data, bool soft_masked)
+{
+  const __m128i set = _mm_setr_epi8('A', 'C', 'G', 'T', 'a', 'c', 'g', 't',
+                                    0, 0, 0, 0, 0, 0, 0, 0);
+  const int setlen = soft_masked ? 8 : 4;
+  const __m128i three = _mm_set1_epi8(3);
+  const __m128i weights = _mm_set1_epi32(0x01041040);
+  const __m128i ones = _mm_set1_epi16(1);
+  const __m128i gather = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1,
+                                       -1, -1, -1, -1, -1, -1, -1, -1);
+  int32 i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i chars = _mm_loadu_si128((const __m128i *) (str + i));
+    int bad = _mm_cmpestri(set, setlen, chars, 16,
+                           _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+                           _SIDD_NEGATIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT);
+
+    if (bad < 16)
+      return i + bad;
+    if (data != NULL) {
+      __m128i codes = _mm_and_si128(_mm_xor_si128(_mm_srli_epi16(chars, 1),
+                                                  _mm_srli_epi16(chars, 2)), three);
+      __m128i packed = _mm_madd_epi16(_mm_maddubs_epi16(codes, weights), ones);
+      uint32 bytes = (uint32) _mm_cvtsi128_si32(_mm_shuffle_epi8(packed, gather));
+
+      memcpy(data + i / 4, &bytes, sizeof(bytes));
+    }
+  }
+  return i + dna_pack_scalar(str + i, len - i, data != NULL ? data + i / 4 : NULL,
+                             soft_masked);
+}
+
+/* 32 characters at a time, tested against each nucleotide and packed as above */
+static int32 __attribute__((target("avx2")))
+dna_pack_avx2(const char* str, int32 len, uint8* data, bool soft_masked)
+{
+  const __m256i case_mask = _mm256_set1_epi8(soft_masked ? (char) 0xDF : (char) 0xFF);
+  const __m256i a = _mm256_set1_epi8('A');
+  const __m256i c = _mm256_set1_epi8('C');
+  const __m256i g = _mm256_set1_epi8('G');
+  const __m256i t = _mm256_set1_epi8('T');
+  const __m256i three = _mm256_set1_epi8(3);
+  const __m256i weights = _mm256_set1_epi32(0x01041040);
+  const __m256i ones = _mm256_set1_epi16(1);
+  const __m256i gather = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1,
+                                          -1, -1, -1, -1, -1, -1, -1, -1,
+                                          0, 4, 8, 12, -1, -1, -1, -1,
+                                          -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m256i lanes = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+  int32 i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i chars = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (str + i)),
+                                     case_mask);
+    __m256i valid = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chars, a),
+                                                    _mm256_cmpeq_epi8(chars, c)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(chars, g),
+                                                    _mm256_cmpeq_epi8(chars, t)));
+    uint32 invalid = ~(uint32) _mm256_movemask_epi8(valid);
+
+    if (invalid != 0)
+      return i + pg_rightmost_one_pos32(invalid);
+    if (data != NULL) {
+      __m256i codes = _mm256_and_si256(_mm256_xor_si256(_mm256_srli_epi16(chars, 1),
+                                                        _mm256_srli_epi16(chars, 2)), three);
+      __m256i packed = _mm256_madd_epi16(_mm256_maddubs_epi16(codes, weights), ones);
+
+      packed = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(packed, gather), lanes);
+      _mm_storel_epi64((__m128i *) (data + i / 4), _mm256_castsi256_si128(packed));
+    }
+  }
+  return i + dna_pack_sse42(str + i, len - i, data != NULL ? data + i / 4 : NULL,
+                            soft_masked);
+}
+#endif
+
+static int32 dna_pack_choose(const char* str, int32 len, uint8* data, bool soft_masked);
+static dna_pack_fn dna_pack_impl = dna_pack_choose;
+
+/* Picks the widest implementation the CPU supports, on the first call */
+static int32
+dna_pack_choose(const char* str, int32 len, uint8* data, bool soft_masked)
+{
+#ifdef DNA_USE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    dna_pack_impl = dna_pack_avx2;
+  else if (__builtin_cpu_supports("sse4.2"))
+    dna_pack_impl = dna_pack_sse42;
+  else
+#endif
+    dna_pack_impl = dna_pack_scalar;
+
+  return dna_pack_impl(str, len, data, soft_masked);
+}
+
+/*
+ * Packs the len characters of str into data (NULL to only validate) and
+ * returns len, or the offset of the first invalid character without raising
+ * an error.
+ */
+int32
+dna_try_pack(const char* str, int32 len, uint8* data)
+{
+  return dna_pack_impl(str, len, data, dna_soft_masked);
+}
+
+/*
+ * Validates the len characters of str and packs them into data (NULL to only
+ * validate), reporting the first invalid character and its offset.
+ */
+void
+dna_pack(const char* str, int32 len, uint8* data)
+{
+  int32 bad = dna_try_pack(str, len, data);
+
+  if (bad < len)
+    dna_invalid_nucleotide(str, bad);
+}
+
+/* Utility function to validate a DNA sequence that is also used to validate the dna string for kmers*/
+void
 validate_dna_sequence(const char* str)
 {
     if (str == NULL || str[0] == '\0') {
         ereport(ERROR, (errmsg("Input array cannot be NULL or empty")));
     }
 
-    int32 len = strlen(str);
-    for (int i = 0; i < len; i++) {
-        if (!(str[i] == 'A' || str[i] == 'C' || str[i] == 'G' || str[i] == 'T')) {
-            ereport(
-                ERROR,
-                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                 errmsg("Error: Invalid nucleotide '%c' in sequence.\n", str[i])));
-        }
-    }
+    dna_pack(str, strlen(str), NULL);
 }
 
-/*Dna creation from str (internal) (with checks)*/
+/*Allocates a zeroed Dna able to hold length nucleotides (internal)*/
 Dna*
-dna_parse(const char* str)
+dna_alloc(int32 length)
 {
+  Size size = DNA_HDRSZ + DNA_PACKED_SIZE(length);
+  Dna *dna = (Dna *) palloc0(size);
 
-  
+  SET_VARSIZE(dna, size);
+  dna->length = length;
+  return dna;
+}
 
-  int32 len = strlen(str);
+/*Dna creation from the len characters of str, not necessarily terminated (internal) (with checks)*/
+Dna*
+dna_parse_bytes(const char* str, int32 len)
+{
   Dna *dna;
 
-  validate_dna_sequence(str);
-  
-  dna = (Dna *) palloc(VARHDRSZ + len  + 1 );
-  SET_VARSIZE(dna, VARHDRSZ +  len  + 1 );
-  memcpy(dna->sequence, str, len + 1);
+  if (len == 0)
+    ereport(ERROR, (errmsg("Input array cannot be NULL or empty")));
 
+  dna = dna_alloc(len);
+  dna_pack(str, len, dna->data);
   return dna;
 }
 
+/*Dna creation from str (internal) (with checks)*/
+Dna*
+dna_parse(const char* str)
+{
+  if (str == NULL)
+    ereport(ERROR, (errmsg("Input array cannot be NULL or empty")));
+
+  return dna_parse_bytes(str, strlen(str));
+}
+
 
 
 /*Dna to str (internal)*/
 char *
 dna_to_str(const Dna* dna)
 {
-  return pstrdup(dna->sequence);
+  char *str = palloc(dna->length + 1);
+
+  for (int i = 0; i < dna->length; i++)
+    str[i] = dna_nucleotides[DNA_GET_BASE(dna, i)];
+  str[dna->length] = '\0';
+  return str;
 }
 
 /********************************************************/
@@ -82,22 +286,57 @@ PG_FUNCTION_INFO_V1(dna_out);
 Datum
 dna_out(PG_FUNCTION_ARGS)
 {
-  const Dna *dna = (Dna *) PG_GETARG_POINTER(0);
+  const Dna *dna = PG_GETARG_DNA_P(0);
   PG_RETURN_CSTRING(dna_to_str(dna));
 }
 
 /*Binary in (binary -> Dna)*/
 
+/*Checks the version byte of a binary dna or kmer*/
+void
+dna_recv_version(StringInfo buf)
+{
+    int version = pq_getmsgbyte(buf);
+
+    if (version != DNA_BINARY_VERSION)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                 errmsg("unsupported binary format version %d", version)));
+}
+
+/*Copies the packed bases of length nucleotides, rejecting set padding bits*/
+void
+dna_recv_bases(StringInfo buf, int32 length, uint8* data)
+{
+    int32 nbytes = DNA_PACKED_SIZE(length);
+
+    pq_copymsgbytes(buf, (char *) data, nbytes);
+    if (length % 4 && (data[nbytes - 1] & (0xFF >> (2 * (length % 4)))) != 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                 errmsg("invalid padding bits in packed nucleotides")));
+}
+
 PG_FUNCTION_INFO_V1(dna_recv);
 Datum
 dna_recv(PG_FUNCTION_ARGS)
 {
     StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
-    int32 len = pq_getmsgint(buf, sizeof(int32));
-    Dna *dna = (Dna *) palloc(VARHDRSZ + len + 1); 
-    SET_VARSIZE(dna, VARHDRSZ + len + 1);  
-    pq_copymsgbytes(buf, dna->sequence, len);
-    dna->sequence[len] = '\0';
+    int32 len;
+    Dna *dna;
+
+    dna_recv_version(buf);
+    len = pq_getmsgint(buf, sizeof(int32));
+    if (len <= 0)
+        ereport(ERROR, (errmsg("Input array cannot be NULL or empty")));
+    /* checked before allocating, the length comes from the client */
+    if ((int64) len > 4 * (int64) (buf->len - buf->cursor))
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                 errmsg("insufficient data left in message")));
+
+    dna = dna_alloc(len);
+    dna_recv_bases(buf, len, dna->data);
     PG_RETURN_POINTER(dna);
 }
 
@@ -108,12 +347,12 @@ PG_FUNCTION_INFO_V1(dna_send);
 Datum
 dna_send(PG_FUNCTION_ARGS)
 {
-    Dna *dna = (Dna *) PG_GETARG_POINTER(0);
-    int32 len = VARSIZE(dna) - VARHDRSZ; 
+    Dna *dna = PG_GETARG_DNA_P(0);
     StringInfoData buf;
     pq_begintypsend(&buf);
-    pq_sendint32(&buf, len);
-    pq_sendbytes(&buf, dna->sequence, len);
+    pq_sendbyte(&buf, DNA_BINARY_VERSION);
+    pq_sendint32(&buf, dna->length);
+    pq_sendbytes(&buf, (char *) dna->data, DNA_PACKED_SIZE(dna->length));
     PG_FREE_IF_COPY(dna, 0);
     PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
 }
@@ -125,10 +364,10 @@ PG_FUNCTION_INFO_V1(dna_cast_from_text);
 Datum
 dna_cast_from_text(PG_FUNCTION_ARGS)
 {
-  text *txt = PG_GETARG_TEXT_P(0);
-  char *str = DatumGetCString(DirectFunctionCall1(textout,
-               PointerGetDatum(txt))); /*Postgre text to C string*/
-  PG_RETURN_POINTER(dna_parse(str));
+  text *txt = PG_GETARG_TEXT_PP(0);
+
+  /*parsed in place, without the copy into a C string*/
+  PG_RETURN_POINTER(dna_parse_bytes(VARDATA_ANY(txt), VARSIZE_ANY_EXHDR(txt)));
 }
 
 /* Dna -> text (external)*/
@@ -136,7 +375,7 @@ PG_FUNCTION_INFO_V1(dna_cast_to_text);
 Datum
 dna_cast_to_text(PG_FUNCTION_ARGS)
 {
-  const Dna *dna  = (Dna *) PG_GETARG_POINTER(0); 
+  const Dna *dna  = PG_GETARG_DNA_P(0);
   text *out = (text *)DirectFunctionCall1(textin,
             PointerGetDatum(dna_to_str(dna)));
   PG_RETURN_TEXT_P(out);
@@ -151,15 +390,129 @@ PG_FUNCTION_INFO_V1(dna_size);
 Datum
 dna_size(PG_FUNCTION_ARGS)
 {
-  const Dna *dna  = (Dna *) PG_GETARG_POINTER(0);
-  PG_RETURN_INT32(dna->size); 
+  PG_RETURN_INT32(toast_raw_datum_size(PG_GETARG_DATUM(0)));
 }
 
-/*Length*/
+/*Length (only the header is fetched, so this is O(1) even for toasted values)*/
 PG_FUNCTION_INFO_V1(dna_len);
 Datum
 dna_len(PG_FUNCTION_ARGS)
 {
-  const Dna *dna  = (Dna *) PG_GETARG_POINTER(0);
-  PG_RETURN_INT32(strlen(dna->sequence)); 
+  const Dna *dna = (Dna *) PG_DETOAST_DATUM_SLICE(PG_GETARG_DATUM(0), 0,
+                                                  sizeof(int32));
+  PG_RETURN_INT32(dna->length);
+}
+
+/*
+ * Reverse complement of the four bases packed in each byte value: the bases
+ * are reversed and each code c becomes 3 - c (A<->T, C<->G).
+ */
+#define DNA_RC_BYTE(a, b, c, d) \
+  ((3 - (d)) << 6 | (3 - (c)) << 4 | (3 - (b)) << 2 | (3 - (a)))
+#define DNA_RC_ROW3(a, b, c) \
+  DNA_RC_BYTE(a, b, c, 0), DNA_RC_BYTE(a, b, c, 1), DNA_RC_BYTE(a, b, c, 2), DNA_RC_BYTE(a, b, c, 3)
+#define DNA_RC_ROW2(a, b) \
+  DNA_RC_ROW3(a, b, 0), DNA_RC_ROW3(a, b, 1), DNA_RC_ROW3(a, b, 2), DNA_RC_ROW3(a, b, 3)
+#define DNA_RC_ROW1(a) \
+  DNA_RC_ROW2(a, 0), DNA_RC_ROW2(a, 1), DNA_RC_ROW2(a, 2), DNA_RC_ROW2(a, 3)
+
+static const uint8 dna_rc_bytes[256] = {
+  DNA_RC_ROW1(0), DNA_RC_ROW1(1), DNA_RC_ROW1(2), DNA_RC_ROW1(3)
+};
+
+/*
+ * Reverse complement, computed a byte at a time on the packed bases. Reading
+ * the bytes backwards puts the padding of the last byte at the front, so the
+ * result is shifted left by the number of padding bits.
+ */
+PG_FUNCTION_INFO_V1(reverse_complement);
+Datum
+reverse_complement(PG_FUNCTION_ARGS)
+{
+  const Dna *dna = PG_GETARG_DNA_P(0);
+  int32 nbytes = DNA_PACKED_SIZE(dna->length);
+  int shift = 2 * (4 * nbytes - dna->length);
+  Dna *out = dna_alloc(dna->length);
+
+  for (int32 i = 0; i < nbytes; i++) {
+    uint8 hi = dna_rc_bytes[dna->data[nbytes - 1 - i]];
+    uint8 lo = i + 1 < nbytes ? dna_rc_bytes[dna->data[nbytes - 2 - i]] : 0;
+
+    out->data[i] = shift == 0 ? hi : (uint8) (hi << shift | lo >> (8 - shift));
+  }
+  PG_RETURN_POINTER(out);
+}
+
+/*******************************************************/
+
+/* Sequential reading */
+
+/*
+ * Prepares a reader over a dna datum. The slices and the copy of the toast
+ * pointer are allocated in the current memory context.
+ */
+void
+dna_reader_init(DnaReader* reader, Datum datum)
+{
+  struct varlena *value = (struct varlena *) DatumGetPointer(datum);
+
+  reader->mcxt = CurrentMemoryContext;
+  reader->pos = 0;
+  reader->chunk_start = 0;
+  reader->streaming = false;
+  if (VARATT_IS_EXTERNAL_ONDISK(value)) {
+    struct varatt_external toast_pointer;
+
+    /* the toast pointer may be unaligned, copy it out before reading it */
+    VARATT_EXTERNAL_GET_POINTER(toast_pointer, value);
+    reader->streaming = !VARATT_EXTERNAL_IS_COMPRESSED(toast_pointer);
+  }
+
+  if (reader->streaming) {
+    /* keep our own copy of the toast pointer, it must outlive the call */
+    reader->datum = PointerGetDatum(memcpy(palloc(VARSIZE_ANY(value)), value, VARSIZE_ANY(value)));
+    reader->length = ((Dna *) PG_DETOAST_DATUM_SLICE(reader->datum, 0, sizeof(int32)))->length;
+    reader->chunk = NULL;
+    reader->chunk_end = 0;
+  }
+  else {
+    Dna *dna = DatumGetDnaP(datum);
+
+    reader->datum = PointerGetDatum(dna);
+    reader->length = dna->length;
+    reader->chunk = (struct varlena *) dna;
+    reader->data = dna->data;
+    reader->chunk_end = dna->length;
+  }
+}
+
+/* Fetches the slice holding the next base */
+void
+dna_reader_fill(DnaReader* reader)
+{
+  int32 offset = reader->pos / 4;
+  int32 nbytes = Min(DNA_READER_CHUNK_SIZE, DNA_PACKED_SIZE(reader->length) - offset);
+  MemoryContext oldcontext;
+
+  Assert(reader->streaming && reader->pos < reader->length);
+
+  if (reader->chunk != NULL)
+    pfree(reader->chunk);
+
+  oldcontext = MemoryContextSwitchTo(reader->mcxt);
+  reader->chunk = (struct varlena *) PG_DETOAST_DATUM_SLICE(reader->datum,
+                                                            sizeof(int32) + offset, nbytes);
+  MemoryContextSwitchTo(oldcontext);
+
+  reader->data = (const uint8 *) VARDATA(reader->chunk);
+  reader->chunk_start = offset * 4;
+  reader->chunk_end = Min(reader->length, (offset + nbytes) * 4);
+}
+
+void
+dna_reader_end(DnaReader* reader)
+{
+  if (reader->streaming && reader->chunk != NULL)
+    pfree(reader->chunk);
+  reader->chunk = NULL;
 }
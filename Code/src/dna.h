@@ -1,14 +1,124 @@
 #pragma once
 
+#include "lib/stringinfo.h"
+
 /* Structure to represent DNA */
 
+/*
+ * The nucleotides are stored packed, 2 bits per base (A=0, C=1, G=2, T=3),
+ * four bases per byte with the first base in the two most significant bits.
+ * The unused bits of the last byte are always zero. The number of bases is
+ * kept in the header so the length is known without scanning the data.
+ */
 typedef struct Dna {
-    int32 size;
-    char sequence[FLEXIBLE_ARRAY_MEMBER];
+    int32 size;     /* varlena header (do not touch directly!) */
+    int32 length;   /* number of nucleotides */
+    uint8 data[FLEXIBLE_ARRAY_MEMBER];
 } Dna;
 
+#define DNA_HDRSZ               offsetof(Dna, data)
+#define DNA_PACKED_SIZE(len)    (((len) + 3) / 4)
+#define DNA_GET_BASE(dna, i) \
+    (((dna)->data[(i) >> 2] >> (6 - 2 * ((i) & 3))) & 3)
+
+/*
+ * Binary (send/recv) format of dna and kmer: a version byte, the number of
+ * nucleotides (int32 for dna, one byte for kmer) and the packed bases as
+ * above, with the unused bits of the last byte zero.
+ */
+#define DNA_BINARY_VERSION      1
+
+/* 2-bit code of an already validated nucleotide character */
+#define NUCLEOTIDE_CODE(c)      ((((c) >> 1) ^ ((c) >> 2)) & 3)
+
+#define DatumGetDnaP(X)         ((Dna *) PG_DETOAST_DATUM(X))
+#define PG_GETARG_DNA_P(n)      DatumGetDnaP(PG_GETARG_DATUM(n))
+
+/* Structure to represent a sequencing read (bases and qualities) */
+
+/*
+ * The bases are packed as in Dna, an N being stored as A and its position
+ * kept in a list. The Phred qualities are reduced to the 8 bins of Illumina
+ * (read_qual_values) and run-length encoded, one byte per run: the bin in
+ * the 3 high bits, the length of the run minus one in the 5 low bits.
+ *
+ * data holds the positions of the N bases (int32, ascending), then the
+ * packed bases, then the quality runs.
+ */
+typedef struct Read {
+    int32 size;     /* varlena header (do not touch directly!) */
+    int32 length;   /* number of bases */
+    int32 nmissing; /* number of N bases */
+    int32 nruns;    /* number of quality runs */
+    uint8 data[FLEXIBLE_ARRAY_MEMBER];
+} Read;
+
+#define READ_HDRSZ              offsetof(Read, data)
+#define READ_MISSING(read)      ((int32 *) (read)->data)
+#define READ_BASES(read)        ((read)->data + sizeof(int32) * (read)->nmissing)
+#define READ_RUNS(read)         (READ_BASES(read) + DNA_PACKED_SIZE((read)->length))
+#define READ_QUAL_BINS          8
+#define READ_MAX_RUN            32
+#define READ_RUN(bin, len)      ((uint8) ((bin) << 5 | ((len) - 1)))
+#define READ_RUN_BIN(run)       ((run) >> 5)
+#define READ_RUN_LENGTH(run)    (((run) & 31) + 1)
+
+#define DatumGetReadP(X)        ((Read *) PG_DETOAST_DATUM(X))
+#define PG_GETARG_READ_P(n)     DatumGetReadP(PG_GETARG_DATUM(n))
+
+/* Quality (Phred score) standing for each bin */
+extern const uint8 read_qual_values[READ_QUAL_BINS];
+
+/*
+ * Sequential reader over the bases of a dna datum. A value stored out of line
+ * and uncompressed is fetched in slices of DNA_READER_CHUNK_SIZE packed bytes,
+ * so memory stays bounded whatever the length of the sequence; any other value
+ * is simply detoasted once.
+ */
+typedef struct DnaReader {
+    Datum datum;                /* value being read, possibly still toasted */
+    bool streaming;             /* fetch slices instead of the whole value */
+    int32 length;               /* number of nucleotides */
+    int32 pos;                  /* index of the next base */
+    int32 chunk_start;          /* index of the first base in the chunk */
+    int32 chunk_end;            /* index after the last base in the chunk */
+    struct varlena *chunk;      /* current slice, or the whole value */
+    const uint8 *data;          /* packed bases of the chunk */
+    MemoryContext mcxt;         /* context the slices are allocated in */
+} DnaReader;
+
+#define DNA_READER_CHUNK_SIZE   65536
+
+/* Character of each 2-bit nucleotide code */
+extern const char dna_nucleotides[4];
+
+/* dna_seq.soft_masked: lower-case nucleotides are accepted */
+extern bool dna_soft_masked;
+
+void validate_dna_sequence(const char* str);
+Dna* dna_alloc(int32 length);
+int32 dna_try_pack(const char* str, int32 len, uint8* data);
+void dna_pack(const char* str, int32 len, uint8* data);
 Dna* dna_parse(const char* str);
+Dna* dna_parse_bytes(const char* str, int32 len);
 char * dna_to_str(const Dna* dna);
+void dna_recv_version(StringInfo buf);
+void dna_recv_bases(StringInfo buf, int32 length, uint8* data);
+void dna_reader_init(DnaReader* reader, Datum datum);
+void dna_reader_fill(DnaReader* reader);
+void dna_reader_end(DnaReader* reader);
+
+/* Next 2-bit base of the sequence, the caller checks pos < length */
+static inline uint8
+dna_reader_next(DnaReader* reader)
+{
+    int32 pos;
+
+    if (reader->pos >= reader->chunk_end)
+        dna_reader_fill(reader);
+    pos = reader->pos++;
+    return (reader->data[(pos - reader->chunk_start) >> 2] >> (6 - 2 * (pos & 3))) & 3;
+}
 Datum dna_in(PG_FUNCTION_ARGS);
 Datum dna_out(PG_FUNCTION_ARGS);
 Datum dna_recv(PG_FUNCTION_ARGS);
@@ -17,4 +127,13 @@ Datum dna_cast_from_text(PG_FUNCTION_ARGS);
 Datum dna_cast_to_text(PG_FUNCTION_ARGS);
 Datum dna_size(PG_FUNCTION_ARGS);
 Datum dna_len(PG_FUNCTION_ARGS);
-
+Datum reverse_complement(PG_FUNCTION_ARGS);
+Datum read_in(PG_FUNCTION_ARGS);
+Datum read_out(PG_FUNCTION_ARGS);
+Datum read_recv(PG_FUNCTION_ARGS);
+Datum read_send(PG_FUNCTION_ARGS);
+Datum read_make(PG_FUNCTION_ARGS);
+Datum read_len(PG_FUNCTION_ARGS);
+Datum read_seq(PG_FUNCTION_ARGS);
+Datum read_qual(PG_FUNCTION_ARGS);
+Datum mean_quality(PG_FUNCTION_ARGS);
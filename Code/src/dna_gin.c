@@ -0,0 +1,170 @@
+#include "postgres.h"
+
+#include "access/gin.h"
+#include "access/reloptions.h"
+#include "access/stratnum.h"
+
+#include "dna.h"
+#include "kmer.h"
+
+/*
+ * GIN operator class dna_kmer_ops: a dna is indexed by the distinct kmers of
+ * length k it contains (option k, DNA_GIN_DEFAULT_K by default), each key
+ * being the packed bases of a kmer, right-aligned in an int8.
+ *
+ * A query pattern of at least k bases is looked up by all its kmers of
+ * length k: the sequences holding them all are candidates, rechecked unless
+ * the pattern is a single kmer of length k. A shorter pattern has no key and
+ * scans the whole index. Sequences shorter than k have no key either, they
+ * cannot contain a pattern of k bases or more.
+ */
+
+#define DNA_GIN_DEFAULT_K           8
+
+#define DNA_CONTAINS_KMER_STRATEGY  1   /* dna @> kmer */
+#define DNA_CONTAINS_DNA_STRATEGY   2   /* dna @> dna */
+
+typedef struct DnaGinOptions {
+    int32 vl_len_;      /* varlena header (do not touch directly!) */
+    int k;              /* length of the indexed kmers */
+} DnaGinOptions;
+
+static int
+dna_gin_k(FunctionCallInfo fcinfo)
+{
+    if (PG_HAS_OPCLASS_OPTIONS())
+        return ((DnaGinOptions *) PG_GET_OPCLASS_OPTIONS())->k;
+    return DNA_GIN_DEFAULT_K;
+}
+
+/* Keys of the kmers of length k read from reader, *nkeys of them */
+static Datum *
+dna_gin_keys(DnaReader *reader, int k, int32 *nkeys)
+{
+    uint64  mask = k == KMER_MAX_LENGTH ? ~UINT64CONST(0) : (UINT64CONST(1) << (2 * k)) - 1;
+    uint64  window = 0;
+    Datum  *keys;
+
+    *nkeys = Max(reader->length - k + 1, 0);
+    if (*nkeys == 0)
+        return NULL;
+
+    keys = (Datum *) palloc(sizeof(Datum) * *nkeys);
+    while (reader->pos < reader->length) {
+        window = ((window << 2) | dna_reader_next(reader)) & mask;
+        if (reader->pos >= k)
+            keys[reader->pos - k] = Int64GetDatum((int64) window);
+    }
+    return keys;
+}
+
+PG_FUNCTION_INFO_V1(dna_gin_extract_value);
+Datum
+dna_gin_extract_value(PG_FUNCTION_ARGS)
+{
+    int32  *nkeys = (int32 *) PG_GETARG_POINTER(1);
+    DnaReader reader;
+    Datum  *keys;
+
+    dna_reader_init(&reader, PG_GETARG_DATUM(0));
+    keys = dna_gin_keys(&reader, dna_gin_k(fcinfo), nkeys);
+    dna_reader_end(&reader);
+
+    PG_RETURN_POINTER(keys);
+}
+
+PG_FUNCTION_INFO_V1(dna_gin_extract_query);
+Datum
+dna_gin_extract_query(PG_FUNCTION_ARGS)
+{
+    int32  *nkeys = (int32 *) PG_GETARG_POINTER(1);
+    StrategyNumber strategy = PG_GETARG_UINT16(2);
+    int32  *searchMode = (int32 *) PG_GETARG_POINTER(6);
+    int     k = dna_gin_k(fcinfo);
+    Datum  *keys = NULL;
+
+    switch (strategy) {
+        case DNA_CONTAINS_KMER_STRATEGY: {
+            const Kmer *kmer = PG_GETARG_KMER_P(0);
+
+            *nkeys = Max(kmer->length - k + 1, 0);
+            if (*nkeys > 0) {
+                keys = (Datum *) palloc(sizeof(Datum) * *nkeys);
+                for (int i = 0; i < *nkeys; i++)
+                    keys[i] = Int64GetDatum((int64) ((kmer->bases << (2 * i)) >> (64 - 2 * k)));
+            }
+            break;
+        }
+        case DNA_CONTAINS_DNA_STRATEGY: {
+            DnaReader reader;
+
+            dna_reader_init(&reader, PG_GETARG_DATUM(0));
+            keys = dna_gin_keys(&reader, k, nkeys);
+            dna_reader_end(&reader);
+            break;
+        }
+        default:
+            elog(ERROR, "unrecognized strategy number: %d", strategy);
+    }
+
+    /* Patterns shorter than k: every sequence is a candidate */
+    if (*nkeys == 0)
+        *searchMode = GIN_SEARCH_MODE_ALL;
+
+    PG_RETURN_POINTER(keys);
+}
+
+PG_FUNCTION_INFO_V1(dna_gin_consistent);
+Datum
+dna_gin_consistent(PG_FUNCTION_ARGS)
+{
+    bool   *check = (bool *) PG_GETARG_POINTER(0);
+    StrategyNumber strategy = PG_GETARG_UINT16(1);
+    int32   nkeys = PG_GETARG_INT32(3);
+    bool   *recheck = (bool *) PG_GETARG_POINTER(5);
+
+    for (int i = 0; i < nkeys; i++)
+        if (!check[i])
+            PG_RETURN_BOOL(false);
+
+    /* Only a kmer of exactly k bases is answered by its key alone */
+    *recheck = !(strategy == DNA_CONTAINS_KMER_STRATEGY && nkeys == 1 &&
+                 PG_GETARG_KMER_P(2)->length == dna_gin_k(fcinfo));
+    PG_RETURN_BOOL(true);
+}
+
+PG_FUNCTION_INFO_V1(dna_gin_triconsistent);
+Datum
+dna_gin_triconsistent(PG_FUNCTION_ARGS)
+{
+    GinTernaryValue *check = (GinTernaryValue *) PG_GETARG_POINTER(0);
+    StrategyNumber strategy = PG_GETARG_UINT16(1);
+    int32   nkeys = PG_GETARG_INT32(3);
+    GinTernaryValue result = GIN_TRUE;
+
+    for (int i = 0; i < nkeys; i++) {
+        if (check[i] == GIN_FALSE)
+            PG_RETURN_GIN_TERNARY_VALUE(GIN_FALSE);
+        if (check[i] == GIN_MAYBE)
+            result = GIN_MAYBE;
+    }
+
+    if (!(strategy == DNA_CONTAINS_KMER_STRATEGY && nkeys == 1 &&
+          PG_GETARG_KMER_P(2)->length == dna_gin_k(fcinfo)))
+        result = GIN_MAYBE;
+    PG_RETURN_GIN_TERNARY_VALUE(result);
+}
+
+PG_FUNCTION_INFO_V1(dna_gin_options);
+Datum
+dna_gin_options(PG_FUNCTION_ARGS)
+{
+    local_relopts *relopts = (local_relopts *) PG_GETARG_POINTER(0);
+
+    init_local_reloptions(relopts, sizeof(DnaGinOptions));
+    add_local_int_reloption(relopts, "k", "length of the indexed kmers",
+                            DNA_GIN_DEFAULT_K, 1, KMER_MAX_LENGTH,
+                            offsetof(DnaGinOptions, k));
+
+    PG_RETURN_VOID();
+}
@@ -7,31 +7,148 @@
 #include "libpq/pqformat.h"
 
 #include "funcapi.h"
+#include "utils/tuplestore.h"
+#include "utils/array.h"
+#include "utils/lsyscache.h"
+#include "utils/typcache.h"
+#include "utils/syscache.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "port/pg_bitutils.h"
 #include "dna.h"
 #include "kmer.h"
 #include "qkmer.h"
-#include <regex.h>  /* Include the regex library */
+#include "kmer_table.h"
 
 
+/*
+ * Sliding window over the last k bases of a sequence, kept right-aligned in a
+ * word so each kmer is obtained by shifting one more base in. The reverse
+ * complement of the window is maintained alongside it: the complement of the
+ * new base enters on the left while the oldest one leaves on the right.
+ */
 typedef struct {
-    int k;           // Store the integer k
-    char *sequence;  // Store the DNA sequence (or other values you need)
+    int k;              // Number of bases in the window
+    bool canonical;     // Report the smallest of both strands
+    uint64 forward;     // Last bases read, right-aligned
+    uint64 reverse;     // Reverse complement of forward
+    uint64 mask;        // Keeps the k rightmost bases of forward
+} KmerWindow;
+
+static void
+kmer_window_init(KmerWindow *window, int k, bool canonical)
+{
+    window->k = k;
+    window->canonical = canonical;
+    window->forward = 0;
+    window->reverse = 0;
+    window->mask = k == KMER_MAX_LENGTH ? ~UINT64CONST(0) : (UINT64CONST(1) << (2 * k)) - 1;
+}
+
+/* Shift one more 2-bit base into the window */
+static inline void
+kmer_window_push(KmerWindow *window, uint8 base)
+{
+    window->forward = ((window->forward << 2) | base) & window->mask;
+    window->reverse = (window->reverse >> 2) | ((uint64) (base ^ 3) << (2 * (window->k - 1)));
+}
+
+/* Packed (left-aligned) bases of the kmer currently in the window */
+static inline uint64
+kmer_window_bases(const KmerWindow *window)
+{
+    uint64 bases = window->forward;
+
+    if (window->canonical && window->reverse < bases)
+        bases = window->reverse;
+    return bases << (64 - 2 * window->k);
+}
+
+/*
+ * State of generate_kmers. The bases come from a DnaReader, so a long toasted
+ * sequence is streamed in slices and the window carries the last k-1 bases
+ * across slice boundaries.
+ */
+typedef struct {
+    DnaReader reader;   // Sequential reader over the packed DNA sequence
+    KmerWindow window;  // Last k bases read
 } FuncData;  // Define a struct to hold the values you need
 
-//Function to generate the kmers
+static void
+check_kmer_length(int k, int32 input_len)
+{
+    if (k <= 0 || k > input_len) {
+        ereport(ERROR,
+        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+         errmsg("k must be between 1 and the length of the DNA sequence")));
+    }
+    if (k > KMER_MAX_LENGTH) {
+        ereport(ERROR,
+        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+         errmsg("Input array cannot be longer than 32 nucleotides.")));
+    }
+}
 
-PG_FUNCTION_INFO_V1(generate_kmers);
-Datum
-generate_kmers(PG_FUNCTION_ARGS)
+/* True when the executor lets a set returning function fill a tuplestore */
+static bool
+srf_can_materialize(FunctionCallInfo fcinfo)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+    return rsinfo != NULL && IsA(rsinfo, ReturnSetInfo) &&
+           (rsinfo->allowedModes & SFRM_Materialize) &&
+           rsinfo->expectedDesc != NULL;
+}
+
+/*
+ * Materialize mode: all the kmers are written to the tuplestore in one pass,
+ * the kmer is built on the stack since tuplestore_putvalues copies it.
+ */
+static void
+generate_kmers_materialize(FunctionCallInfo fcinfo, DnaReader *reader, KmerWindow *window)
+{
+    ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    Kmer            kmer;
+    Datum           value = KmerPGetDatum(&kmer);
+    bool            isnull = false;
+
+    InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+
+    memset(&kmer, 0, sizeof(Kmer));
+    kmer.length = window->k;
+    for (int32 i = 0; i < reader->length; i++) {
+        kmer_window_push(window, dna_reader_next(reader));
+        if (i >= window->k - 1) {
+            kmer.bases = kmer_window_bases(window);
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, &value, &isnull);
+        }
+    }
+}
+
+/* Common body of generate_kmers and generate_canonical_kmers */
+static Datum
+generate_kmers_internal(FunctionCallInfo fcinfo, bool canonical)
 {
     FuncCallContext     *funcctx;
     int                  k;
-    Dna                  *dna;
-    char                 *str;
-    int                  input_len;
     int                  call_cntr;
     int                  max_calls;
     FuncData             *data;
+
+    /* let the executor pull all the kmers at once when it supports it */
+    if (srf_can_materialize(fcinfo))
+    {
+        DnaReader   reader;
+        KmerWindow  window;
+
+        dna_reader_init(&reader, PG_GETARG_DATUM(0));
+        k = PG_GETARG_INT32(1);
+        check_kmer_length(k, reader.length);
+        kmer_window_init(&window, k, canonical);
+        generate_kmers_materialize(fcinfo, &reader, &window);
+        dna_reader_end(&reader);
+        return (Datum) 0;
+    }
  
     /* bloc executed only on the first call of the function */
     if (SRF_IS_FIRSTCALL())
@@ -40,25 +157,18 @@ generate_kmers(PG_FUNCTION_ARGS)
         funcctx = SRF_FIRSTCALL_INIT();
         oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
         
-        dna  = (Dna *) PG_GETARG_POINTER(0);
         k = PG_GETARG_INT32(1);
 
-        str= dna->sequence;
-        input_len = strlen(str);
-
-
-        if (k <= 0 || k > input_len) {
-            ereport(ERROR,
-            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-             errmsg("k must be between 1 and the length of the DNA sequence")));
-        }
-
         data = palloc(sizeof(FuncData));
+        dna_reader_init(&data->reader, PG_GETARG_DATUM(0));
+        check_kmer_length(k, data->reader.length);
+        kmer_window_init(&data->window, k, canonical);
 
-        data->k = k;
-        data->sequence = str;
+        /* preload the first k-1 bases, every call then adds one */
+        for (int i = 0; i < k - 1; i++)
+            kmer_window_push(&data->window, dna_reader_next(&data->reader));
 
-        funcctx->max_calls = input_len - k + 1;
+        funcctx->max_calls = data->reader.length - k + 1;
         funcctx->user_fctx  =  (void *) data;
 
         MemoryContextSwitchTo(oldcontext);
@@ -69,148 +179,980 @@ generate_kmers(PG_FUNCTION_ARGS)
     call_cntr = funcctx->call_cntr;
     max_calls = funcctx->max_calls;
     data = (FuncData *) funcctx->user_fctx;
-    k = data->k;  
-    str = data->sequence;
+    k = data->window.k;
 
     if (call_cntr < max_calls)    /* do when there is more left to send */
     {
-        Kmer         *kmer;
-        char *substring= palloc((k+1) * sizeof(char));
-        
-        strncpy(substring, str + call_cntr, k);
-        substring[k] = '\0'; 
-
-        /* Convert the substring to a PostgreSQL text type */
-        kmer = kmer_parse(substring);
-        pfree(substring);
+        kmer_window_push(&data->window, dna_reader_next(&data->reader));
 
-        /* Return the result substring */
-        SRF_RETURN_NEXT(funcctx, PointerGetDatum(kmer));
+        /* Return the kmer ending at the base just read */
+        SRF_RETURN_NEXT(funcctx, KmerPGetDatum(kmer_make(kmer_window_bases(&data->window), k)));
     }
     else
     {
         /* No more substrings to return */
+        dna_reader_end(&data->reader);
         SRF_RETURN_DONE(funcctx);
     }
 }
 
-//contains function - checks if a kmer or qkmer contains a certain pattern
+PG_FUNCTION_INFO_V1(generate_kmers);
+Datum
+generate_kmers(PG_FUNCTION_ARGS)
+{
+    return generate_kmers_internal(fcinfo, false);
+}
 
-PG_FUNCTION_INFO_V1(contains);
+/* Same as generate_kmers, each kmer being replaced by its canonical form */
+PG_FUNCTION_INFO_V1(generate_canonical_kmers);
 Datum
-contains(PG_FUNCTION_ARGS)
+generate_canonical_kmers(PG_FUNCTION_ARGS)
 {
-    text *qkmer_text = PG_GETARG_TEXT_PP(0);
-    text *kmer_text = PG_GETARG_TEXT_PP(1);
-
-    /* Convert the PostgreSQL text types to C strings */
-    char *qkmer = text_to_cstring(qkmer_text);
-    char *kmer = text_to_cstring(kmer_text);
-    char regex_pattern[1024] = {0};
-    char *p;
-    int i = 0;
-    regex_t regex;
-    int ret;
-
-    /* Check if pattern and kmer have the same length */
-    if (strlen(qkmer) != strlen(kmer)) {
-        PG_RETURN_BOOL(false);
-    }
-
-    /* Convert 'N' in pattern to a regex pattern [ATGC] */
-    p = qkmer;
-
-    while (*p != '\0' && i < sizeof(regex_pattern) - 1) {
-        if (*p == 'N') {
-            /* Append [ATGC] in place of 'N' */
-            strncat(regex_pattern, "[ATGC]", sizeof(regex_pattern) - strlen(regex_pattern) - 1);
-            i += 6;
-        } 
-        else if (*p == 'R'){
-            /* Append [AG] in place of 'R' */
-            strncat(regex_pattern, "[AG]", sizeof(regex_pattern) - strlen(regex_pattern) - 1);
-            i += 4;
-        }
-        else if (*p == 'Y'){
-            /* Append [CT] in place of 'Y' */
-            strncat(regex_pattern, "[CT]", sizeof(regex_pattern) - strlen(regex_pattern) - 1);
-            i += 4;
-        }
-        else if (*p == 'W'){
-            /* Append [AT] in place of 'W' */
-            strncat(regex_pattern, "[AT]", sizeof(regex_pattern) - strlen(regex_pattern) - 1);
-            i += 4;
-        }
-        else if (*p == 'S'){
-            /* Append [CG] in place of 'S' */
-            strncat(regex_pattern, "[CG]", sizeof(regex_pattern) - strlen(regex_pattern) - 1);
-            i += 4;
-        }
-        else if (*p == 'M'){
-            /* Append [AC] in place of 'M' */
-            strncat(regex_pattern, "[AC]", sizeof(regex_pattern) - strlen(regex_pattern) - 1);
-            i += 4;
-        }
-        else if (*p == 'K'){
-            /* Append [GT] in place of 'K' */
-            strncat(regex_pattern, "[GT]", sizeof(regex_pattern) - strlen(regex_pattern) - 1);
-            i += 4;
-        }
-        else if (*p == 'B'){
-            /* Append [CGT] in place of 'B' */
-            strncat(regex_pattern, "[CGT]", sizeof(regex_pattern) - strlen(regex_pattern) - 1);
-            i += 5;
+    return generate_kmers_internal(fcinfo, true);
+}
+
+/*
+ * Kmers of a read made only of trusted bases: no N, and a (binned) quality
+ * of at least min_quality. The quality runs are walked alongside the bases,
+ * a run below min_quality being skipped as a whole; the window is refilled
+ * after it, like after an N.
+ */
+PG_FUNCTION_INFO_V1(generate_read_kmers);
+Datum
+generate_read_kmers(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    const Read     *read = PG_GETARG_READ_P(0);
+    int             k = PG_GETARG_INT32(1);
+    int             min_quality = PG_GETARG_INT32(2);
+    const uint8    *bases = READ_BASES(read);
+    const uint8    *runs = READ_RUNS(read);
+    const int32    *missing = READ_MISSING(read);
+    int32           next_missing = 0;
+    int32           trusted = 0;    /* trusted bases ending at pos */
+    int32           pos = 0;
+    KmerWindow      window;
+    Kmer            kmer;
+    Datum           value = KmerPGetDatum(&kmer);
+    bool            isnull = false;
+
+    check_kmer_length(k, read->length);
+    kmer_window_init(&window, k, false);
+    InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+
+    memset(&kmer, 0, sizeof(Kmer));
+    kmer.length = k;
+    for (int32 r = 0; r < read->nruns; r++) {
+        int32 end = pos + READ_RUN_LENGTH(runs[r]);
+
+        if (read_qual_values[READ_RUN_BIN(runs[r])] < min_quality) {
+            trusted = 0;
+            pos = end;
+            continue;
         }
-        else if (*p == 'D'){
-            /* Append [AGT] in place of 'D' */
-            strncat(regex_pattern, "[AGT]", sizeof(regex_pattern) - strlen(regex_pattern) - 1);
-            i += 5;
+
+        for (; pos < end; pos++) {
+            kmer_window_push(&window, (bases[pos >> 2] >> (6 - 2 * (pos & 3))) & 3);
+            while (next_missing < read->nmissing && missing[next_missing] < pos)
+                next_missing++;
+            if (next_missing < read->nmissing && missing[next_missing] == pos) {
+                trusted = 0;
+                continue;
+            }
+            if (++trusted >= k) {
+                kmer.bases = kmer_window_bases(&window);
+                tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, &value, &isnull);
+            }
         }
-        else if (*p == 'H'){
-            /* Append [ACT] in place of 'H' */
-            strncat(regex_pattern, "[ACT]", sizeof(regex_pattern) - strlen(regex_pattern) - 1);
-            i += 5;
+    }
+    return (Datum) 0;
+}
+
+/*
+ * Sampling of kmers (minimizers and syncmers). Both pick the kmer or s-mer of
+ * smallest hash in a sliding window, which is maintained with a monotone
+ * deque: the entries kept have increasing hashes, so the front is always the
+ * minimum and every position is pushed and popped at most once.
+ */
+typedef struct {
+    uint64 hash;
+    uint64 bases;       // packed bases of the sampled kmer or s-mer
+    int32 pos;          // 0-based start position in the sequence
+} KmerSample;
+
+typedef struct {
+    KmerSample *items;  // ring buffer of at most capacity entries
+    int capacity;
+    int head;
+    int count;
+} KmerDeque;
+
+static void
+kmer_deque_init(KmerDeque *deque, int capacity)
+{
+    deque->items = palloc(capacity * sizeof(KmerSample));
+    deque->capacity = capacity;
+    deque->head = 0;
+    deque->count = 0;
+}
+
+/* Drops the entries starting before first_pos, then appends a new one */
+static inline void
+kmer_deque_push(KmerDeque *deque, int32 first_pos, uint64 bases, int32 pos)
+{
+    uint64 hash = kmer_mix64(bases);
+    int tail;
+
+    while (deque->count > 0 && deque->items[deque->head].pos < first_pos) {
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+    }
+    /* on equal hashes the leftmost entry stays the minimum */
+    while (deque->count > 0 &&
+           deque->items[(deque->head + deque->count - 1) % deque->capacity].hash > hash)
+        deque->count--;
+
+    tail = (deque->head + deque->count) % deque->capacity;
+    deque->items[tail].hash = hash;
+    deque->items[tail].bases = bases;
+    deque->items[tail].pos = pos;
+    deque->count++;
+}
+
+static inline const KmerSample *
+kmer_deque_min(const KmerDeque *deque)
+{
+    return &deque->items[deque->head];
+}
+
+/* Appends a (kmer, position) row to the tuplestore, positions are 1-based */
+static void
+put_kmer_sample(ReturnSetInfo *rsinfo, uint64 bases, int k, int32 pos)
+{
+    Kmer    kmer;
+    Datum   values[2];
+    bool    nulls[2] = {false, false};
+
+    memset(&kmer, 0, sizeof(Kmer));
+    kmer.bases = bases;
+    kmer.length = k;
+    values[0] = KmerPGetDatum(&kmer);
+    values[1] = Int32GetDatum(pos + 1);
+    tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+}
+
+/*
+ * Minimizers: for every w consecutive kmers, the one of smallest hash. A kmer
+ * that stays the minimum of several windows is returned once. When the
+ * sequence has fewer than w kmers, they all form a single window.
+ */
+PG_FUNCTION_INFO_V1(generate_minimizers);
+Datum
+generate_minimizers(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    int             k = PG_GETARG_INT32(1);
+    int             w = PG_GETARG_INT32(2);
+    bool            canonical = PG_GETARG_BOOL(3);
+    DnaReader       reader;
+    KmerWindow      window;
+    KmerDeque       deque;
+    int32           last_pos = -1;
+
+    if (w <= 0) {
+        ereport(ERROR,
+        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+         errmsg("w must be at least 1")));
+    }
+
+    dna_reader_init(&reader, PG_GETARG_DATUM(0));
+    check_kmer_length(k, reader.length);
+    kmer_window_init(&window, k, canonical);
+    kmer_deque_init(&deque, w);
+    InitMaterializedSRF(fcinfo, 0);
+
+    for (int32 i = 0; i < reader.length; i++) {
+        int32 pos = i - k + 1;
+
+        kmer_window_push(&window, dna_reader_next(&reader));
+        if (pos < 0)
+            continue;
+        kmer_deque_push(&deque, pos - w + 1, kmer_window_bases(&window), pos);
+        if (pos >= w - 1 && kmer_deque_min(&deque)->pos != last_pos) {
+            last_pos = kmer_deque_min(&deque)->pos;
+            put_kmer_sample(rsinfo, kmer_deque_min(&deque)->bases, k, last_pos);
         }
-        else if (*p == 'V'){
-            /* Append [ACG] in place of 'V' */
-            strncat(regex_pattern, "[ACG]", sizeof(regex_pattern) - strlen(regex_pattern) - 1);
-            i += 5;
+    }
+    if (last_pos < 0)
+        put_kmer_sample(rsinfo, kmer_deque_min(&deque)->bases, k, kmer_deque_min(&deque)->pos);
+
+    dna_reader_end(&reader);
+    return (Datum) 0;
+}
+
+/*
+ * Closed syncmers: the kmers whose s-mer of smallest hash is their first or
+ * their last one. Unlike minimizers the choice depends on the kmer alone, so
+ * the same kmer is always sampled whatever its context.
+ */
+PG_FUNCTION_INFO_V1(generate_syncmers);
+Datum
+generate_syncmers(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    int             k = PG_GETARG_INT32(1);
+    int             s = PG_GETARG_INT32(2);
+    bool            canonical = PG_GETARG_BOOL(3);
+    DnaReader       reader;
+    KmerWindow      window;
+    KmerWindow      swindow;
+    KmerDeque       deque;
+
+    dna_reader_init(&reader, PG_GETARG_DATUM(0));
+    check_kmer_length(k, reader.length);
+    if (s <= 0 || s > k) {
+        ereport(ERROR,
+        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+         errmsg("s must be between 1 and k")));
+    }
+    kmer_window_init(&window, k, canonical);
+    kmer_window_init(&swindow, s, canonical);
+    kmer_deque_init(&deque, k - s + 1);
+    InitMaterializedSRF(fcinfo, 0);
+
+    for (int32 i = 0; i < reader.length; i++) {
+        uint8 base = dna_reader_next(&reader);
+        int32 pos = i - k + 1;      // start of the kmer ending here
+        int32 spos = i - s + 1;     // start of the s-mer ending here
+
+        kmer_window_push(&window, base);
+        kmer_window_push(&swindow, base);
+        if (spos < 0)
+            continue;
+        kmer_deque_push(&deque, pos, kmer_window_bases(&swindow), spos);
+        if (pos >= 0 &&
+            (kmer_deque_min(&deque)->pos == pos || kmer_deque_min(&deque)->pos == spos))
+            put_kmer_sample(rsinfo, kmer_window_bases(&window), k, pos);
+    }
+
+    dna_reader_end(&reader);
+    return (Datum) 0;
+}
+
+/*
+ * Counting of kmers. The kmers of a sequence are accumulated in a kmer_table
+ * keyed on their packed bases, so only the distinct kmers become tuples.
+ */
+
+/* Counts the kmers of length k read from reader into table */
+static void
+kmer_table_add_sequence(kmer_table_hash *table, DnaReader *reader, int k, bool canonical)
+{
+    KmerWindow window;
+
+    kmer_window_init(&window, k, canonical);
+    for (int32 i = 0; i < reader->length; i++) {
+        kmer_window_push(&window, dna_reader_next(reader));
+        if (i >= k - 1)
+            kmer_table_add(table, kmer_window_bases(&window), 1);
+    }
+}
+
+/* Returns a (kmer, count) row for every entry of the table */
+static void
+put_kmer_counts(ReturnSetInfo *rsinfo, kmer_table_hash *table, int k)
+{
+    kmer_table_iterator iter;
+    KmerCount  *entry;
+    Kmer        kmer;
+    Datum       values[2];
+    bool        nulls[2] = {false, false};
+
+    memset(&kmer, 0, sizeof(Kmer));
+    kmer.length = k;
+    values[0] = KmerPGetDatum(&kmer);
+
+    kmer_table_start_iterate(table, &iter);
+    while ((entry = kmer_table_iterate(table, &iter)) != NULL) {
+        kmer.bases = entry->bases;
+        values[1] = Int64GetDatum(entry->count);
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+}
+
+/* Number of occurrences of every distinct kmer of a sequence */
+PG_FUNCTION_INFO_V1(kmer_counts);
+Datum
+kmer_counts(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    int             k = PG_GETARG_INT32(1);
+    bool            canonical = PG_GETARG_BOOL(2);
+    DnaReader       reader;
+    kmer_table_hash *table;
+
+    dna_reader_init(&reader, PG_GETARG_DATUM(0));
+    check_kmer_length(k, reader.length);
+    InitMaterializedSRF(fcinfo, 0);
+
+    table = kmer_table_create(CurrentMemoryContext,
+                              kmer_table_initial_size(reader.length - k + 1, k), NULL);
+    kmer_table_add_sequence(table, &reader, k, canonical);
+    put_kmer_counts(rsinfo, table, k);
+
+    kmer_table_destroy(table);
+    dna_reader_end(&reader);
+    return (Datum) 0;
+}
+
+/*
+ * kmer_count_agg: the same counting as kmer_counts over all the rows of a
+ * group. Each worker of a parallel aggregation fills its own table, the
+ * partial tables are shipped to the leader as (bases, count) pairs and merged.
+ */
+typedef struct {
+    int k;                      // Length of the counted kmers
+    bool canonical;             // Count canonical kmers
+    kmer_table_hash *table;     // Counts, allocated in the aggregate context
+} KmerCountState;
+
+/*
+ * The serialized state and the result array are each a single allocation,
+ * limited to MaxAllocSize (1 GB). An element of the array (a kmer_count
+ * composite) takes less than 64 bytes, a serialized pair 16, so the number
+ * of distinct kmers is bounded by the array.
+ */
+#define KMER_COUNT_AGG_MAX_KMERS    ((int64) (MaxAllocSize / 64))
+
+static void
+kmer_count_state_check(const KmerCountState *state)
+{
+    if (state->table->members > KMER_COUNT_AGG_MAX_KMERS) {
+        ereport(ERROR,
+        (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+         errmsg("too many distinct kmers for kmer_count_agg"),
+         errdetail("kmer_count_agg can return at most " INT64_FORMAT " distinct kmers.",
+                   KMER_COUNT_AGG_MAX_KMERS),
+         errhint("Use kmer_counts_query, which has no such limit, or kmer_counts on each sequence.")));
+    }
+}
+
+/* All the rows and partial states must count the same kind of kmers */
+static void
+kmer_count_state_match(const KmerCountState *state, int k, bool canonical)
+{
+    if (state->k != k) {
+        ereport(ERROR,
+        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+         errmsg("k must be the same for all the rows of kmer_count_agg")));
+    }
+    if (state->canonical != canonical) {
+        ereport(ERROR,
+        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+         errmsg("canonical must be the same for all the rows of kmer_count_agg")));
+    }
+}
+
+static KmerCountState *
+kmer_count_state_create(MemoryContext aggcontext, int k, bool canonical, int64 size_hint)
+{
+    KmerCountState *state = MemoryContextAlloc(aggcontext, sizeof(KmerCountState));
+
+    state->k = k;
+    state->canonical = canonical;
+    state->table = kmer_table_create(aggcontext, kmer_table_initial_size(size_hint, k), NULL);
+    return state;
+}
+
+static MemoryContext
+kmer_count_agg_context(FunctionCallInfo fcinfo, const char *name)
+{
+    MemoryContext aggcontext;
+
+    if (!AggCheckCallContext(fcinfo, &aggcontext))
+        elog(ERROR, "%s called in non-aggregate context", name);
+    return aggcontext;
+}
+
+PG_FUNCTION_INFO_V1(kmer_count_agg_transfn);
+Datum
+kmer_count_agg_transfn(PG_FUNCTION_ARGS)
+{
+    MemoryContext   aggcontext = kmer_count_agg_context(fcinfo, "kmer_count_agg_transfn");
+    KmerCountState *state = PG_ARGISNULL(0) ? NULL : (KmerCountState *) PG_GETARG_POINTER(0);
+    int             k;
+    bool            canonical;
+    DnaReader       reader;
+
+    if (PG_ARGISNULL(2)) {
+        ereport(ERROR,
+        (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+         errmsg("k cannot be NULL")));
+    }
+    k = PG_GETARG_INT32(2);
+    canonical = PG_NARGS() > 3 && !PG_ARGISNULL(3) && PG_GETARG_BOOL(3);
+
+    if (k <= 0 || k > KMER_MAX_LENGTH) {
+        ereport(ERROR,
+        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+         errmsg("k must be between 1 and 32")));
+    }
+    if (state != NULL)
+        kmer_count_state_match(state, k, canonical);
+
+    /* NULL sequences and sequences shorter than k have no kmer */
+    if (PG_ARGISNULL(1)) {
+        if (state == NULL)
+            PG_RETURN_NULL();
+        PG_RETURN_POINTER(state);
+    }
+
+    dna_reader_init(&reader, PG_GETARG_DATUM(1));
+    if (state == NULL)
+        state = kmer_count_state_create(aggcontext, k, canonical, reader.length - k + 1);
+    if (reader.length >= k)
+        kmer_table_add_sequence(state->table, &reader, k, canonical);
+    dna_reader_end(&reader);
+    kmer_count_state_check(state);
+
+    PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(kmer_count_agg_combine);
+Datum
+kmer_count_agg_combine(PG_FUNCTION_ARGS)
+{
+    KmerCountState *state1 = PG_ARGISNULL(0) ? NULL : (KmerCountState *) PG_GETARG_POINTER(0);
+    KmerCountState *state2 = PG_ARGISNULL(1) ? NULL : (KmerCountState *) PG_GETARG_POINTER(1);
+    kmer_table_iterator iter;
+    KmerCount      *entry;
+
+    kmer_count_agg_context(fcinfo, "kmer_count_agg_combine");
+    if (state2 == NULL) {
+        if (state1 == NULL)
+            PG_RETURN_NULL();
+        PG_RETURN_POINTER(state1);
+    }
+    /*
+     * Both states live in the aggregate context (the deserialized ones too),
+     * so one can be returned as is and the smaller is merged into the larger.
+     */
+    if (state1 == NULL)
+        PG_RETURN_POINTER(state2);
+    kmer_count_state_match(state1, state2->k, state2->canonical);
+    if (state1->table->members < state2->table->members) {
+        KmerCountState *tmp = state1;
+
+        state1 = state2;
+        state2 = tmp;
+    }
+
+    kmer_table_start_iterate(state2->table, &iter);
+    while ((entry = kmer_table_iterate(state2->table, &iter)) != NULL)
+        kmer_table_add(state1->table, entry->bases, entry->count);
+    kmer_count_state_check(state1);
+
+    PG_RETURN_POINTER(state1);
+}
+
+/* Serialized state: k, canonical, number of kmers, then (bases, count) pairs */
+PG_FUNCTION_INFO_V1(kmer_count_agg_serialize);
+Datum
+kmer_count_agg_serialize(PG_FUNCTION_ARGS)
+{
+    KmerCountState *state = (KmerCountState *) PG_GETARG_POINTER(0);
+    StringInfoData  buf;
+    kmer_table_iterator iter;
+    KmerCount      *entry;
+
+    kmer_count_agg_context(fcinfo, "kmer_count_agg_serialize");
+
+    pq_begintypsend(&buf);
+    enlargeStringInfo(&buf, 16 + state->table->members * 16);
+    pq_sendint32(&buf, state->k);
+    pq_sendbyte(&buf, state->canonical);
+    pq_sendint64(&buf, state->table->members);
+
+    kmer_table_start_iterate(state->table, &iter);
+    while ((entry = kmer_table_iterate(state->table, &iter)) != NULL) {
+        pq_sendint64(&buf, entry->bases);
+        pq_sendint64(&buf, entry->count);
+    }
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+PG_FUNCTION_INFO_V1(kmer_count_agg_deserialize);
+Datum
+kmer_count_agg_deserialize(PG_FUNCTION_ARGS)
+{
+    MemoryContext   aggcontext = kmer_count_agg_context(fcinfo, "kmer_count_agg_deserialize");
+    bytea          *sstate = PG_GETARG_BYTEA_PP(0);
+    StringInfoData  buf;
+    KmerCountState *state;
+    int             k;
+    bool            canonical;
+    int64           n;
+
+    initStringInfo(&buf);
+    appendBinaryStringInfo(&buf, VARDATA_ANY(sstate), VARSIZE_ANY_EXHDR(sstate));
+    k = pq_getmsgint(&buf, 4);
+    canonical = pq_getmsgbyte(&buf) != 0;
+    n = pq_getmsgint64(&buf);
+
+    state = kmer_count_state_create(aggcontext, k, canonical, n);
+    for (int64 i = 0; i < n; i++) {
+        uint64 bases = pq_getmsgint64(&buf);
+
+        kmer_table_add(state->table, bases, pq_getmsgint64(&buf));
+    }
+    pq_getmsgend(&buf);
+    pfree(buf.data);
+
+    PG_RETURN_POINTER(state);
+}
+
+/* Array of (kmer, count) composite values, one per distinct kmer */
+PG_FUNCTION_INFO_V1(kmer_count_agg_finalfn);
+Datum
+kmer_count_agg_finalfn(PG_FUNCTION_ARGS)
+{
+    KmerCountState *state;
+    Oid             elemtype;
+    TupleDesc       tupdesc;
+    Datum          *elems;
+    int             nelems = 0;
+    int16           typlen;
+    bool            typbyval;
+    char            typalign;
+    kmer_table_iterator iter;
+    KmerCount      *entry;
+
+    kmer_count_agg_context(fcinfo, "kmer_count_agg_finalfn");
+    if (PG_ARGISNULL(0))
+        PG_RETURN_NULL();
+    state = (KmerCountState *) PG_GETARG_POINTER(0);
+
+    elemtype = get_element_type(get_fn_expr_rettype(fcinfo->flinfo));
+    if (!OidIsValid(elemtype))
+        elog(ERROR, "could not determine the element type of kmer_count_agg");
+    tupdesc = lookup_rowtype_tupdesc_copy(elemtype, -1);
+    get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+
+    elems = palloc(Max(state->table->members, 1) * sizeof(Datum));
+    kmer_table_start_iterate(state->table, &iter);
+    while ((entry = kmer_table_iterate(state->table, &iter)) != NULL) {
+        Datum   values[2];
+        bool    nulls[2] = {false, false};
+
+        values[0] = KmerPGetDatum(kmer_make(entry->bases, state->k));
+        values[1] = Int64GetDatum(entry->count);
+        elems[nelems++] = HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls));
+    }
+
+    PG_RETURN_ARRAYTYPE_P(construct_array(elems, nelems, elemtype, typlen, typbyval, typalign));
+}
+
+/*
+ * kmer_counts_query: the counts of kmer_count_agg over the dna values returned
+ * by a query, without its limit on the number of distinct kmers. The query is
+ * run through SPI with a receiver that counts the kmers of every row as the
+ * executor produces it (the query itself can use a parallel plan), and the
+ * counts are returned in a tuplestore, which spills to disk past work_mem.
+ */
+typedef struct {
+    DestReceiver pub;
+    Oid dna_type;               // Type of the column of the query
+    int k;                      // Length of the counted kmers
+    bool canonical;             // Count canonical kmers
+    kmer_table_hash *table;     // Counts of all the rows
+    MemoryContext row_context;  // Reset after every row
+} KmerCountReceiver;
+
+static void
+kmer_count_receiver_startup(DestReceiver *self, int operation, TupleDesc typeinfo)
+{
+    KmerCountReceiver *receiver = (KmerCountReceiver *) self;
+
+    if (typeinfo->natts != 1 || TupleDescAttr(typeinfo, 0)->atttypid != receiver->dna_type) {
+        ereport(ERROR,
+        (errcode(ERRCODE_DATATYPE_MISMATCH),
+         errmsg("query of kmer_counts_query must return a single dna column")));
+    }
+}
+
+static bool
+kmer_count_receiver_receive(TupleTableSlot *slot, DestReceiver *self)
+{
+    KmerCountReceiver *receiver = (KmerCountReceiver *) self;
+    MemoryContext   oldcontext;
+    DnaReader       reader;
+    Datum           value;
+    bool            isnull;
+
+    value = slot_getattr(slot, 1, &isnull);
+    if (isnull)
+        return true;
+
+    oldcontext = MemoryContextSwitchTo(receiver->row_context);
+    dna_reader_init(&reader, value);
+    if (reader.length >= receiver->k)
+        kmer_table_add_sequence(receiver->table, &reader, receiver->k, receiver->canonical);
+    dna_reader_end(&reader);
+    MemoryContextSwitchTo(oldcontext);
+    MemoryContextReset(receiver->row_context);
+    return true;
+}
+
+static void
+kmer_count_receiver_shutdown(DestReceiver *self)
+{
+}
+
+/* The dna type is looked up next to the kmer type of the result */
+static Oid
+kmer_counts_dna_type(Oid kmer_type)
+{
+    HeapTuple   tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(kmer_type));
+    Oid         namespace;
+
+    if (!HeapTupleIsValid(tuple))
+        elog(ERROR, "cache lookup failed for type %u", kmer_type);
+    namespace = ((Form_pg_type) GETSTRUCT(tuple))->typnamespace;
+    ReleaseSysCache(tuple);
+    return GetSysCacheOid2(TYPENAMENSP, Anum_pg_type_oid,
+                           CStringGetDatum("dna"), ObjectIdGetDatum(namespace));
+}
+
+PG_FUNCTION_INFO_V1(kmer_counts_query);
+Datum
+kmer_counts_query(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    char           *query = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    int             k = PG_GETARG_INT32(1);
+    bool            canonical = PG_GETARG_BOOL(2);
+    KmerCountReceiver receiver;
+    SPIExecuteOptions options;
+    int             ret;
+
+    if (k <= 0 || k > KMER_MAX_LENGTH) {
+        ereport(ERROR,
+        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+         errmsg("k must be between 1 and 32")));
+    }
+    InitMaterializedSRF(fcinfo, 0);
+
+    memset(&receiver, 0, sizeof(receiver));
+    receiver.pub.receiveSlot = kmer_count_receiver_receive;
+    receiver.pub.rStartup = kmer_count_receiver_startup;
+    receiver.pub.rShutdown = kmer_count_receiver_shutdown;
+    receiver.pub.rDestroy = kmer_count_receiver_shutdown;
+    receiver.pub.mydest = DestNone;
+    receiver.dna_type = kmer_counts_dna_type(TupleDescAttr(rsinfo->setDesc, 0)->atttypid);
+    receiver.k = k;
+    receiver.canonical = canonical;
+    receiver.table = kmer_table_create(CurrentMemoryContext,
+                                       kmer_table_initial_size(PG_INT64_MAX, k), NULL);
+    receiver.row_context = AllocSetContextCreate(CurrentMemoryContext,
+                                                 "kmer_counts_query row",
+                                                 ALLOCSET_DEFAULT_SIZES);
+
+    /* read only: the query cannot modify the database */
+    memset(&options, 0, sizeof(options));
+    options.read_only = true;
+    options.dest = &receiver.pub;
+
+    SPI_connect();
+    ret = SPI_execute_extended(query, &options);
+    if (ret < 0)
+        elog(ERROR, "SPI_execute_extended failed: %s", SPI_result_code_string(ret));
+    SPI_finish();
+
+    put_kmer_counts(rsinfo, receiver.table, k);
+
+    kmer_table_destroy(receiver.table);
+    MemoryContextDelete(receiver.row_context);
+    return (Datum) 0;
+}
+
+//contains function - checks if a kmer or qkmer contains a certain pattern
+
+/*
+ * Spreads the 16 2-bit nucleotide codes of a 32-bit half of a kmer into one
+ * nibble each, and turns every code into the matching one-hot IUPAC mask
+ * (A=1, C=2, G=4, T=8) so it can be compared with a qkmer with bit operations.
+ */
+static inline uint64
+kmer_onehot_masks(uint32 half)
+{
+    const uint64 ones = UINT64CONST(0x1111111111111111);
+    uint64 x = half;
+    uint64 lo, hi;
+
+    x = (x | (x << 16)) & UINT64CONST(0x0000FFFF0000FFFF);
+    x = (x | (x << 8)) & UINT64CONST(0x00FF00FF00FF00FF);
+    x = (x | (x << 4)) & UINT64CONST(0x0F0F0F0F0F0F0F0F);
+    x = (x | (x << 2)) & UINT64CONST(0x3333333333333333);
+
+    lo = x & ones;
+    hi = (x >> 1) & ones;
+    return (~hi & ~lo & ones) | ((~hi & lo & ones) << 1) |
+           ((hi & ~lo & ones) << 2) | ((hi & lo) << 3);
+}
+
+/* Nibbles of the positions [16 * word, length) of a qkmer */
+static inline uint64
+qkmer_valid_nibbles(int32 length, int word)
+{
+    int n = Min(Max(length - 16 * word, 0), 16);
+
+    return n == 0 ? 0 : ~UINT64CONST(0) << (64 - 4 * n);
+}
+
+/* True if every nucleotide of kmer is accepted by the matching qkmer position */
+bool
+qkmer_matches(const Qkmer* qkmer, const Kmer* kmer)
+{
+    uint64 miss;
+
+    miss = (kmer_onehot_masks((uint32) (kmer->bases >> 32)) & ~qkmer->masks[0] &
+            qkmer_valid_nibbles(qkmer->length, 0)) |
+           (kmer_onehot_masks((uint32) kmer->bases) & ~qkmer->masks[1] &
+            qkmer_valid_nibbles(qkmer->length, 1));
+
+    return (qkmer->length == kmer->length) & (miss == 0);
+}
+
+/*
+ * Matcher compiled from a qkmer. contains() keeps the last one it compiled in
+ * fn_extra, so a constant pattern is compiled once per query instead of once
+ * per row.
+ */
+typedef struct QkmerMatcher {
+    uint64 masks[2];        /* qkmer the matcher was compiled from */
+    int32  length;
+    bool   exact;           /* no degenerate position: plain kmer equality */
+    uint64 bases;           /* packed kmer of an exact pattern */
+    uint64 forbidden[2];    /* nucleotides rejected at each position */
+} QkmerMatcher;
+
+/* Backend-local statistics of the matcher cache */
+static int64 qkmer_cache_hits = 0;
+static int64 qkmer_cache_misses = 0;
+
+static void
+qkmer_matcher_compile(QkmerMatcher *matcher, const Qkmer *qkmer)
+{
+    matcher->masks[0] = qkmer->masks[0];
+    matcher->masks[1] = qkmer->masks[1];
+    matcher->length = qkmer->length;
+    matcher->exact = true;
+    matcher->bases = 0;
+    for (int i = 0; i < qkmer->length; i++) {
+        uint8 mask = QKMER_GET_MASK(qkmer, i);
+
+        /* single nucleotide masks are powers of two, their log2 is the code */
+        if (mask & (mask - 1)) {
+            matcher->exact = false;
+            break;
         }
-        else {
-            /* Append the character as-is */
-            regex_pattern[i++] = *p;
+        matcher->bases |= (uint64) pg_rightmost_one_pos32(mask) << (62 - 2 * i);
+    }
+    matcher->forbidden[0] = ~qkmer->masks[0] & qkmer_valid_nibbles(qkmer->length, 0);
+    matcher->forbidden[1] = ~qkmer->masks[1] & qkmer_valid_nibbles(qkmer->length, 1);
+}
+
+static inline bool
+qkmer_matcher_matches(const QkmerMatcher *matcher, const Kmer *kmer)
+{
+    if (matcher->exact)
+        return matcher->length == kmer->length && matcher->bases == kmer->bases;
+
+    return (matcher->length == kmer->length) &
+           (((kmer_onehot_masks((uint32) (kmer->bases >> 32)) & matcher->forbidden[0]) |
+             (kmer_onehot_masks((uint32) kmer->bases) & matcher->forbidden[1])) == 0);
+}
+
+/* Matcher of qkmer, compiled again only when the pattern changes between calls */
+static const QkmerMatcher *
+qkmer_cached_matcher(FunctionCallInfo fcinfo, const Qkmer *qkmer)
+{
+    QkmerMatcher *matcher = (QkmerMatcher *) fcinfo->flinfo->fn_extra;
+
+    if (matcher != NULL &&
+        matcher->masks[0] == qkmer->masks[0] &&
+        matcher->masks[1] == qkmer->masks[1] &&
+        matcher->length == qkmer->length) {
+        qkmer_cache_hits++;
+    }
+    else {
+        if (matcher == NULL) {
+            matcher = MemoryContextAlloc(fcinfo->flinfo->fn_mcxt, sizeof(QkmerMatcher));
+            fcinfo->flinfo->fn_extra = matcher;
         }
-        p++;
+        qkmer_matcher_compile(matcher, qkmer);
+        qkmer_cache_misses++;
     }
+    return matcher;
+}
 
-    /* Compile the regular expression */
-    ret = regcomp(&regex, regex_pattern, REG_EXTENDED);
-    if (ret) {
-        ereport(ERROR, (errmsg("Could not compile regex")));
+PG_FUNCTION_INFO_V1(contains);
+Datum
+contains(PG_FUNCTION_ARGS)
+{
+    const Qkmer *qkmer = PG_GETARG_QKMER_P(0);
+    const Kmer *kmer = PG_GETARG_KMER_P(1);
+
+    PG_RETURN_BOOL(qkmer_matcher_matches(qkmer_cached_matcher(fcinfo, qkmer), kmer));
+}
+
+/* Commutator of contains, so that an index on kmer can serve qkmer @> kmer */
+PG_FUNCTION_INFO_V1(contained_by);
+Datum
+contained_by(PG_FUNCTION_ARGS)
+{
+    const Kmer *kmer = PG_GETARG_KMER_P(0);
+    const Qkmer *qkmer = PG_GETARG_QKMER_P(1);
+
+    PG_RETURN_BOOL(qkmer_matcher_matches(qkmer_cached_matcher(fcinfo, qkmer), kmer));
+}
+
+/* Hits and misses of the contains() matcher cache in this backend */
+PG_FUNCTION_INFO_V1(qkmer_cache_stats);
+Datum
+qkmer_cache_stats(PG_FUNCTION_ARGS)
+{
+    TupleDesc   tupdesc;
+    Datum       values[3];
+    bool        nulls[3] = {false, false, false};
+    int64       total = qkmer_cache_hits + qkmer_cache_misses;
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
+    values[0] = Int64GetDatum(qkmer_cache_hits);
+    values[1] = Int64GetDatum(qkmer_cache_misses);
+    if (total > 0)
+        values[2] = Float8GetDatum((double) qkmer_cache_hits / total);
+    else
+        nulls[2] = true;
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+PG_FUNCTION_INFO_V1(qkmer_cache_reset);
+Datum
+qkmer_cache_reset(PG_FUNCTION_ARGS)
+{
+    qkmer_cache_hits = 0;
+    qkmer_cache_misses = 0;
+    PG_RETURN_VOID();
+}
+
+/*
+ * Substring tests of a dna: dna @> kmer and dna @> dna. A pattern of at most
+ * 32 bases is compared with the sliding window of the sequence, which is
+ * streamed. A longer one is located by its first 32 bases and the rest is
+ * compared base by base.
+ */
+
+/* True if the sequence read by reader has bases (left-aligned) among its kmers of length k */
+static bool
+dna_reader_find(DnaReader *reader, uint64 bases, int k)
+{
+    KmerWindow window;
+
+    kmer_window_init(&window, k, false);
+    while (reader->pos < reader->length) {
+        kmer_window_push(&window, dna_reader_next(reader));
+        if (reader->pos >= k && kmer_window_bases(&window) == bases)
+            return true;
     }
+    return false;
+}
 
-    /* Execute the regex match */
-    ret = regexec(&regex, kmer, 0, NULL, 0);
-    regfree(&regex);
+PG_FUNCTION_INFO_V1(dna_contains_kmer);
+Datum
+dna_contains_kmer(PG_FUNCTION_ARGS)
+{
+    const Kmer *kmer = PG_GETARG_KMER_P(1);
+    DnaReader reader;
+    bool found;
+
+    dna_reader_init(&reader, PG_GETARG_DATUM(0));
+    found = dna_reader_find(&reader, kmer->bases, kmer->length);
+    dna_reader_end(&reader);
+
+    PG_RETURN_BOOL(found);
+}
+
+PG_FUNCTION_INFO_V1(dna_contains_dna);
+Datum
+dna_contains_dna(PG_FUNCTION_ARGS)
+{
+    const Dna *pattern = PG_GETARG_DNA_P(1);
+    int32 head_len = Min(pattern->length, KMER_MAX_LENGTH);
+    uint64 head = 0;
+    const Dna *dna;
+    KmerWindow window;
+
+    for (int i = 0; i < DNA_PACKED_SIZE(head_len); i++)
+        head |= (uint64) pattern->data[i] << (56 - 8 * i);
+    head &= KMER_PREFIX_MASK(head_len);
 
-    /* Return true if it matches, false otherwise */
-    PG_RETURN_BOOL(ret == 0);
+    if (pattern->length <= KMER_MAX_LENGTH) {
+        DnaReader reader;
+        bool found;
+
+        dna_reader_init(&reader, PG_GETARG_DATUM(0));
+        found = dna_reader_find(&reader, head, head_len);
+        dna_reader_end(&reader);
+        PG_RETURN_BOOL(found);
+    }
+
+    dna = PG_GETARG_DNA_P(0);
+    kmer_window_init(&window, head_len, false);
+    for (int32 i = 0; i + pattern->length - head_len < dna->length; i++) {
+        int32 start = i - head_len + 1;
+        int32 j;
+
+        kmer_window_push(&window, DNA_GET_BASE(dna, i));
+        if (start < 0 || kmer_window_bases(&window) != head)
+            continue;
+
+        for (j = head_len; j < pattern->length; j++)
+            if (DNA_GET_BASE(dna, start + j) != DNA_GET_BASE(pattern, j))
+                break;
+        if (j == pattern->length)
+            PG_RETURN_BOOL(true);
+    }
+    PG_RETURN_BOOL(false);
 }
 
 PG_FUNCTION_INFO_V1(kmer_cast_to_dna);
 Datum
 kmer_cast_to_dna(PG_FUNCTION_ARGS)
 {
-  const Kmer *kmer  = (Kmer *) PG_GETARG_POINTER(0); 
-  Dna *out = dna_parse(kmer_to_str(kmer));
-  PG_RETURN_TEXT_P(out);
+  const Kmer *kmer  = PG_GETARG_KMER_P(0);
+  Dna *out = dna_alloc(kmer->length);
+
+  /* Both types pack the first nucleotide in the most significant bits */
+  for (int i = 0; i < DNA_PACKED_SIZE(kmer->length); i++)
+    out->data[i] = (uint8) (kmer->bases >> (56 - 8 * i));
+  PG_RETURN_POINTER(out);
 }
 
 PG_FUNCTION_INFO_V1(dna_cast_to_kmer);
 Datum
 dna_cast_to_kmer(PG_FUNCTION_ARGS)
 {
-  const Dna *dna  = (Dna *) PG_GETARG_POINTER(0); 
-  Kmer *out = kmer_parse(dna_to_str(dna));
-  PG_RETURN_TEXT_P(out);
+  const Dna *dna  = PG_GETARG_DNA_P(0);
+  uint64 bases = 0;
+
+  if (dna->length > KMER_MAX_LENGTH)
+    ereport(ERROR, (errmsg("Input array cannot be longer than 32 nucleotides.")));
+
+  for (int i = 0; i < DNA_PACKED_SIZE(dna->length); i++)
+    bases |= (uint64) dna->data[i] << (56 - 8 * i);
+  PG_RETURN_KMER_P(kmer_make(bases, dna->length));
 }
@@ -8,15 +8,20 @@
 #include "catalog/pg_type.h" //Data types for the index
 #include "utils/datum.h" //Datum operations index
 
-#include "utils/pg_locale.h"
+#include "port/pg_bitutils.h"
+#include "port/pg_bswap.h"
 #include "utils/varlena.h"
 
 #include "varatt.h" 
 #include "utils/builtins.h"
+#include "utils/sortsupport.h"
+#include "executor/executor.h"
 #include "libpq/pqformat.h"
 
 
+#include "dna.h"
 #include "kmer.h"
+#include "qkmer.h"
 
 
 /**********************************************************/
@@ -24,36 +29,55 @@
 /*KMER CREATION*/
 
 
+/*Kmer from already packed bases (internal)*/
+Kmer*
+kmer_make(uint64 bases, int32 length)
+{
+  Kmer *kmer = (Kmer *) palloc0(sizeof(Kmer));
+
+  kmer->bases = bases & KMER_PREFIX_MASK(length);
+  kmer->length = length;
+  return kmer;
+}
+
 /*Kmer creation from str (internal) (with checks)*/
 Kmer*
 kmer_parse(const char* str)
 {
-
-  
-  
-  int32 len = strlen(str);
-  Kmer *kmer;
+  int32 len;
+  uint64 bases = 0;
 
   validate_dna_sequence(str);
 
-  if(strlen(str) > 32){
+  len = strlen(str);
+  if(len > KMER_MAX_LENGTH){
         ereport(ERROR, (errmsg("Input array cannot be longer than 32 nucleotides.")));
     }
-  
-  kmer = (Kmer*) palloc(VARHDRSZ + len  + 1 );
-  SET_VARSIZE(kmer, VARHDRSZ +  len  + 1 );
-  memcpy(kmer->sequence, str, len + 1);
 
-  return kmer;
-}
+  for (int i = 0; i < len; i++)
+    bases |= (uint64) NUCLEOTIDE_CODE(str[i]) << (62 - 2 * i);
 
+  return kmer_make(bases, len);
+}
 
+/*Writes the nucleotides of a kmer into buf (at least length + 1 bytes) and returns its length*/
+static int
+kmer_unpack(const Kmer* kmer, char *buf)
+{
+  for (int i = 0; i < kmer->length; i++)
+    buf[i] = dna_nucleotides[KMER_GET_BASE(kmer, i)];
+  buf[kmer->length] = '\0';
+  return kmer->length;
+}
 
 /*Kmer to str (internal)*/
 char *
 kmer_to_str(const Kmer* kmer)
 {
-  return pstrdup(kmer->sequence);
+  char *str = palloc(kmer->length + 1);
+
+  kmer_unpack(kmer, str);
+  return str;
 }
 
 /********************************************************/
@@ -66,7 +90,7 @@ Datum
 kmer_in(PG_FUNCTION_ARGS)
 {
   const char * str = PG_GETARG_CSTRING(0);
-  PG_RETURN_POINTER(kmer_parse(str));
+  PG_RETURN_KMER_P(kmer_parse(str));
   
 }
 
@@ -75,7 +99,7 @@ PG_FUNCTION_INFO_V1(kmer_out);
 Datum
 kmer_out(PG_FUNCTION_ARGS)
 {
-  const Kmer *kmer = (Kmer *) PG_GETARG_POINTER(0);
+  const Kmer *kmer = PG_GETARG_KMER_P(0);
   PG_RETURN_CSTRING(kmer_to_str(kmer));
 }
 
@@ -86,12 +110,21 @@ Datum
 kmer_recv(PG_FUNCTION_ARGS)
 {
     StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
-    int32 len = pq_getmsgint(buf, sizeof(int32));
-    Kmer *kmer = (Kmer *) palloc(VARHDRSZ + len + 1); 
-    SET_VARSIZE(kmer, VARHDRSZ + len + 1);  
-    pq_copymsgbytes(buf, kmer->sequence, len);
-    kmer->sequence[len] = '\0';
-    PG_RETURN_POINTER(kmer);
+    int32 len;
+    uint8 packed[sizeof(uint64)] = {0};
+    uint64 bases;
+
+    dna_recv_version(buf);
+    len = pq_getmsgbyte(buf);
+    if (len == 0)
+        ereport(ERROR, (errmsg("Input array cannot be NULL or empty")));
+    if (len > KMER_MAX_LENGTH)
+        ereport(ERROR, (errmsg("Input array cannot be longer than 32 nucleotides.")));
+
+    /* the packed bytes are the leading bytes of the big-endian bases */
+    dna_recv_bases(buf, len, packed);
+    memcpy(&bases, packed, sizeof(bases));
+    PG_RETURN_KMER_P(kmer_make(pg_ntoh64(bases), len));
 }
 
 
@@ -101,13 +134,13 @@ PG_FUNCTION_INFO_V1(kmer_send);
 Datum
 kmer_send(PG_FUNCTION_ARGS)
 {
-    Kmer *kmer = (Kmer *) PG_GETARG_POINTER(0);
-    int32 len = VARSIZE(kmer) - VARHDRSZ; 
+    Kmer *kmer = PG_GETARG_KMER_P(0);
+    uint64 bases = pg_hton64(kmer->bases);
     StringInfoData buf;
     pq_begintypsend(&buf);
-    pq_sendint32(&buf, len);
-    pq_sendbytes(&buf, kmer->sequence, len);
-    PG_FREE_IF_COPY(kmer, 0);
+    pq_sendbyte(&buf, DNA_BINARY_VERSION);
+    pq_sendbyte(&buf, kmer->length);
+    pq_sendbytes(&buf, (char *) &bases, DNA_PACKED_SIZE(kmer->length));
     PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
 }
 
@@ -121,7 +154,7 @@ kmer_cast_from_text(PG_FUNCTION_ARGS)
   text *txt = PG_GETARG_TEXT_P(0);
   char *str = DatumGetCString(DirectFunctionCall1(textout,
                PointerGetDatum(txt))); /*Postgre text to C string*/
-  PG_RETURN_POINTER(kmer_parse(str));
+  PG_RETURN_KMER_P(kmer_parse(str));
 }
 
 /* Kmer -> text (external)*/
@@ -129,7 +162,7 @@ PG_FUNCTION_INFO_V1(kmer_cast_to_text);
 Datum
 kmer_cast_to_text(PG_FUNCTION_ARGS)
 {
-  const Kmer *kmer  = (Kmer *) PG_GETARG_POINTER(0); 
+  const Kmer *kmer  = PG_GETARG_KMER_P(0);
   text *out = (text *)DirectFunctionCall1(textin,
             PointerGetDatum(kmer_to_str(kmer)));
   PG_RETURN_TEXT_P(out);
@@ -144,8 +177,7 @@ PG_FUNCTION_INFO_V1(kmer_size);
 Datum
 kmer_size(PG_FUNCTION_ARGS)
 {
-  const Kmer *kmer  = (Kmer *) PG_GETARG_POINTER(0);
-  PG_RETURN_INT32(kmer->size); 
+  PG_RETURN_INT32(sizeof(Kmer));
 }
 
 /*Length*/
@@ -153,8 +185,8 @@ PG_FUNCTION_INFO_V1(kmer_len);
 Datum
 kmer_len(PG_FUNCTION_ARGS)
 {
-  const Kmer *kmer  = (Kmer *) PG_GETARG_POINTER(0);
-  PG_RETURN_INT32(strlen(kmer->sequence)); 
+  const Kmer *kmer  = PG_GETARG_KMER_P(0);
+  PG_RETURN_INT32(kmer->length);
 }
 
 /*Equals function*/
@@ -163,18 +195,10 @@ PG_FUNCTION_INFO_V1(kmer_equals);
 Datum
 kmer_equals(PG_FUNCTION_ARGS)
 {
-    // Retrieve arguments as C-strings (text type in PostgreSQL)
-    text *a_text = PG_GETARG_TEXT_PP(0);
-    text *b_text = PG_GETARG_TEXT_PP(1);
+    const Kmer *a = PG_GETARG_KMER_P(0);
+    const Kmer *b = PG_GETARG_KMER_P(1);
 
-    // Convert `text` to C-strings for comparison
-    const char *a = text_to_cstring(a_text);
-    const char *b = text_to_cstring(b_text);
-
-    // Assume `FPeq` is your custom function that compares two kmers.
-    bool result = (strcmp(a, b) == 0);
-
-    PG_RETURN_BOOL(result);
+    PG_RETURN_BOOL(a->bases == b->bases && a->length == b->length);
 }
 
 /*Starts with function*/
@@ -182,44 +206,247 @@ PG_FUNCTION_INFO_V1(starts_with);
 Datum
 starts_with(PG_FUNCTION_ARGS)
 {
-    // Retrieve the prefix and kmer arguments as text
-    text *prefix_text = PG_GETARG_TEXT_PP(0);
-    text *kmer_text = PG_GETARG_TEXT_PP(1);
-    bool result;
-
-    // Convert the `text` values to C-strings for easier manipulation
-    const char *prefix = text_to_cstring(prefix_text);
-    const char *kmer = text_to_cstring(kmer_text);
+    const Kmer *prefix = PG_GETARG_KMER_P(0);
+    const Kmer *kmer = PG_GETARG_KMER_P(1);
 
     // Check if prefix lenght is greater than the kmer length 
-    if (strlen(prefix) > strlen(kmer)) {
+    if (prefix->length > kmer->length) {
         PG_RETURN_BOOL(false);
     }
 
     // Check if `kmer` starts with `prefix`
-    result = (strncmp(kmer, prefix, strlen(prefix)) == 0);
+    PG_RETURN_BOOL(((kmer->bases ^ prefix->bases) &
+                    KMER_PREFIX_MASK(prefix->length)) == 0);
+}
 
-    PG_RETURN_BOOL(result);
+/*Starts with, kmer first (function of the ^@ operator)*/
+PG_FUNCTION_INFO_V1(kmer_starts_with);
+Datum
+kmer_starts_with(PG_FUNCTION_ARGS)
+{
+    const Kmer *kmer = PG_GETARG_KMER_P(0);
+    const Kmer *prefix = PG_GETARG_KMER_P(1);
+
+    PG_RETURN_BOOL(prefix->length <= kmer->length &&
+                   ((kmer->bases ^ prefix->bases) &
+                    KMER_PREFIX_MASK(prefix->length)) == 0);
+}
+
+/*Hamming distance, operator <-> */
+PG_FUNCTION_INFO_V1(hamming_distance);
+Datum
+hamming_distance(PG_FUNCTION_ARGS)
+{
+    const Kmer *a = PG_GETARG_KMER_P(0);
+    const Kmer *b = PG_GETARG_KMER_P(1);
+
+    PG_RETURN_INT32(kmer_hamming(a, b));
+}
+
+/*
+ * Fields of a kmer_budget (query kmer, mismatches integer) composite value,
+ * false when one of them is null
+ */
+bool
+kmer_budget_parse(Datum budget, const Kmer **query, int32 *mismatches)
+{
+    HeapTupleHeader tuple = DatumGetHeapTupleHeader(budget);
+    bool        isnull;
+    Datum       value;
+
+    value = GetAttributeByNum(tuple, 1, &isnull);
+    if (isnull)
+        return false;
+    *query = DatumGetKmerP(value);
+
+    value = GetAttributeByNum(tuple, 2, &isnull);
+    if (isnull)
+        return false;
+    *mismatches = DatumGetInt32(value);
+    return true;
+}
+
+/*Within a number of mismatches of a query, operator %> */
+PG_FUNCTION_INFO_V1(within_mismatches);
+Datum
+within_mismatches(PG_FUNCTION_ARGS)
+{
+    const Kmer *kmer = PG_GETARG_KMER_P(0);
+    const Kmer *query;
+    int32       mismatches;
+
+    if (!kmer_budget_parse(PG_GETARG_DATUM(1), &query, &mismatches))
+        PG_RETURN_BOOL(false);
+
+    PG_RETURN_BOOL(kmer_hamming(kmer, query) <= mismatches);
+}
+
+/*
+ * Reverse complement of packed bases (internal): the word is complemented,
+ * its 2-bit groups are reversed, and the bases that were padding are shifted
+ * back out.
+ */
+uint64
+kmer_reverse_complement(uint64 bases, int32 length)
+{
+    uint64 rc = ~bases;
+
+    rc = ((rc >> 2) & UINT64CONST(0x3333333333333333)) |
+         ((rc & UINT64CONST(0x3333333333333333)) << 2);
+    rc = ((rc >> 4) & UINT64CONST(0x0F0F0F0F0F0F0F0F)) |
+         ((rc & UINT64CONST(0x0F0F0F0F0F0F0F0F)) << 4);
+    rc = pg_bswap64(rc);
+
+    return length == 0 ? 0 : rc << (64 - 2 * length);
+}
+
+/*Canonical form: the smallest of the kmer and its reverse complement*/
+PG_FUNCTION_INFO_V1(canonical);
+Datum
+canonical(PG_FUNCTION_ARGS)
+{
+    const Kmer *kmer = PG_GETARG_KMER_P(0);
+    uint64 rc = kmer_reverse_complement(kmer->bases, kmer->length);
+
+    PG_RETURN_KMER_P(kmer_make(Min(kmer->bases, rc), kmer->length));
+}
+
+
+
+/***********************ORDERING SUPPORT***********************/
+
+/*
+ * Lexicographic order of the sequences: the packed words are compared first
+ * (the unused low bits are zero, i.e. 'A'), and on equal words the shorter
+ * kmer, a prefix of the other, comes first.
+ */
+static inline int
+kmer_compare(const Kmer *a, const Kmer *b)
+{
+    if (a->bases != b->bases)
+        return a->bases < b->bases ? -1 : 1;
+    return (a->length > b->length) - (a->length < b->length);
+}
+
+PG_FUNCTION_INFO_V1(kmer_cmp);
+Datum
+kmer_cmp(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_INT32(kmer_compare(PG_GETARG_KMER_P(0), PG_GETARG_KMER_P(1)));
+}
+
+PG_FUNCTION_INFO_V1(kmer_lt);
+Datum
+kmer_lt(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(kmer_compare(PG_GETARG_KMER_P(0), PG_GETARG_KMER_P(1)) < 0);
+}
+
+PG_FUNCTION_INFO_V1(kmer_le);
+Datum
+kmer_le(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(kmer_compare(PG_GETARG_KMER_P(0), PG_GETARG_KMER_P(1)) <= 0);
+}
+
+PG_FUNCTION_INFO_V1(kmer_gt);
+Datum
+kmer_gt(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(kmer_compare(PG_GETARG_KMER_P(0), PG_GETARG_KMER_P(1)) > 0);
+}
+
+PG_FUNCTION_INFO_V1(kmer_ge);
+Datum
+kmer_ge(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(kmer_compare(PG_GETARG_KMER_P(0), PG_GETARG_KMER_P(1)) >= 0);
+}
+
+PG_FUNCTION_INFO_V1(kmer_ne);
+Datum
+kmer_ne(PG_FUNCTION_ARGS)
+{
+    const Kmer *a = PG_GETARG_KMER_P(0);
+    const Kmer *b = PG_GETARG_KMER_P(1);
+
+    PG_RETURN_BOOL(a->bases != b->bases || a->length != b->length);
+}
+
+static int
+kmer_fastcmp(Datum x, Datum y, SortSupport ssup)
+{
+    return kmer_compare(DatumGetKmerP(x), DatumGetKmerP(y));
+}
+
+/* The abbreviated key is the packed word itself, ties are broken on length */
+static Datum
+kmer_abbrev_convert(Datum original, SortSupport ssup)
+{
+    return UInt64GetDatum(DatumGetKmerP(original)->bases);
+}
+
+static bool
+kmer_abbrev_abort(int memtupcount, SortSupport ssup)
+{
+    return false;
+}
+
+PG_FUNCTION_INFO_V1(kmer_sortsupport);
+Datum
+kmer_sortsupport(PG_FUNCTION_ARGS)
+{
+    SortSupport ssup = (SortSupport) PG_GETARG_POINTER(0);
+
+    ssup->comparator = kmer_fastcmp;
+#if SIZEOF_DATUM >= 8
+    if (ssup->abbreviate)
+    {
+        ssup->comparator = ssup_datum_unsigned_cmp;
+        ssup->abbrev_converter = kmer_abbrev_convert;
+        ssup->abbrev_abort = kmer_abbrev_abort;
+        ssup->abbrev_full_comparator = kmer_fastcmp;
+    }
+#endif
+    PG_RETURN_VOID();
 }
 
 
 
 /***********************COUNTING SUPPORT***********************/
 
+/*
+ * The length is XORed into the zero padding bits below the bases. Up to 29
+ * bases the padding (6 bits or more) holds any length, so distinct kmers get
+ * distinct keys; from 30 bases on, the length also flips low bits of the last
+ * bases (bits 2-4 for 31 bases), so some kmers of 30 to 32 bases share a key.
+ * That only adds collisions, equal kmers still hash alike. The key is then
+ * mixed over all 64 bits.
+ */
+#define KMER_HASH_KEY(kmer)     ((kmer)->bases ^ (uint64) (kmer)->length)
+
 PG_FUNCTION_INFO_V1(kmer_hash);
 Datum
 kmer_hash(PG_FUNCTION_ARGS)
 {
-    Kmer *kmer = (Kmer *) PG_GETARG_POINTER(0);
-    uint32 hash = 5381;  // Seed value
-    int c;
-    const char *str = kmer->sequence;
+    const Kmer *kmer = PG_GETARG_KMER_P(0);
 
-    // Compute hash using djb2 algorithm
-    while ((c = *str++))
-        hash = ((hash << 5) + hash) + c;
+    PG_RETURN_UINT32((uint32) kmer_mix64(KMER_HASH_KEY(kmer)));
+}
+
+/*
+ * Seeded variant (hash support function 2), used by hash partitioning. The
+ * seed is mixed into the key; a seed of 0 gives the same low 32 bits as
+ * kmer_hash, as required.
+ */
+PG_FUNCTION_INFO_V1(kmer_hash_extended);
+Datum
+kmer_hash_extended(PG_FUNCTION_ARGS)
+{
+    const Kmer *kmer = PG_GETARG_KMER_P(0);
+    uint64 seed = (uint64) PG_GETARG_INT64(1);
 
-    PG_RETURN_UINT32(hash);
+    PG_RETURN_UINT64(kmer_mix64(KMER_HASH_KEY(kmer) ^ kmer_mix64(seed)));
 }
 
 
@@ -230,9 +457,6 @@ kmer_hash(PG_FUNCTION_ARGS)
 
 
  #define SPGIST_MAX_PREFIX_LENGTH    Max((int) (BLCKSZ - 258 * sizeof(Kmer) - 100), 32)
- #define SPG_STRATEGY_ADDITION   (10)
- #define SPG_IS_COLLATION_AWARE_STRATEGY(s) ((s) > SPG_STRATEGY_ADDITION \
-                                          && (s) != RTPrefixStrategyNumber)
   
  /* Struct for sorting values in picksplit */
  typedef struct spgNodePtr
@@ -258,16 +482,19 @@ kmer_hash(PG_FUNCTION_ARGS)
  }
   
 
+/*
+ * Form a kmer datum (possibly empty, as used for leaf suffixes) from the
+ * given not-necessarily-null-terminated nucleotide string
+ */
 static Datum
 formKmerDatum(const char *data, int datalen)
 {
-    Kmer *kmer = (Kmer *) palloc(VARHDRSZ + sizeof(int32) + datalen + 1);
+    uint64 bases = 0;
 
-    SET_VARSIZE(kmer, VARHDRSZ + sizeof(int32) + datalen + 1);
-    memcpy(kmer->sequence, data, datalen);
-    kmer->sequence[datalen] = '\0';  // Null-terminate the sequence
+    for (int i = 0; i < datalen; i++)
+        bases |= (uint64) NUCLEOTIDE_CODE(data[i]) << (62 - 2 * i);
 
-    return PointerGetDatum(kmer);
+    return KmerPGetDatum(kmer_make(bases, datalen));
 }
 
  /*
@@ -314,6 +541,29 @@ formKmerDatum(const char *data, int datalen)
      return i; /*Returns the length of common characters*/
  }
 
+/*
+ * Length of the common prefix of two packed kmers: the first differing bit
+ * of the two words gives the first differing nucleotide
+ */
+static int
+kmerCommonPrefix(const Kmer *a, const Kmer *b)
+{
+    int         len = Min(a->length, b->length);
+    uint64      diff = a->bases ^ b->bases;
+
+    if (diff == 0)
+        return len;
+    return Min(len, (63 - pg_leftmost_one_pos64(diff)) / 2);
+}
+
+/* Kmer made of the bases [start, start + length) of kmer */
+static Kmer *
+kmerSubstring(const Kmer *kmer, int start, int length)
+{
+    return kmer_make(start < KMER_MAX_LENGTH ? kmer->bases << (2 * start) : 0,
+                     length);
+}
+
   
  /*
   * Binary search an array of int16 datums for a match to c
@@ -353,9 +603,9 @@ spg_kmer_choose(PG_FUNCTION_ARGS)
 {
     spgChooseIn *in = (spgChooseIn *) PG_GETARG_POINTER(0);
     spgChooseOut *out = (spgChooseOut *) PG_GETARG_POINTER(1);
-    Kmer       *inKmer = (Kmer *) DatumGetPointer(in->datum);
-    const char *inSeq = inKmer->sequence;
-    int         inSize = strlen(inSeq);
+    Kmer       *inKmer = DatumGetKmerP(in->datum);
+    char        inSeq[KMER_MAX_LENGTH + 1];
+    int         inSize = kmer_unpack(inKmer, inSeq);
     const char *prefixStr = NULL;
     int         prefixSize = 0;
     int         commonLen = 0;
@@ -492,20 +742,17 @@ spg_kmer_picksplit(PG_FUNCTION_ARGS)
 {
     spgPickSplitIn *in = (spgPickSplitIn *) PG_GETARG_POINTER(0);
     spgPickSplitOut *out = (spgPickSplitOut *) PG_GETARG_POINTER(1);
-    Kmer       *kmer0 = (Kmer *) DatumGetPointer(in->datums[0]);
+    Kmer       *kmer0 = DatumGetKmerP(in->datums[0]);
     int         i,
                 commonLen;
     spgNodePtr *nodes;
 
     /* Identify the longest common prefix, if any */
-    commonLen = strlen(kmer0->sequence);
+    commonLen = kmer0->length;
     for (i = 1; i < in->nTuples && commonLen > 0; i++)
     {
-        Kmer *kmeri = (Kmer *) DatumGetPointer(in->datums[i]);
-        int   tmp = commonPrefix(kmer0->sequence,
-                                 kmeri->sequence,
-                                 strlen(kmer0->sequence),
-                                 strlen(kmeri->sequence));
+        Kmer *kmeri = DatumGetKmerP(in->datums[i]);
+        int   tmp = kmerCommonPrefix(kmer0, kmeri);
 
         if (tmp < commonLen)
             commonLen = tmp;
@@ -524,19 +771,22 @@ spg_kmer_picksplit(PG_FUNCTION_ARGS)
     }
     else
     {
+        char prefixStr[KMER_MAX_LENGTH + 1];
+
+        kmer_unpack(kmer0, prefixStr);
         out->hasPrefix = true;
-        out->prefixDatum = formTextDatum(kmer0->sequence, commonLen);
+        out->prefixDatum = formTextDatum(prefixStr, commonLen);
     }
 
-    /* Extract the node label (first non-common byte) from each value */
+    /* Extract the node label (first non-common nucleotide) from each value */
     nodes = (spgNodePtr *) palloc(sizeof(spgNodePtr) * in->nTuples);
 
     for (i = 0; i < in->nTuples; i++)
     {
-        Kmer *kmeri = (Kmer *) DatumGetPointer(in->datums[i]);
+        Kmer *kmeri = DatumGetKmerP(in->datums[i]);
 
-        if (commonLen < strlen(kmeri->sequence))
-            nodes[i].c = (int16) *(unsigned char *) (kmeri->sequence + commonLen);
+        if (commonLen < kmeri->length)
+            nodes[i].c = (int16) dna_nucleotides[KMER_GET_BASE(kmeri, commonLen)];
         else
             nodes[i].c = -1; /* use -1 if the sequence is entirely common */
         nodes[i].i = i;
@@ -558,7 +808,7 @@ spg_kmer_picksplit(PG_FUNCTION_ARGS)
 
     for (i = 0; i < in->nTuples; i++)
     {
-        Kmer *kmeri = (Kmer *) DatumGetPointer(nodes[i].d);
+        Kmer *kmeri = DatumGetKmerP(nodes[i].d);
         Datum leafD;
 
         if (i == 0 || nodes[i].c != nodes[i - 1].c)
@@ -567,11 +817,11 @@ spg_kmer_picksplit(PG_FUNCTION_ARGS)
             out->nNodes++;
         }
 
-        if (commonLen < strlen(kmeri->sequence))
-            leafD = formKmerDatum(kmeri->sequence + commonLen + 1,
-                                  strlen(kmeri->sequence) - commonLen - 1);
+        if (commonLen < kmeri->length)
+            leafD = KmerPGetDatum(kmerSubstring(kmeri, commonLen + 1,
+                                                kmeri->length - commonLen - 1));
         else
-            leafD = formKmerDatum(NULL, 0);
+            leafD = KmerPGetDatum(kmer_make(0, 0));
 
         out->leafTupleDatums[nodes[i].i] = leafD;
         out->mapTuplesToNodes[nodes[i].i] = out->nNodes - 1;
@@ -580,19 +830,48 @@ spg_kmer_picksplit(PG_FUNCTION_ARGS)
     PG_RETURN_VOID();
 }
 
+/*
+ * Distances of value to the query of each ORDER BY kmer <-> query. A leaf
+ * value gets its exact Hamming distance. An inner one is the prefix of all
+ * the kmers below it and gets a lower bound: the mismatches of the prefix,
+ * plus its bases beyond the length of the query.
+ */
+static double *
+spgKmerDistances(ScanKey orderbys, int norderbys, const Kmer *value, bool isLeaf)
+{
+    double *distances = (double *) palloc(sizeof(double) * norderbys);
+
+    for (int i = 0; i < norderbys; i++)
+    {
+        const Kmer *query = DatumGetKmerP(orderbys[i].sk_argument);
+
+        if (isLeaf)
+            distances[i] = kmer_hamming(value, query);
+        else
+            distances[i] = kmer_mismatches(value->bases, query->bases,
+                                           Min(value->length, query->length)) +
+                           Max(value->length - query->length, 0);
+    }
+    return distances;
+}
+
 PG_FUNCTION_INFO_V1(spg_kmer_inner_consistent);
 Datum
 spg_kmer_inner_consistent(PG_FUNCTION_ARGS)
 {
     spgInnerConsistentIn *in = (spgInnerConsistentIn *) PG_GETARG_POINTER(0);
     spgInnerConsistentOut *out = (spgInnerConsistentOut *) PG_GETARG_POINTER(1);
-    bool        collate_is_c = lc_collate_is_c(PG_GET_COLLATION());
     Kmer        *reconstructedValue;
-    Kmer        *reconstrKmer;
-    int         maxReconstrLen;
+    char         reconstrStr[KMER_MAX_LENGTH + 1];
+    int          maxReconstrLen;
     text        *prefixText = NULL;
-    int         prefixSize = 0;
-    int         i;
+    int          prefixSize = 0;
+    const Kmer **budgetQueries;
+    int32       *budgets;
+    int         *spent;
+    bool         hasBudget = false;
+    int          i,
+                 j;
 
     /*
      * Reconstruct values represented at this tuple, including parent data,
@@ -600,9 +879,9 @@ spg_kmer_inner_consistent(PG_FUNCTION_ARGS)
      * in->level should be the length of the previously reconstructed value,
      * and the number of bytes added here is prefixSize or prefixSize + 1.
      */
-    reconstructedValue = (Kmer *) DatumGetPointer(in->reconstructedValue);
+    reconstructedValue = DatumGetKmerP(in->reconstructedValue);
     Assert(reconstructedValue == NULL ? in->level == 0 :
-           strlen(reconstructedValue) == in->level);
+           reconstructedValue->length == in->level);
 
     maxReconstrLen = in->level + 1;
     if (in->hasPrefix)
@@ -611,15 +890,13 @@ spg_kmer_inner_consistent(PG_FUNCTION_ARGS)
          prefixSize = VARSIZE_ANY_EXHDR(prefixText);
          maxReconstrLen += prefixSize;
     }
-
-    reconstrKmer = palloc(VARHDRSZ + maxReconstrLen);
-    SET_VARSIZE(reconstrKmer, VARHDRSZ + maxReconstrLen);
+    Assert(maxReconstrLen <= KMER_MAX_LENGTH + 1);
 
     if (in->level)
-        memcpy(reconstrKmer->sequence, reconstructedValue->sequence, in->level);
+        kmer_unpack(reconstructedValue, reconstrStr);
     if (prefixSize)
-        memcpy(reconstrKmer->sequence + in->level, VARDATA_ANY(prefixText), prefixSize);
-    // last byte of reconstrKmer will be filled in below
+        memcpy(reconstrStr + in->level, VARDATA_ANY(prefixText), prefixSize);
+    // last byte of reconstrStr will be filled in below
 
     /*
      * Scan the child nodes. For each one, complete the reconstructed value
@@ -629,21 +906,41 @@ spg_kmer_inner_consistent(PG_FUNCTION_ARGS)
     out->nodeNumbers = (int *) palloc(sizeof(int) * in->nNodes);
     out->levelAdds = (int *) palloc(sizeof(int) * in->nNodes);
     out->reconstructedValues = (Datum *) palloc(sizeof(Datum) * in->nNodes);
+    if (in->norderbys > 0)
+        out->distances = (double **) palloc(sizeof(double *) * in->nNodes);
     out->nNodes = 0;
 
+    /*
+     * Mismatch budgets: the mismatches spent by the bases above this tuple
+     * are carried down in the traversal value, one count per scan key.
+     */
+    budgetQueries = (const Kmer **) palloc0(sizeof(Kmer *) * in->nkeys);
+    budgets = (int32 *) palloc0(sizeof(int32) * in->nkeys);
+    spent = (int *) palloc0(sizeof(int) * in->nkeys);
+    for (j = 0; j < in->nkeys; j++)
+    {
+        if (in->scankeys[j].sk_strategy != KMER_WITHIN_STRATEGY)
+            continue;
+        if (!kmer_budget_parse(in->scankeys[j].sk_argument,
+                               &budgetQueries[j], &budgets[j]))
+            PG_RETURN_VOID();
+        hasBudget = true;
+    }
+    if (hasBudget)
+        out->traversalValues = (void **) palloc(sizeof(void *) * in->nNodes);
+
     for (i = 0; i < in->nNodes; i++)
     {
         int16       nodeChar = DatumGetInt16(in->nodeLabels[i]);
         int         thisLen;
         bool        res = true;
-        int         j;
 
         /* If nodeChar is a dummy value, don't include it in data */
         if (nodeChar <= 0)
             thisLen = maxReconstrLen - 1;
         else
         {
-            reconstrKmer->sequence[maxReconstrLen - 1] = nodeChar;
+            reconstrStr[maxReconstrLen - 1] = nodeChar;
             thisLen = maxReconstrLen;
         }
 
@@ -651,46 +948,63 @@ spg_kmer_inner_consistent(PG_FUNCTION_ARGS)
         {
             StrategyNumber strategy = in->scankeys[j].sk_strategy;
             Kmer *inKmer;
+            char  inStr[KMER_MAX_LENGTH + 1];
             int   inSize;
             int   r;
 
             /*
-             * If it's a collation-aware operator, but the collation is C, we
-             * can treat it as non-collation-aware. With non-C collation we
-             * need to traverse the whole tree :-( so there's no point in making
-             * any check here.
+             * Wildcard query: only the nucleotides added at this level need
+             * checking, the ones above were checked by the parent nodes. A
+             * value longer than the pattern can never match it.
+             */
+            if (strategy == KMER_CONTAINS_STRATEGY)
+            {
+                const Qkmer *query = DatumGetQkmerP(in->scankeys[j].sk_argument);
+
+                if (thisLen > query->length)
+                    res = false;
+                for (int p = in->level; res && p < thisLen; p++)
+                    if (!(QKMER_GET_MASK(query, p) & (1 << NUCLEOTIDE_CODE(reconstrStr[p]))))
+                        res = false;
+                if (!res)
+                    break;
+                continue;
+            }
+
+            /*
+             * Mismatch budget: the bases added at this level, or beyond the
+             * end of the query, add to the mismatches spent above. The
+             * branch is pruned as soon as the budget is exhausted.
              */
-            if (SPG_IS_COLLATION_AWARE_STRATEGY(strategy))
+            if (strategy == KMER_WITHIN_STRATEGY)
             {
-                if (collate_is_c)
-                    strategy -= SPG_STRATEGY_ADDITION;
-                else
-                    continue;
+                const Kmer *query = budgetQueries[j];
+
+                spent[j] = in->traversalValue ? ((int *) in->traversalValue)[j] : 0;
+                for (int p = in->level; p < thisLen; p++)
+                    if (p >= query->length ||
+                        NUCLEOTIDE_CODE(reconstrStr[p]) != KMER_GET_BASE(query, p))
+                        spent[j]++;
+                if (spent[j] > budgets[j])
+                {
+                    res = false;
+                    break;
+                }
+                continue;
             }
 
-            inKmer = (Kmer *) DatumGetPointer(in->scankeys[j].sk_argument);
-            inSize = strlen(inKmer->sequence);
+            inKmer = DatumGetKmerP(in->scankeys[j].sk_argument);
+            inSize = kmer_unpack(inKmer, inStr);
 
-            r = memcmp(reconstrKmer->sequence, inKmer->sequence,
-                       Min(inSize, thisLen));
+            r = memcmp(reconstrStr, inStr, Min(inSize, thisLen));
 
             switch (strategy)
             {
-                case BTLessStrategyNumber:
-                case BTLessEqualStrategyNumber:
-                    if (r > 0)
-                        res = false;
-                    break;
-                case BTEqualStrategyNumber:
+                case KMER_EQUAL_STRATEGY:
                     if (r != 0 || inSize < thisLen)
                         res = false;
                     break;
-                case BTGreaterEqualStrategyNumber:
-                case BTGreaterStrategyNumber:
-                    if (r < 0)
-                        res = false;
-                    break;
-                case RTPrefixStrategyNumber:
+                case KMER_PREFIX_STRATEGY:
                     if (r != 0)
                         res = false;
                     break;
@@ -709,7 +1023,20 @@ spg_kmer_inner_consistent(PG_FUNCTION_ARGS)
             out->nodeNumbers[out->nNodes] = i;
             out->levelAdds[out->nNodes] = thisLen - in->level;
             out->reconstructedValues[out->nNodes] =
-                datumCopy(PointerGetDatum(reconstrKmer), false, -1);
+                formKmerDatum(reconstrStr, thisLen);
+            if (in->norderbys > 0)
+                out->distances[out->nNodes] =
+                    spgKmerDistances(in->orderbys, in->norderbys,
+                                     DatumGetKmerP(out->reconstructedValues[out->nNodes]),
+                                     false);
+            if (hasBudget)
+            {
+                int        *childSpent = (int *) MemoryContextAlloc(in->traversalMemoryContext,
+                                                                    sizeof(int) * in->nkeys);
+
+                memcpy(childSpent, spent, sizeof(int) * in->nkeys);
+                out->traversalValues[out->nNodes] = childSpent;
+            }
             out->nNodes++;
         }
     }
@@ -725,109 +1052,65 @@ spg_kmer_leaf_consistent(PG_FUNCTION_ARGS)
     spgLeafConsistentOut *out = (spgLeafConsistentOut *) PG_GETARG_POINTER(1);
     int         level = in->level;
     Kmer        *leafValue,
-                *reconstrValue = NULL;
-    char       *fullValue;
-    int         fullLen;
+                *reconstrValue = NULL,
+                *fullValue;
     bool        res;
     int         j;
 
     /* all tests are exact */
     out->recheck = false;
 
-    leafValue = (Kmer *) DatumGetPointer(in->leafDatum);
+    leafValue = DatumGetKmerP(in->leafDatum);
 
-    /* As above, in->reconstructedValue isn't toasted or short. */
     if (DatumGetPointer(in->reconstructedValue))
-        reconstrValue = (Kmer *) DatumGetPointer(in->reconstructedValue);
+        reconstrValue = DatumGetKmerP(in->reconstructedValue);
 
     Assert(reconstrValue == NULL ? level == 0 :
-           strlen(reconstrValue->sequence) == level);
+           reconstrValue->length == level);
 
     /* Reconstruct the full Kmer represented by this leaf tuple */
-    fullLen = level + strlen(leafValue->sequence);
-    if (strlen(leafValue->sequence) == 0 && level > 0)
-    {
-        fullValue = reconstrValue->sequence;
-        out->leafValue = PointerGetDatum(reconstrValue);
-    }
+    if (leafValue->length == 0 && level > 0)
+        fullValue = reconstrValue;
     else
-    {
-        Kmer *fullKmer = palloc(VARHDRSZ + fullLen);
-
-        SET_VARSIZE(fullKmer, VARHDRSZ + fullLen);
-        fullValue = fullKmer->sequence;
-        if (level)
-            memcpy(fullValue, reconstrValue->sequence, level);
-        if (strlen(leafValue->sequence) > 0)
-            memcpy(fullValue + level, leafValue->sequence, strlen(leafValue->sequence));
-        out->leafValue = PointerGetDatum(fullKmer);
-    }
+        fullValue = kmer_make((level ? reconstrValue->bases : 0) |
+                              (leafValue->bases >> (2 * level)),
+                              level + leafValue->length);
+    out->leafValue = KmerPGetDatum(fullValue);
 
     /* Perform the required comparison(s) */
     res = true;
     for (j = 0; j < in->nkeys; j++)
     {
         StrategyNumber strategy = in->scankeys[j].sk_strategy;
-        Kmer *query = (Kmer *) DatumGetPointer(in->scankeys[j].sk_argument);
-        int queryLen = strlen(query->sequence);
-        int r;
-
-        if (strategy == RTPrefixStrategyNumber)
-        {
-            /*
-             * If level >= length of query then reconstrValue must begin with
-             * query (prefix) sequence, so we don't need to check it again.
-             */
-            res = (level >= queryLen) ||
-                (memcmp(reconstrValue->sequence, query->sequence, queryLen) == 0);
-
-            if (!res)           /* no need to consider remaining conditions */
-                break;
-
-            continue;
-        }
-
-        if (SPG_IS_COLLATION_AWARE_STRATEGY(strategy))
-        {
-            /* Collation-aware comparison */
-            strategy -= SPG_STRATEGY_ADDITION;
-
-            /* If asserts enabled, verify encoding of reconstructed sequence */
-            Assert(pg_verifymbstr(fullValue, fullLen, false));
-
-            r = memcmp(fullValue, query->sequence, Min(queryLen, fullLen));
-        }
-        else
-        {
-            /* Non-collation-aware comparison */
-            r = memcmp(fullValue, query->sequence, Min(queryLen, fullLen));
-
-            if (r == 0)
-            {
-                if (queryLen > fullLen)
-                    r = -1;
-                else if (queryLen < fullLen)
-                    r = 1;
-            }
-        }
+        Kmer *query;
 
         switch (strategy)
         {
-            case BTLessStrategyNumber:
-                res = (r < 0);
-                break;
-            case BTLessEqualStrategyNumber:
-                res = (r <= 0);
+            case KMER_EQUAL_STRATEGY:
+                query = DatumGetKmerP(in->scankeys[j].sk_argument);
+                res = (fullValue->bases == query->bases &&
+                       fullValue->length == query->length);
                 break;
-            case BTEqualStrategyNumber:
-                res = (r == 0);
+            case KMER_PREFIX_STRATEGY:
+                query = DatumGetKmerP(in->scankeys[j].sk_argument);
+                res = (query->length <= fullValue->length &&
+                       ((fullValue->bases ^ query->bases) &
+                        KMER_PREFIX_MASK(query->length)) == 0);
                 break;
-            case BTGreaterEqualStrategyNumber:
-                res = (r >= 0);
+            case KMER_CONTAINS_STRATEGY:
+                res = qkmer_matches(DatumGetQkmerP(in->scankeys[j].sk_argument),
+                                    fullValue);
                 break;
-            case BTGreaterStrategyNumber:
-                res = (r > 0);
+            case KMER_WITHIN_STRATEGY:
+            {
+                const Kmer *budgetQuery;
+                int32       mismatches;
+
+                res = kmer_budget_parse(in->scankeys[j].sk_argument,
+                                        &budgetQuery, &mismatches) &&
+                      kmer_hamming(fullValue, budgetQuery) <= mismatches;
                 break;
+            }
             default:
                 elog(ERROR, "unrecognized strategy number: %d",
                      in->scankeys[j].sk_strategy);
@@ -839,5 +1122,13 @@ spg_kmer_leaf_consistent(PG_FUNCTION_ARGS)
             break;              /* no need to consider remaining conditions */
     }
 
+    /* Hamming distances are exact */
+    if (res && in->norderbys > 0)
+    {
+        out->distances = spgKmerDistances(in->orderbys, in->norderbys,
+                                          fullValue, true);
+        out->recheckDistances = false;
+    }
+
     PG_RETURN_BOOL(res);
 }
@@ -1,11 +1,78 @@
+#pragma once
+
+#include "port/pg_bitutils.h"
+
 /* Structure to represent Kmer */
 
+/*
+ * A kmer is a fixed-length value: its nucleotides are packed 2 bits per base
+ * (same codes as dna) into a 64-bit word, left-aligned so the first base sits
+ * in the two most significant bits and the unused low bits are zero. Comparing
+ * (bases, length) therefore follows the lexicographic order of the sequences.
+ * 32 bases already fill the word, so the type is 16 bytes passed by reference.
+ */
 typedef struct Kmer {
-    int32 size;
-    char sequence[FLEXIBLE_ARRAY_MEMBER];
+    uint64 bases;
+    int32 length;   /* number of nucleotides */
 } Kmer;
 
+#define KMER_MAX_LENGTH         32
+#define KMER_GET_BASE(kmer, i)  (((kmer)->bases >> (62 - 2 * (i))) & 3)
+/* Mask covering the first len bases of a packed word */
+#define KMER_PREFIX_MASK(len) \
+    ((len) == 0 ? UINT64CONST(0) : ~UINT64CONST(0) << (64 - 2 * (len)))
+
+/*
+ * Mixes the packed bases of a kmer into a well spread 64-bit hash (finalizer
+ * of MurmurHash3). The mix is invertible, so distinct kmers never collide.
+ */
+static inline uint64
+kmer_mix64(uint64 x)
+{
+    x ^= x >> 33;
+    x *= UINT64CONST(0xff51afd7ed558ccd);
+    x ^= x >> 33;
+    x *= UINT64CONST(0xc4ceb9fe1a85ec53);
+    x ^= x >> 33;
+    return x;
+}
+
+/* Number of positions among the first len where two packed words differ */
+static inline int
+kmer_mismatches(uint64 a, uint64 b, int len)
+{
+    uint64 diff = (a ^ b) & KMER_PREFIX_MASK(len);
+
+    return pg_popcount64((diff | (diff >> 1)) & UINT64CONST(0x5555555555555555));
+}
+
+/*
+ * Hamming distance of two kmers: the mismatches over their common length,
+ * every base of the longer one beyond it counting as one more.
+ */
+static inline int
+kmer_hamming(const Kmer *a, const Kmer *b)
+{
+    return kmer_mismatches(a->bases, b->bases, Min(a->length, b->length)) +
+           Max(a->length, b->length) - Min(a->length, b->length);
+}
+
+#define DatumGetKmerP(X)        ((Kmer *) DatumGetPointer(X))
+#define KmerPGetDatum(X)        PointerGetDatum(X)
+#define PG_GETARG_KMER_P(n)     DatumGetKmerP(PG_GETARG_DATUM(n))
+#define PG_RETURN_KMER_P(x)     return KmerPGetDatum(x)
+
+/* Strategy numbers of the kmer_index_support operator class */
+#define KMER_EQUAL_STRATEGY     1   /* kmer = kmer */
+#define KMER_PREFIX_STRATEGY    2   /* kmer ^@ kmer */
+#define KMER_CONTAINS_STRATEGY  3   /* kmer <@ qkmer */
+#define KMER_DISTANCE_STRATEGY  4   /* kmer <-> kmer, ordering */
+#define KMER_WITHIN_STRATEGY    5   /* kmer %> kmer_budget */
+
+Kmer* kmer_make(uint64 bases, int32 length);
 Kmer* kmer_parse(const char* str);
+uint64 kmer_reverse_complement(uint64 bases, int32 length);
+bool kmer_budget_parse(Datum budget, const Kmer** query, int32* mismatches);
 char * kmer_to_str(const Kmer* kmer);
 Datum kmer_in(PG_FUNCTION_ARGS);
 Datum kmer_out(PG_FUNCTION_ARGS);
@@ -15,5 +82,6 @@ Datum kmer_cast_from_text(PG_FUNCTION_ARGS);
 Datum kmer_cast_to_text(PG_FUNCTION_ARGS);
 Datum kmer_size(PG_FUNCTION_ARGS);
 Datum kmer_len(PG_FUNCTION_ARGS);
-
-
+/* Config functions of the SP-GiST operator classes, which kmer_spgist builds */
+Datum spg_kmer_config(PG_FUNCTION_ARGS);
+Datum spg_kmer_radix_config(PG_FUNCTION_ARGS);
@@ -0,0 +1,282 @@
+#include "postgres.h"
+
+#include "access/stratnum.h"
+#include "catalog/pg_am_d.h"
+#include "catalog/pg_type.h"
+#include "commands/defrem.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "nodes/supportnodes.h"
+#include "optimizer/optimizer.h"
+#include "port/pg_bitutils.h"
+#include "utils/lsyscache.h"
+#include "utils/typcache.h"
+
+#include "dna.h"
+#include "kmer.h"
+#include "kmer_planner.h"
+#include "qkmer.h"
+
+/*
+ * Planner support functions (prosupport) of starts_with, contains and the
+ * functions behind ^@, @> and <@.
+ *
+ * Whether the test is written as a function call or as an operator, they
+ * - turn it into the operator clause an SP-GiST kmer index understands (built
+ *   by the core or by kmer_spgist),
+ * - turn it into a range on a B-tree index: the kmers starting with a prefix
+ *   are exactly the ones in [prefix, successor), and a qkmer is bounded the
+ *   same way by its leading non-degenerate bases,
+ * - estimate its selectivity from the kmer statistics (kmer_stats.c),
+ * - replace a qkmer without degenerate positions by a kmer equality.
+ */
+
+/* Arguments of the call a support request is about */
+static List *
+support_call_args(Node *node)
+{
+    if (IsA(node, FuncExpr))
+        return ((FuncExpr *) node)->args;
+    if (IsA(node, OpExpr))
+        return ((OpExpr *) node)->args;
+    return NIL;
+}
+
+/* SP-GiST, or kmer_spgist: the same index with another build */
+static bool
+kmer_index_is_spgist(Oid relam)
+{
+    return relam == SPGIST_AM_OID || relam == get_am_oid("kmer_spgist", true);
+}
+
+/* kmer op value clause, or NULL when the operator family lacks op */
+static Expr *
+kmer_index_clause(Oid opfamily, int16 strategy, Node *kmer, Node *value)
+{
+    Oid     opno = get_opfamily_member(opfamily, exprType(kmer), exprType(value),
+                                       strategy);
+
+    if (!OidIsValid(opno))
+        return NULL;
+    return make_opclause(opno, BOOLOID, false, (Expr *) copyObject(kmer),
+                         (Expr *) copyObject(value), InvalidOid, InvalidOid);
+}
+
+/*
+ * B-tree range of the kmers starting with the first len bases of bases:
+ * kmer >= prefix, and kmer < successor unless the prefix is only Ts, the
+ * successor being the prefix without its trailing Ts and with its last base
+ * incremented.
+ */
+static List *
+kmer_prefix_range(Oid opfamily, Node *kmer, uint64 bases, int32 len)
+{
+    Oid     kmertype = exprType(kmer);
+    Expr   *lower;
+    Expr   *upper;
+    int32   upper_len = len;
+
+    lower = kmer_index_clause(opfamily, BTGreaterEqualStrategyNumber, kmer,
+                              (Node *) makeConst(kmertype, -1, InvalidOid, sizeof(Kmer),
+                                                 PointerGetDatum(kmer_make(bases, len)),
+                                                 false, false));
+    if (lower == NULL)
+        return NIL;
+
+    while (upper_len > 0 && ((bases >> (64 - 2 * upper_len)) & 3) == 3)
+        upper_len--;
+    if (upper_len == 0)
+        return list_make1(lower);
+
+    bases = (bases & KMER_PREFIX_MASK(upper_len)) + (UINT64CONST(1) << (64 - 2 * upper_len));
+    upper = kmer_index_clause(opfamily, BTLessStrategyNumber, kmer,
+                              (Node *) makeConst(kmertype, -1, InvalidOid, sizeof(Kmer),
+                                                 PointerGetDatum(kmer_make(bases, upper_len)),
+                                                 false, false));
+    if (upper == NULL)
+        return NIL;
+    return list_make2(lower, upper);
+}
+
+/* Support of a prefix test, the kmer being argument kmer_arg and the prefix the other */
+static Node *
+kmer_prefix_support(Node *rawreq, int kmer_arg)
+{
+    if (IsA(rawreq, SupportRequestSelectivity)) {
+        SupportRequestSelectivity *req = (SupportRequestSelectivity *) rawreq;
+
+        if (req->is_join)
+            return NULL;
+        req->selectivity = kmer_prefix_selectivity(req->root, req->args,
+                                                   req->varRelid, kmer_arg);
+        return (Node *) req;
+    }
+
+    if (IsA(rawreq, SupportRequestIndexCondition)) {
+        SupportRequestIndexCondition *req = (SupportRequestIndexCondition *) rawreq;
+        List   *args = support_call_args(req->node);
+        Node   *kmer;
+        Node   *prefix;
+        List   *result = NIL;
+
+        if (list_length(args) != 2 || req->indexarg != kmer_arg)
+            return NULL;
+        kmer = (Node *) list_nth(args, kmer_arg);
+        prefix = (Node *) list_nth(args, 1 - kmer_arg);
+        if (!is_pseudo_constant_for_index(req->root, prefix, req->index))
+            return NULL;
+
+        if (kmer_index_is_spgist(req->index->relam)) {
+            Expr   *clause = kmer_index_clause(req->opfamily, KMER_PREFIX_STRATEGY,
+                                               kmer, prefix);
+
+            if (clause != NULL)
+                result = list_make1(clause);
+        }
+        else if (req->index->relam == BTREE_AM_OID && IsA(prefix, Const) &&
+                 !((Const *) prefix)->constisnull) {
+            const Kmer *value = DatumGetKmerP(((Const *) prefix)->constvalue);
+
+            result = kmer_prefix_range(req->opfamily, kmer, value->bases, value->length);
+        }
+
+        if (result != NIL)
+            req->lossy = false;
+        return (Node *) result;
+    }
+
+    return NULL;
+}
+
+/* Support of a qkmer test, the kmer being argument kmer_arg and the qkmer the other */
+static Node *
+kmer_contains_support(Node *rawreq, int kmer_arg)
+{
+    if (IsA(rawreq, SupportRequestSimplify)) {
+        SupportRequestSimplify *req = (SupportRequestSimplify *) rawreq;
+        List   *args = req->fcall->args;
+        Node   *kmer;
+        Node   *pattern;
+        const Qkmer *qkmer;
+        uint64  bases = 0;
+        Oid     eqop;
+        OpExpr *result;
+
+        if (list_length(args) != 2)
+            return NULL;
+        kmer = (Node *) list_nth(args, kmer_arg);
+        pattern = (Node *) list_nth(args, 1 - kmer_arg);
+        if (!IsA(pattern, Const) || ((Const *) pattern)->constisnull)
+            return NULL;
+
+        qkmer = DatumGetQkmerP(((Const *) pattern)->constvalue);
+        for (int i = 0; i < qkmer->length; i++) {
+            uint8   mask = QKMER_GET_MASK(qkmer, i);
+
+            if ((mask & (mask - 1)) != 0)
+                return NULL;
+            bases |= (uint64) pg_rightmost_one_pos32(mask) << (62 - 2 * i);
+        }
+
+        eqop = lookup_type_cache(exprType(kmer), TYPECACHE_EQ_OPR)->eq_opr;
+        if (!OidIsValid(eqop))
+            return NULL;
+
+        result = (OpExpr *) make_opclause(eqop, BOOLOID, false, (Expr *) kmer,
+                                          (Expr *) makeConst(exprType(kmer), -1, InvalidOid,
+                                                             sizeof(Kmer),
+                                                             PointerGetDatum(kmer_make(bases, qkmer->length)),
+                                                             false, false),
+                                          InvalidOid, InvalidOid);
+        result->opfuncid = get_opcode(eqop);
+        return (Node *) result;
+    }
+
+    if (IsA(rawreq, SupportRequestSelectivity)) {
+        SupportRequestSelectivity *req = (SupportRequestSelectivity *) rawreq;
+
+        if (req->is_join)
+            return NULL;
+        req->selectivity = kmer_contains_selectivity(req->root, req->args,
+                                                     req->varRelid, kmer_arg);
+        return (Node *) req;
+    }
+
+    if (IsA(rawreq, SupportRequestIndexCondition)) {
+        SupportRequestIndexCondition *req = (SupportRequestIndexCondition *) rawreq;
+        List   *args = support_call_args(req->node);
+        Node   *kmer;
+        Node   *pattern;
+        List   *result = NIL;
+
+        if (list_length(args) != 2 || req->indexarg != kmer_arg)
+            return NULL;
+        kmer = (Node *) list_nth(args, kmer_arg);
+        pattern = (Node *) list_nth(args, 1 - kmer_arg);
+        if (!is_pseudo_constant_for_index(req->root, pattern, req->index))
+            return NULL;
+
+        if (kmer_index_is_spgist(req->index->relam)) {
+            Expr   *clause = kmer_index_clause(req->opfamily, KMER_CONTAINS_STRATEGY,
+                                               kmer, pattern);
+
+            if (clause != NULL) {
+                result = list_make1(clause);
+                req->lossy = false;
+            }
+        }
+        else if (req->index->relam == BTREE_AM_OID && IsA(pattern, Const) &&
+                 !((Const *) pattern)->constisnull) {
+            /* Leading non-degenerate bases, the rest is rechecked */
+            const Qkmer *qkmer = DatumGetQkmerP(((Const *) pattern)->constvalue);
+            uint64  bases = 0;
+            int32   len = 0;
+
+            for (; len < qkmer->length; len++) {
+                uint8   mask = QKMER_GET_MASK(qkmer, len);
+
+                if ((mask & (mask - 1)) != 0)
+                    break;
+                bases |= (uint64) pg_rightmost_one_pos32(mask) << (62 - 2 * len);
+            }
+            if (len > 0)
+                result = kmer_prefix_range(req->opfamily, kmer, bases, len);
+        }
+
+        return (Node *) result;
+    }
+
+    return NULL;
+}
+
+/*Support function of starts_with(prefix, kmer)*/
+PG_FUNCTION_INFO_V1(starts_with_support);
+Datum
+starts_with_support(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_POINTER(kmer_prefix_support((Node *) PG_GETARG_POINTER(0), 1));
+}
+
+/*Support function of kmer_starts_with(kmer, prefix), behind kmer ^@ prefix*/
+PG_FUNCTION_INFO_V1(kmer_starts_with_support);
+Datum
+kmer_starts_with_support(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_POINTER(kmer_prefix_support((Node *) PG_GETARG_POINTER(0), 0));
+}
+
+/*Support function of contains(qkmer, kmer), behind qkmer @> kmer*/
+PG_FUNCTION_INFO_V1(contains_support);
+Datum
+contains_support(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_POINTER(kmer_contains_support((Node *) PG_GETARG_POINTER(0), 1));
+}
+
+/*Support function of contained_by(kmer, qkmer), behind kmer <@ qkmer*/
+PG_FUNCTION_INFO_V1(contained_by_support);
+Datum
+contained_by_support(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_POINTER(kmer_contains_support((Node *) PG_GETARG_POINTER(0), 0));
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+/* Planner support of the kmer operators */
+
+#include "nodes/pathnodes.h"
+
+/*
+ * Restriction selectivity of a prefix or qkmer test on a kmer column
+ * (kmer_stats.c). args are the two arguments of the operator or function,
+ * kmer_arg the position of the kmer among them.
+ */
+double kmer_prefix_selectivity(PlannerInfo* root, List* args, int varRelid, int kmer_arg);
+double kmer_contains_selectivity(PlannerInfo* root, List* args, int varRelid, int kmer_arg);
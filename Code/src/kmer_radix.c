@@ -0,0 +1,267 @@
+#include "postgres.h"
+
+#include "access/spgist.h"
+#include "catalog/pg_type.h"
+#include "port/pg_bitutils.h"
+
+#include "dna.h"
+#include "kmer.h"
+#include "qkmer.h"
+
+/*
+ * Four-way radix tree over packed kmers (operator class kmer_radix_ops).
+ *
+ * An inner tuple at level L holds an optional prefix, the bases [L, L + P)
+ * shared by all the kmers below it stored as a kmer, and exactly 4 unlabeled
+ * nodes: node c holds the kmers whose base at L + P has code c. A kmer of
+ * length L + P (or shorter, below prefix-less tuples) has no base there and
+ * goes to node 0. Leaves store the whole kmer, so nothing has to be
+ * reconstructed during a scan and the leaf checks are exact.
+ */
+
+#define KMER_RADIX_NODES    4
+
+/* Bases of kmer starting at level, left-aligned */
+#define KMER_RADIX_SHIFT(bases, level) \
+    ((level) >= KMER_MAX_LENGTH ? UINT64CONST(0) : (bases) << (2 * (level)))
+
+/* Node of the kmer under an inner tuple whose prefix ends at pos */
+static inline int
+radix_node(const Kmer *kmer, int pos)
+{
+    return pos < kmer->length ? (int) KMER_GET_BASE(kmer, pos) : 0;
+}
+
+/* Number of leading bases of prefix that kmer has from level on */
+static int
+radix_common(const Kmer *kmer, int level, const Kmer *prefix)
+{
+    int     len = Min(kmer->length - level, prefix->length);
+    uint64  diff;
+
+    if (len <= 0)
+        return 0;
+    diff = KMER_RADIX_SHIFT(kmer->bases, level) ^ prefix->bases;
+    if (diff == 0)
+        return len;
+    return Min(len, (63 - pg_leftmost_one_pos64(diff)) / 2);
+}
+
+PG_FUNCTION_INFO_V1(spg_kmer_radix_config);
+Datum
+spg_kmer_radix_config(PG_FUNCTION_ARGS)
+{
+    spgConfigIn *cfgin = (spgConfigIn *) PG_GETARG_POINTER(0);
+    spgConfigOut *cfg = (spgConfigOut *) PG_GETARG_POINTER(1);
+
+    cfg->prefixType = cfgin->attType;   /* kmer */
+    cfg->labelType = VOIDOID;           /* the node number is the base */
+    cfg->canReturnData = true;
+    cfg->longValuesOK = false;
+    PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(spg_kmer_radix_choose);
+Datum
+spg_kmer_radix_choose(PG_FUNCTION_ARGS)
+{
+    spgChooseIn *in = (spgChooseIn *) PG_GETARG_POINTER(0);
+    spgChooseOut *out = (spgChooseOut *) PG_GETARG_POINTER(1);
+    const Kmer *kmer = DatumGetKmerP(in->datum);
+    int         prefixLen = 0;
+
+    if (in->hasPrefix)
+    {
+        const Kmer *prefix = DatumGetKmerP(in->prefixDatum);
+        int         commonLen = radix_common(kmer, in->level, prefix);
+
+        prefixLen = prefix->length;
+        if (commonLen < prefixLen)
+        {
+            /* Split the prefix where the new kmer leaves it */
+            out->resultType = spgSplitTuple;
+            out->result.splitTuple.prefixHasPrefix = commonLen > 0;
+            if (commonLen > 0)
+                out->result.splitTuple.prefixPrefixDatum =
+                    KmerPGetDatum(kmer_make(prefix->bases, commonLen));
+            out->result.splitTuple.prefixNNodes = KMER_RADIX_NODES;
+            out->result.splitTuple.prefixNodeLabels = NULL;
+            out->result.splitTuple.childNodeN = KMER_GET_BASE(prefix, commonLen);
+
+            out->result.splitTuple.postfixHasPrefix = prefixLen - commonLen > 1;
+            if (prefixLen - commonLen > 1)
+                out->result.splitTuple.postfixPrefixDatum =
+                    KmerPGetDatum(kmer_make(prefix->bases << (2 * (commonLen + 1)),
+                                            prefixLen - commonLen - 1));
+            PG_RETURN_VOID();
+        }
+    }
+
+    /* In an allTheSame tuple the nodes are equivalent, the core picks one */
+    out->resultType = spgMatchNode;
+    out->result.matchNode.nodeN = in->allTheSame ? 0 : radix_node(kmer, in->level + prefixLen);
+    out->result.matchNode.levelAdd = prefixLen + 1;
+    out->result.matchNode.restDatum = in->leafDatum;
+    PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(spg_kmer_radix_picksplit);
+Datum
+spg_kmer_radix_picksplit(PG_FUNCTION_ARGS)
+{
+    spgPickSplitIn *in = (spgPickSplitIn *) PG_GETARG_POINTER(0);
+    spgPickSplitOut *out = (spgPickSplitOut *) PG_GETARG_POINTER(1);
+    const Kmer *kmer0 = DatumGetKmerP(in->datums[0]);
+    Kmer        common;
+    int         i;
+
+    /* Longest prefix shared by all the kmers from this level on */
+    common.bases = KMER_RADIX_SHIFT(kmer0->bases, in->level);
+    common.length = Max(kmer0->length - in->level, 0);
+    for (i = 1; i < in->nTuples && common.length > 0; i++)
+        common.length = radix_common(DatumGetKmerP(in->datums[i]), in->level, &common);
+
+    out->hasPrefix = common.length > 0;
+    if (out->hasPrefix)
+        out->prefixDatum = KmerPGetDatum(kmer_make(common.bases, common.length));
+
+    out->nNodes = KMER_RADIX_NODES;
+    out->nodeLabels = NULL;
+    out->mapTuplesToNodes = (int *) palloc(sizeof(int) * in->nTuples);
+    out->leafTupleDatums = (Datum *) palloc(sizeof(Datum) * in->nTuples);
+
+    for (i = 0; i < in->nTuples; i++)
+    {
+        out->mapTuplesToNodes[i] = radix_node(DatumGetKmerP(in->datums[i]),
+                                              in->level + common.length);
+        out->leafTupleDatums[i] = in->datums[i];
+    }
+
+    PG_RETURN_VOID();
+}
+
+/*
+ * Nodes (as a bitmap) of an inner tuple at level with the given prefix that
+ * may hold kmers satisfying the scan key
+ */
+static int
+radix_consistent_nodes(ScanKey key, int level, const Kmer *prefix)
+{
+    int     pos = level + prefix->length;
+
+    switch (key->sk_strategy)
+    {
+        case KMER_EQUAL_STRATEGY:
+        {
+            const Kmer *query = DatumGetKmerP(key->sk_argument);
+
+            if (radix_common(query, level, prefix) < prefix->length)
+                return 0;
+            return 1 << radix_node(query, pos);
+        }
+        case KMER_PREFIX_STRATEGY:
+        {
+            const Kmer *query = DatumGetKmerP(key->sk_argument);
+
+            if (radix_common(query, level, prefix) < Min(prefix->length, query->length - level))
+                return 0;
+            return pos < query->length ? 1 << KMER_GET_BASE(query, pos) : 0xF;
+        }
+        case KMER_CONTAINS_STRATEGY:
+        {
+            const Qkmer *query = DatumGetQkmerP(key->sk_argument);
+
+            /* the kmers below are at least as long as the prefix */
+            if (prefix->length > 0 && pos > query->length)
+                return 0;
+            for (int i = 0; i < prefix->length; i++)
+                if (!(QKMER_GET_MASK(query, level + i) & (1 << KMER_GET_BASE(prefix, i))))
+                    return 0;
+            return pos < query->length ? QKMER_GET_MASK(query, pos) : 1;
+        }
+        default:
+            elog(ERROR, "unrecognized strategy number: %d", key->sk_strategy);
+            return 0;
+    }
+}
+
+PG_FUNCTION_INFO_V1(spg_kmer_radix_inner_consistent);
+Datum
+spg_kmer_radix_inner_consistent(PG_FUNCTION_ARGS)
+{
+    spgInnerConsistentIn *in = (spgInnerConsistentIn *) PG_GETARG_POINTER(0);
+    spgInnerConsistentOut *out = (spgInnerConsistentOut *) PG_GETARG_POINTER(1);
+    Kmer        prefix;
+    int         nodes = 0xF;
+    int         i;
+
+    memset(&prefix, 0, sizeof(Kmer));
+    if (in->hasPrefix)
+        prefix = *DatumGetKmerP(in->prefixDatum);
+
+    for (i = 0; i < in->nkeys && nodes != 0; i++)
+        nodes &= radix_consistent_nodes(&in->scankeys[i], in->level, &prefix);
+
+    out->nodeNumbers = (int *) palloc(sizeof(int) * in->nNodes);
+    out->levelAdds = (int *) palloc(sizeof(int) * in->nNodes);
+    out->nNodes = 0;
+
+    for (i = 0; i < in->nNodes; i++)
+    {
+        /* the base of an allTheSame tuple is unknown, all nodes are visited */
+        if (in->allTheSame ? nodes != 0 : (nodes & (1 << i)) != 0)
+        {
+            out->nodeNumbers[out->nNodes] = i;
+            out->levelAdds[out->nNodes] = prefix.length + 1;
+            out->nNodes++;
+        }
+    }
+
+    PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(spg_kmer_radix_leaf_consistent);
+Datum
+spg_kmer_radix_leaf_consistent(PG_FUNCTION_ARGS)
+{
+    spgLeafConsistentIn *in = (spgLeafConsistentIn *) PG_GETARG_POINTER(0);
+    spgLeafConsistentOut *out = (spgLeafConsistentOut *) PG_GETARG_POINTER(1);
+    const Kmer *leaf = DatumGetKmerP(in->leafDatum);
+    bool        res = true;
+    int         j;
+
+    /* leaves hold whole kmers, all tests are exact */
+    out->recheck = false;
+    out->leafValue = in->leafDatum;
+
+    for (j = 0; j < in->nkeys && res; j++)
+    {
+        switch (in->scankeys[j].sk_strategy)
+        {
+            case KMER_EQUAL_STRATEGY:
+            {
+                const Kmer *query = DatumGetKmerP(in->scankeys[j].sk_argument);
+
+                res = leaf->bases == query->bases && leaf->length == query->length;
+                break;
+            }
+            case KMER_PREFIX_STRATEGY:
+            {
+                const Kmer *query = DatumGetKmerP(in->scankeys[j].sk_argument);
+
+                res = query->length <= leaf->length &&
+                      ((leaf->bases ^ query->bases) & KMER_PREFIX_MASK(query->length)) == 0;
+                break;
+            }
+            case KMER_CONTAINS_STRATEGY:
+                res = qkmer_matches(DatumGetQkmerP(in->scankeys[j].sk_argument), leaf);
+                break;
+            default:
+                elog(ERROR, "unrecognized strategy number: %d",
+                     in->scankeys[j].sk_strategy);
+                break;
+        }
+    }
+
+    PG_RETURN_BOOL(res);
+}
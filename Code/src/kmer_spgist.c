@@ -0,0 +1,1348 @@
+#include "postgres.h"
+
+#include "access/parallel.h"
+#include "access/relscan.h"
+#include "access/spgist_private.h"
+#include "access/table.h"
+#include "access/tableam.h"
+#include "access/xact.h"
+#include "access/xloginsert.h"
+#include "catalog/index.h"
+#include "catalog/pg_type.h"
+#include "executor/instrument.h"
+#include "executor/tuptable.h"
+#include "miscadmin.h"
+#include "optimizer/optimizer.h"
+#include "pgstat.h"
+#include "port/pg_bitutils.h"
+#include "storage/bufmgr.h"
+#include "storage/condition_variable.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/tuplesort.h"
+#include "utils/typcache.h"
+#include "utils/wait_event.h"
+
+#include "dna.h"
+#include "kmer.h"
+
+/*
+ * Bulk build of the SP-GiST kmer indexes (access method kmer_spgist).
+ *
+ * kmer_spgist is SP-GiST with another build routine: scans, inserts and
+ * vacuums of its indexes are the core ones, with the same operator classes
+ * kmer_index_support and kmer_radix_ops. The core build inserts the kmers one
+ * at a time, splitting leaf pages as they fill up, which reads and writes
+ * pages all over the index once it outgrows shared buffers. Here the kmers
+ * are sorted first, in parallel when max_parallel_maintenance_workers allows
+ * it, and the tree is written bottom-up in one pass over them:
+ *
+ * - the sorted kmers are cut into the largest groups sharing a subtree of the
+ *   trie of the operator class that fit on a leaf page. Each group is written
+ *   as a leaf chain as soon as it is known, the chains filling the leaf pages
+ *   up to the fillfactor;
+ * - the inner tuples above the chains, those of the trie compressed along
+ *   common prefixes, are built with a stack over the groups and kept in
+ *   memory until the leaves are done (one per few hundred leaves);
+ * - a kmer repeated beyond a leaf page gets allTheSame inner tuples, as the
+ *   core would have made them;
+ * - the inner tuples are laid out from the root, each on the page of its
+ *   parent when there is room and else on a page whose block number is the
+ *   parent's plus one modulo 3, the rule followed by the core.
+ *
+ * Null values are inserted afterwards by the core, which also builds the
+ * indexes of other operator classes and those with INCLUDE columns.
+ */
+
+/* Nodes of the allTheSame inner tuples */
+#define KMER_BUILD_SAME_NODES   8
+/* At most 4 bases and the end of the kmer below an inner tuple */
+#define KMER_BUILD_MAX_CHILDREN 5
+/* Leaf pages being filled at a time, the chains going to the fullest one */
+#define KMER_BUILD_LEAF_PAGES   8
+
+#define PARALLEL_KEY_KMER_SHARED    UINT64CONST(0xD000000000000001)
+#define PARALLEL_KEY_TUPLESORT      UINT64CONST(0xD000000000000002)
+#define PARALLEL_KEY_QUERY_TEXT     UINT64CONST(0xD000000000000003)
+#define PARALLEL_KEY_WAL_USAGE      UINT64CONST(0xD000000000000004)
+#define PARALLEL_KEY_BUFFER_USAGE   UINT64CONST(0xD000000000000005)
+
+typedef struct KmerBuildItem
+{
+    Kmer        kmer;
+    ItemPointerData tid;
+} KmerBuildItem;
+
+/* Downlink of a node: an inner tuple of the build or the head of a leaf chain */
+typedef struct KmerBuildChild
+{
+    int32       inner;          /* index in KmerBuildState.inners, or -1 */
+    ItemPointerData tid;        /* leaf chain if inner is -1, invalid if none */
+} KmerBuildChild;
+
+/* Inner tuple, formed once the places of its children are known */
+typedef struct KmerBuildInner
+{
+    Kmer        prefix;         /* bases from the level of the tuple on */
+    bool        allTheSame;
+    int16       nNodes;
+    int16       labels[KMER_BUILD_SAME_NODES];  /* kmer_index_support */
+    KmerBuildChild nodes[KMER_BUILD_SAME_NODES];
+    uint16      size;
+    BlockNumber blkno;
+    OffsetNumber offnum;
+} KmerBuildInner;
+
+/* Node of the trie whose children are not all known yet */
+typedef struct KmerBuildOpen
+{
+    int         pos;            /* position where the kmers below differ */
+    Kmer        first;          /* first kmer below */
+    int32       minLength;      /* length of the shortest kmer below */
+    int         nChildren;
+    int         symbols[KMER_BUILD_MAX_CHILDREN];
+    KmerBuildChild children[KMER_BUILD_MAX_CHILDREN];
+} KmerBuildOpen;
+
+/* Subtree waiting for its parent: a group, or a node of the trie */
+typedef struct KmerBuildSubtree
+{
+    bool        open;           /* node, else the written group ref */
+    KmerBuildOpen node;
+    KmerBuildChild ref;
+    Kmer        first;
+    int32       minLength;
+} KmerBuildSubtree;
+
+/* Page of inner tuples being laid out */
+typedef struct KmerBuildPage
+{
+    BlockNumber blkno;
+    Size        free;           /* space left up to the fillfactor */
+    OffsetNumber nTuples;
+} KmerBuildPage;
+
+typedef struct KmerBuildState
+{
+    Relation    index;
+    SpGistState spgstate;
+    bool        radix;          /* kmer_radix_ops, else kmer_index_support */
+    Size        pageSlack;      /* free space left on the pages */
+    Size        pageSpace;      /* and space filled */
+    Size        leafSize;       /* of a leaf tuple with its line pointer */
+    int         chainMax;       /* kmers of a leaf chain */
+
+    Tuplesortstate *sort;
+    TupleTableSlot *slot;
+    bool        sortDone;       /* no kmer left */
+    bool        nullPending;    /* slot holds the first null */
+
+    KmerBuildItem *items;       /* next sorted kmers, chainMax + 1 at most */
+    int         nItems;
+    int         prevCommon;     /* depth shared by the last group and items */
+
+    Buffer      leafBuffers[KMER_BUILD_LEAF_PAGES]; /* pinned */
+    Size        leafFree[KMER_BUILD_LEAF_PAGES];    /* up to the fillfactor */
+    int         nLeafBuffers;
+
+    KmerBuildInner *inners;
+    int32       nInners;
+    int32       maxInners;
+
+    KmerBuildOpen stack[KMER_MAX_LENGTH + 2];
+    int         depth;
+    bool        hasPending;
+    KmerBuildSubtree pending;   /* last group or node, without parent yet */
+
+    KmerBuildPage *pages;
+    int         nPages;
+    int         maxPages;
+    int         openPages[3];   /* page being filled of each block parity */
+    BlockNumber nextBlock;
+
+    MemoryContext tmpCtx;
+} KmerBuildState;
+
+/* Sort of (kmer, heap tid) rows, filled by the table scan */
+typedef struct KmerBuildSpool
+{
+    Tuplesortstate *sort;
+    TupleTableSlot *slot;
+    double      indtuples;
+} KmerBuildSpool;
+
+/* Shared state of a parallel build */
+typedef struct KmerBuildShared
+{
+    Oid         heaprelid;
+    Oid         indexrelid;
+    bool        isconcurrent;
+    int         scantuplesortstates;
+
+    ConditionVariable workersdonecv;
+
+    slock_t     mutex;
+    int         nparticipantsdone;
+    double      reltuples;
+    double      indtuples;
+    bool        brokenhotchain;
+
+    /* ParallelTableScanDescData follows */
+} KmerBuildShared;
+
+#define ParallelTableScanFromKmerBuildShared(shared) \
+    (ParallelTableScanDesc) ((char *) (shared) + BUFFERALIGN(sizeof(KmerBuildShared)))
+
+typedef struct KmerBuildLeader
+{
+    ParallelContext *pcxt;
+    int         nparticipants;  /* launched workers and the leader */
+    KmerBuildShared *shared;
+    Sharedsort *sharedsort;
+    Snapshot    snapshot;
+    WalUsage   *walusage;
+    BufferUsage *bufferusage;
+} KmerBuildLeader;
+
+PGDLLEXPORT void kmer_spgist_build_main(dsm_segment *seg, shm_toc *toc);
+
+/* Bases of kmer from pos on, left-aligned */
+static inline uint64
+kmer_build_bases_from(const Kmer *kmer, int pos)
+{
+    return pos >= KMER_MAX_LENGTH ? UINT64CONST(0) : kmer->bases << (2 * pos);
+}
+
+/*
+ * Depth down to which two kmers follow the same path of the trie: the number
+ * of leading positions with the same symbol. kmer_radix_ops reads the bases
+ * padded with A (code 0) up to 32, kmer_index_support the bases followed by
+ * an end mark, so that equal kmers share length + 1 positions.
+ */
+static int
+kmer_build_common(const KmerBuildState *bs, const Kmer *a, const Kmer *b)
+{
+    uint64  diff = a->bases ^ b->bases;
+    int     common = diff == 0 ? KMER_MAX_LENGTH : (63 - pg_leftmost_one_pos64(diff)) / 2;
+    int     minLength = Min(a->length, b->length);
+
+    if (bs->radix || common < minLength)
+        return common;
+    return a->length == b->length ? minLength + 1 : minLength;
+}
+
+/* Depth from which kmers sharing the path of kmer are equal in the trie */
+static inline int
+kmer_build_max_depth(const KmerBuildState *bs, const Kmer *kmer)
+{
+    return bs->radix ? KMER_MAX_LENGTH : kmer->length + 1;
+}
+
+/* Symbol of kmer at pos: its base, or -1 past its end for kmer_index_support */
+static inline int
+kmer_build_symbol(const KmerBuildState *bs, const Kmer *kmer, int pos)
+{
+    if (pos < kmer->length)
+        return (int) KMER_GET_BASE(kmer, pos);
+    return bs->radix ? 0 : -1;
+}
+
+/*
+ * Level of a subtree holding kmer below a node of the trie at pos (-1 for
+ * the root). Under kmer_index_support a kmer ending at pos is in the node
+ * labelled -1, which does not consume a position.
+ */
+static inline int
+kmer_build_level(const KmerBuildState *bs, const Kmer *kmer, int pos)
+{
+    if (pos < 0)
+        return 0;
+    if (!bs->radix && kmer->length == pos)
+        return pos;
+    return pos + 1;
+}
+
+/* Bases [from, to) of kmer, as a prefix */
+static Kmer
+kmer_build_prefix(const Kmer *kmer, int from, int to)
+{
+    Kmer    prefix;
+
+    prefix.length = Max(to - from, 0);
+    prefix.bases = kmer_build_bases_from(kmer, from) & KMER_PREFIX_MASK(prefix.length);
+    return prefix;
+}
+
+/*
+ * Next kmers of the sort, up to chainMax + 1 of them, which tells whether a
+ * group fits on a leaf page
+ */
+static void
+kmer_build_fill(KmerBuildState *bs)
+{
+    while (!bs->sortDone && bs->nItems <= bs->chainMax)
+    {
+        KmerBuildItem *item;
+        Datum   value;
+        bool    isnull;
+
+        if (!tuplesort_gettupleslot(bs->sort, true, false, bs->slot, NULL))
+        {
+            bs->sortDone = true;
+            break;
+        }
+        value = slot_getattr(bs->slot, 1, &isnull);
+        if (isnull)
+        {
+            /* Nulls sort last */
+            bs->sortDone = true;
+            bs->nullPending = true;
+            break;
+        }
+        item = &bs->items[bs->nItems++];
+        item->kmer = *DatumGetKmerP(value);
+        item->tid = *(ItemPointer) DatumGetPointer(slot_getattr(bs->slot, 2, &isnull));
+    }
+}
+
+static void
+kmer_build_consume(KmerBuildState *bs, int count)
+{
+    bs->nItems -= count;
+    memmove(bs->items, bs->items + count, sizeof(KmerBuildItem) * bs->nItems);
+}
+
+/*
+ * Writes the leaves of count kmers below a node at level and returns the
+ * head of their chain. The leaves of a root leaf page are not chained.
+ */
+static ItemPointerData
+kmer_build_write_leaves(KmerBuildState *bs, const KmerBuildItem *items,
+                        int count, int level, bool root)
+{
+    Buffer      buffer;
+    Page        page;
+    OffsetNumber first;
+    ItemPointerData head;
+    MemoryContext oldCtx;
+    int         i;
+
+    if (root)
+    {
+        buffer = ReadBuffer(bs->index, SPGIST_ROOT_BLKNO);
+        LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+    }
+    else
+    {
+        Size    size = count * bs->leafSize;
+        int     best = -1;
+
+        /* Best fit among the pages being filled, else a new one */
+        for (i = 0; i < bs->nLeafBuffers; i++)
+        {
+            if (bs->leafFree[i] >= size &&
+                (best < 0 || bs->leafFree[i] < bs->leafFree[best]))
+                best = i;
+        }
+        if (best < 0)
+        {
+            if (bs->nLeafBuffers < KMER_BUILD_LEAF_PAGES)
+                best = bs->nLeafBuffers++;
+            else
+            {
+                /* Done with the fullest page */
+                best = 0;
+                for (i = 1; i < bs->nLeafBuffers; i++)
+                {
+                    if (bs->leafFree[i] < bs->leafFree[best])
+                        best = i;
+                }
+                ReleaseBuffer(bs->leafBuffers[best]);
+            }
+            bs->leafBuffers[best] = SpGistNewBuffer(bs->index);
+            SpGistInitBuffer(bs->leafBuffers[best], SPGIST_LEAF);
+            bs->leafFree[best] = bs->pageSpace;
+        }
+        else
+            LockBuffer(bs->leafBuffers[best], BUFFER_LOCK_EXCLUSIVE);
+        bs->leafFree[best] -= size;
+        buffer = bs->leafBuffers[best];
+    }
+
+    page = BufferGetPage(buffer);
+    first = PageGetMaxOffsetNumber(page) + 1;
+    oldCtx = MemoryContextSwitchTo(bs->tmpCtx);
+    for (i = 0; i < count; i++)
+    {
+        Kmer        leaf = items[i].kmer;
+        Datum       datum = KmerPGetDatum(&leaf);
+        bool        isnull = false;
+        SpGistLeafTuple tuple;
+
+        /* kmer_index_support leaves hold the suffix from the level */
+        if (!bs->radix)
+        {
+            leaf.bases = kmer_build_bases_from(&items[i].kmer, level);
+            leaf.length = items[i].kmer.length - level;
+        }
+        tuple = spgFormLeafTuple(&bs->spgstate, (ItemPointer) &items[i].tid,
+                                 &datum, &isnull);
+        SGLT_SET_NEXTOFFSET(tuple, root || i == count - 1 ?
+                            InvalidOffsetNumber : first + i + 1);
+        if (PageAddItem(page, (Item) tuple, tuple->size, InvalidOffsetNumber,
+                        false, false) != first + i)
+            elog(ERROR, "failed to add item of size %u to SPGiST index page",
+                 tuple->size);
+    }
+    MemoryContextSwitchTo(oldCtx);
+    MemoryContextReset(bs->tmpCtx);
+
+    MarkBufferDirty(buffer);
+    ItemPointerSet(&head, BufferGetBlockNumber(buffer), first);
+    if (root)
+        UnlockReleaseBuffer(buffer);
+    else
+        LockBuffer(buffer, BUFFER_LOCK_UNLOCK);
+    return head;
+}
+
+static SpGistInnerTuple
+kmer_build_form_inner(KmerBuildState *bs, const KmerBuildInner *inner)
+{
+    SpGistNodeTuple nodes[KMER_BUILD_SAME_NODES];
+    Datum       prefix = (Datum) 0;
+    SpGistInnerTuple tuple;
+    int         i;
+
+    for (i = 0; i < inner->nNodes; i++)
+    {
+        const KmerBuildChild *child = &inner->nodes[i];
+
+        if (bs->radix)
+            nodes[i] = spgFormNodeTuple(&bs->spgstate, (Datum) 0, true);
+        else
+            nodes[i] = spgFormNodeTuple(&bs->spgstate,
+                                        Int16GetDatum(inner->labels[i]), false);
+        if (child->inner >= 0)
+            ItemPointerSet(&nodes[i]->t_tid, bs->inners[child->inner].blkno,
+                           bs->inners[child->inner].offnum);
+        else
+            nodes[i]->t_tid = child->tid;
+    }
+
+    if (inner->prefix.length > 0)
+    {
+        if (bs->radix)
+            prefix = KmerPGetDatum(&inner->prefix);
+        else
+        {
+            char    str[KMER_MAX_LENGTH];
+
+            for (i = 0; i < inner->prefix.length; i++)
+                str[i] = dna_nucleotides[KMER_GET_BASE(&inner->prefix, i)];
+            prefix = PointerGetDatum(cstring_to_text_with_len(str, inner->prefix.length));
+        }
+    }
+
+    tuple = spgFormInnerTuple(&bs->spgstate, inner->prefix.length > 0, prefix,
+                              inner->nNodes, nodes);
+    tuple->allTheSame = inner->allTheSame;
+    return tuple;
+}
+
+/* Keeps an inner tuple until the layout, its children being already kept */
+static KmerBuildChild
+kmer_build_add_inner(KmerBuildState *bs, KmerBuildInner *inner)
+{
+    MemoryContext oldCtx = MemoryContextSwitchTo(bs->tmpCtx);
+    KmerBuildChild ref;
+
+    inner->size = kmer_build_form_inner(bs, inner)->size;
+    inner->blkno = InvalidBlockNumber;
+    inner->offnum = InvalidOffsetNumber;
+    MemoryContextSwitchTo(oldCtx);
+    MemoryContextReset(bs->tmpCtx);
+
+    if (bs->nInners == bs->maxInners)
+    {
+        bs->maxInners *= 2;
+        bs->inners = (KmerBuildInner *) repalloc_huge(bs->inners,
+                                                      sizeof(KmerBuildInner) * bs->maxInners);
+    }
+    bs->inners[bs->nInners] = *inner;
+    ref.inner = bs->nInners++;
+    ItemPointerSetInvalid(&ref.tid);
+    return ref;
+}
+
+static void
+kmer_build_init_inner(KmerBuildInner *inner, int nNodes)
+{
+    int     i;
+
+    memset(inner, 0, sizeof(KmerBuildInner));
+    inner->nNodes = nNodes;
+    for (i = 0; i < nNodes; i++)
+    {
+        inner->labels[i] = -1;
+        inner->nodes[i].inner = -1;
+        ItemPointerSetInvalid(&inner->nodes[i].tid);
+    }
+}
+
+/*
+ * allTheSame inner tuples over n leaf chains of kmers equal in the trie, 8
+ * nodes per tuple. The top one, at level, has the prefix up to where the
+ * core would have found the kmers to be the same; the ones below have none.
+ */
+static KmerBuildChild
+kmer_build_same_tree(KmerBuildState *bs, const KmerBuildChild *chains, int n,
+                     const Kmer *kmer, int32 minLength, int level, bool top)
+{
+    KmerBuildInner inner;
+    int         i;
+
+    kmer_build_init_inner(&inner, KMER_BUILD_SAME_NODES);
+    inner.allTheSame = true;
+    if (top)
+        inner.prefix = kmer_build_prefix(kmer, level,
+                                         bs->radix ? minLength : kmer->length);
+
+    if (n <= KMER_BUILD_SAME_NODES)
+    {
+        for (i = 0; i < n; i++)
+            inner.nodes[i] = chains[i];
+    }
+    else
+    {
+        for (i = 0; i < KMER_BUILD_SAME_NODES; i++)
+        {
+            int     lo = (int) ((int64) n * i / KMER_BUILD_SAME_NODES);
+            int     hi = (int) ((int64) n * (i + 1) / KMER_BUILD_SAME_NODES);
+
+            inner.nodes[i] = hi - lo == 1 ? chains[lo] :
+                kmer_build_same_tree(bs, chains + lo, hi - lo, kmer, minLength,
+                                     level, false);
+        }
+    }
+    return kmer_build_add_inner(bs, &inner);
+}
+
+/*
+ * Inner tuple of a node of the trie at level. kmer_radix_ops prefixes stop
+ * at the shortest kmer below (radix_common), so between there and the node
+ * the positions get tuples with a single node.
+ */
+static KmerBuildChild
+kmer_build_close(KmerBuildState *bs, const KmerBuildOpen *node, int level)
+{
+    KmerBuildInner inner;
+    int         i;
+
+    if (bs->radix && node->pos > Max(node->minLength, level))
+    {
+        int     end = Max(node->minLength, level);
+
+        kmer_build_init_inner(&inner, 4);
+        inner.nodes[kmer_build_symbol(bs, &node->first, end)] =
+            kmer_build_close(bs, node, end + 1);
+        inner.prefix = kmer_build_prefix(&node->first, level, end);
+        return kmer_build_add_inner(bs, &inner);
+    }
+
+    kmer_build_init_inner(&inner, bs->radix ? 4 : node->nChildren);
+    inner.prefix = kmer_build_prefix(&node->first, level, node->pos);
+    for (i = 0; i < node->nChildren; i++)
+    {
+        int     symbol = node->symbols[i];
+
+        if (bs->radix)
+            inner.nodes[symbol] = node->children[i];
+        else
+        {
+            inner.labels[i] = symbol < 0 ? -1 : (int16) dna_nucleotides[symbol];
+            inner.nodes[i] = node->children[i];
+        }
+    }
+    return kmer_build_add_inner(bs, &inner);
+}
+
+/* Hangs a subtree below a node of the trie, forming its inner tuples */
+static void
+kmer_build_attach(KmerBuildState *bs, KmerBuildOpen *node, const KmerBuildSubtree *sub)
+{
+    if (node->nChildren == 0)
+    {
+        node->first = sub->first;
+        node->minLength = sub->minLength;
+    }
+    else
+        node->minLength = Min(node->minLength, sub->minLength);
+
+    node->symbols[node->nChildren] = kmer_build_symbol(bs, &sub->first, node->pos);
+    node->children[node->nChildren] = sub->open ?
+        kmer_build_close(bs, &sub->node, node->pos + 1) : sub->ref;
+    node->nChildren++;
+}
+
+static void
+kmer_build_subtree_of(KmerBuildSubtree *sub, const KmerBuildOpen *node)
+{
+    sub->open = true;
+    sub->node = *node;
+    sub->first = node->first;
+    sub->minLength = node->minLength;
+}
+
+/*
+ * Adds a group following the previous one at the given depth of the trie.
+ * The stack holds the nodes of the trie on the path of the previous group,
+ * deepest last: those deeper than the new group are complete.
+ */
+static void
+kmer_build_push_group(KmerBuildState *bs, const KmerBuildSubtree *group, int common)
+{
+    if (bs->hasPending)
+    {
+        KmerBuildSubtree sub = bs->pending;
+
+        while (bs->depth > 0 && bs->stack[bs->depth - 1].pos > common)
+        {
+            KmerBuildOpen *node = &bs->stack[--bs->depth];
+
+            kmer_build_attach(bs, node, &sub);
+            kmer_build_subtree_of(&sub, node);
+        }
+        if (bs->depth == 0 || bs->stack[bs->depth - 1].pos < common)
+        {
+            KmerBuildOpen *node = &bs->stack[bs->depth++];
+
+            node->pos = common;
+            node->nChildren = 0;
+        }
+        kmer_build_attach(bs, &bs->stack[bs->depth - 1], &sub);
+    }
+    bs->pending = *group;
+    bs->hasPending = true;
+}
+
+/* Root of the trie, once all the groups are added */
+static KmerBuildChild
+kmer_build_finish_trie(KmerBuildState *bs)
+{
+    KmerBuildSubtree sub = bs->pending;
+
+    while (bs->depth > 0)
+    {
+        KmerBuildOpen *node = &bs->stack[--bs->depth];
+
+        kmer_build_attach(bs, node, &sub);
+        kmer_build_subtree_of(&sub, node);
+    }
+    return sub.open ? kmer_build_close(bs, &sub.node, 0) : sub.ref;
+}
+
+/*
+ * Writes the kmers equal in the trie to the first one, more than a leaf page
+ * holds, as chains of full pages below allTheSame inner tuples. Returns the
+ * depth shared with the next kmer.
+ */
+static int
+kmer_build_same_group(KmerBuildState *bs, KmerBuildSubtree *group)
+{
+    Kmer        head = bs->items[0].kmer;
+    int         depth = kmer_build_max_depth(bs, &head);
+    KmerBuildChild *chains;
+    int         nChains = 0;
+    int         maxChains = 16;
+    int         next;
+
+    chains = (KmerBuildChild *) palloc(sizeof(KmerBuildChild) * maxChains);
+    for (;;)
+    {
+        int     count;
+
+        kmer_build_fill(bs);
+        for (count = 0; count < bs->nItems && count < bs->chainMax; count++)
+        {
+            if (kmer_build_common(bs, &head, &bs->items[count].kmer) < depth)
+                break;
+            group->minLength = Min(group->minLength, bs->items[count].kmer.length);
+        }
+        if (count == 0)
+            break;
+
+        if (nChains == maxChains)
+        {
+            maxChains *= 2;
+            chains = (KmerBuildChild *) repalloc_huge(chains, sizeof(KmerBuildChild) * maxChains);
+        }
+        /* Below the node labelled -1 the kmer_index_support leaves are empty */
+        chains[nChains].inner = -1;
+        chains[nChains].tid = kmer_build_write_leaves(bs, bs->items, count,
+                                                      head.length, false);
+        nChains++;
+        kmer_build_consume(bs, count);
+        if (count < bs->chainMax)
+            break;
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    next = bs->nItems > 0 ? kmer_build_common(bs, &head, &bs->items[0].kmer) : -1;
+    group->ref = kmer_build_same_tree(bs, chains, nChains, &head, group->minLength,
+                                      kmer_build_level(bs, &head, Max(bs->prevCommon, next)),
+                                      true);
+    pfree(chains);
+    return next;
+}
+
+/*
+ * Cuts the next group off the sorted kmers and writes it. The group of the
+ * first kmer is the shallowest subtree of the trie below the depth shared
+ * with the previous group that fits on a leaf page, so that each node of the
+ * trie gets either a single leaf chain or inner tuples. Returns false once
+ * the kmers are exhausted.
+ */
+static bool
+kmer_build_next_group(KmerBuildState *bs)
+{
+    KmerBuildSubtree group;
+    const Kmer *head;
+    int         depth;
+    int         next;
+
+    kmer_build_fill(bs);
+    if (bs->nItems == 0)
+        return false;
+
+    head = &bs->items[0].kmer;
+    depth = bs->prevCommon;
+    if (bs->nItems > bs->chainMax)
+        depth = Max(depth, kmer_build_common(bs, head, &bs->items[bs->chainMax].kmer));
+    depth++;
+
+    memset(&group, 0, sizeof(group));
+    group.first = *head;
+    group.minLength = head->length;
+    if (depth > kmer_build_max_depth(bs, head))
+        next = kmer_build_same_group(bs, &group);
+    else
+    {
+        int     count;
+        int     pos;
+
+        for (count = 1; count < bs->nItems; count++)
+        {
+            if (kmer_build_common(bs, head, &bs->items[count].kmer) < depth)
+                break;
+            group.minLength = Min(group.minLength, bs->items[count].kmer.length);
+        }
+        next = count < bs->nItems ?
+            kmer_build_common(bs, head, &bs->items[count].kmer) : -1;
+
+        /* The parent node is at the deepest position shared with a neighbour */
+        pos = Max(bs->prevCommon, next);
+        group.ref.inner = -1;
+        group.ref.tid = kmer_build_write_leaves(bs, bs->items, count,
+                                                kmer_build_level(bs, head, pos),
+                                                pos < 0);
+        kmer_build_consume(bs, count);
+    }
+
+    kmer_build_push_group(bs, &group, bs->prevCommon);
+    bs->prevCommon = next;
+    return true;
+}
+
+/* A page of the given block parity with room for size bytes */
+static int
+kmer_build_inner_page(KmerBuildState *bs, int parity, Size size)
+{
+    int     page = bs->openPages[parity];
+
+    if (page >= 0 && bs->pages[page].free >= size)
+        return page;
+
+    /* Pages are numbered in order, the skipped parities get a new page too */
+    do
+    {
+        if (bs->nPages == bs->maxPages)
+        {
+            bs->maxPages *= 2;
+            bs->pages = (KmerBuildPage *) repalloc(bs->pages,
+                                                   sizeof(KmerBuildPage) * bs->maxPages);
+        }
+        page = bs->nPages++;
+        bs->pages[page].blkno = bs->nextBlock++;
+        bs->pages[page].free = bs->pageSpace;
+        bs->pages[page].nTuples = 0;
+        bs->openPages[bs->pages[page].blkno % 3] = page;
+    } while (bs->pages[page].blkno % 3 != parity);
+    return page;
+}
+
+/* Places an inner tuple on a page with room for it, then its children */
+static void
+kmer_build_place(KmerBuildState *bs, int32 i, int page)
+{
+    int     n;
+
+    bs->inners[i].blkno = bs->pages[page].blkno;
+    bs->inners[i].offnum = ++bs->pages[page].nTuples;
+    bs->pages[page].free -= bs->inners[i].size + sizeof(ItemIdData);
+
+    for (n = 0; n < bs->inners[i].nNodes; n++)
+    {
+        int32   child = bs->inners[i].nodes[n].inner;
+        Size    size;
+
+        if (child < 0)
+            continue;
+        size = bs->inners[child].size + sizeof(ItemIdData);
+        if (bs->pages[page].free >= size)
+            kmer_build_place(bs, child, page);
+        else
+            kmer_build_place(bs, child,
+                             kmer_build_inner_page(bs, (bs->pages[page].blkno + 1) % 3, size));
+    }
+}
+
+static int
+kmer_build_cmp_place(const void *a, const void *b, void *arg)
+{
+    const KmerBuildInner *inners = (const KmerBuildInner *) arg;
+    const KmerBuildInner *ia = &inners[*(const int32 *) a];
+    const KmerBuildInner *ib = &inners[*(const int32 *) b];
+
+    if (ia->blkno != ib->blkno)
+        return ia->blkno < ib->blkno ? -1 : 1;
+    return (ia->offnum > ib->offnum) - (ia->offnum < ib->offnum);
+}
+
+/* Lays out the inner tuples from the root, at the root page, and writes them */
+static void
+kmer_build_write_inner(KmerBuildState *bs, int32 root)
+{
+    int32      *order;
+    int32       next = 0;
+    int         page;
+    int32       i;
+
+    bs->maxPages = 64;
+    bs->pages = (KmerBuildPage *) palloc(sizeof(KmerBuildPage) * bs->maxPages);
+    bs->nPages = 1;
+    bs->pages[0].blkno = SPGIST_ROOT_BLKNO;
+    bs->pages[0].free = bs->pageSpace;
+    bs->pages[0].nTuples = 0;
+    bs->openPages[0] = bs->openPages[1] = bs->openPages[2] = -1;
+    bs->nextBlock = RelationGetNumberOfBlocks(bs->index);
+    kmer_build_place(bs, root, 0);
+
+    order = (int32 *) palloc_extended(sizeof(int32) * bs->nInners, MCXT_ALLOC_HUGE);
+    for (i = 0; i < bs->nInners; i++)
+        order[i] = i;
+    qsort_arg(order, bs->nInners, sizeof(int32), kmer_build_cmp_place, bs->inners);
+
+    for (page = 0; page < bs->nPages; page++)
+    {
+        BlockNumber blkno = bs->pages[page].blkno;
+        Buffer      buffer;
+
+        if (blkno == SPGIST_ROOT_BLKNO)
+        {
+            buffer = ReadBuffer(bs->index, SPGIST_ROOT_BLKNO);
+            LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+        }
+        else
+        {
+            buffer = SpGistNewBuffer(bs->index);
+            if (BufferGetBlockNumber(buffer) != blkno)
+                elog(ERROR, "unexpected block %u of index \"%s\", expected %u",
+                     BufferGetBlockNumber(buffer), RelationGetRelationName(bs->index),
+                     blkno);
+        }
+        SpGistInitBuffer(buffer, 0);
+
+        for (; next < bs->nInners && bs->inners[order[next]].blkno == blkno; next++)
+        {
+            KmerBuildInner *inner = &bs->inners[order[next]];
+            MemoryContext oldCtx = MemoryContextSwitchTo(bs->tmpCtx);
+            SpGistInnerTuple tuple = kmer_build_form_inner(bs, inner);
+
+            if (PageAddItem(BufferGetPage(buffer), (Item) tuple, tuple->size,
+                            InvalidOffsetNumber, false, false) != inner->offnum)
+                elog(ERROR, "failed to add item of size %u to SPGiST index page",
+                     tuple->size);
+            MemoryContextSwitchTo(oldCtx);
+            MemoryContextReset(bs->tmpCtx);
+        }
+        MarkBufferDirty(buffer);
+        UnlockReleaseBuffer(buffer);
+    }
+    Assert(next == bs->nInners);
+    pfree(order);
+}
+
+/* Writes the tree of the sorted kmers */
+static void
+kmer_build_tree(KmerBuildState *bs)
+{
+    KmerBuildChild root;
+    int         i;
+
+    while (kmer_build_next_group(bs))
+        CHECK_FOR_INTERRUPTS();
+    for (i = 0; i < bs->nLeafBuffers; i++)
+        ReleaseBuffer(bs->leafBuffers[i]);
+
+    if (!bs->hasPending)
+        return;                 /* no kmer, the root stays an empty leaf page */
+    root = kmer_build_finish_trie(bs);
+    if (root.inner >= 0)
+        kmer_build_write_inner(bs, root.inner);
+}
+
+/* Inserts the null (last) rows of the sort, through the core */
+static void
+kmer_build_insert_nulls(KmerBuildState *bs)
+{
+    if (!bs->nullPending)
+        return;
+    do
+    {
+        Datum       value = (Datum) 0;
+        bool        isnull = true;
+        bool        tidnull;
+        ItemPointer tid = (ItemPointer) DatumGetPointer(slot_getattr(bs->slot, 2, &tidnull));
+        MemoryContext oldCtx = MemoryContextSwitchTo(bs->tmpCtx);
+
+        /* As in the core build, a buffer locked elsewhere may need a retry */
+        while (!spgdoinsert(bs->index, &bs->spgstate, tid, &value, &isnull))
+            MemoryContextReset(bs->tmpCtx);
+        MemoryContextSwitchTo(oldCtx);
+        MemoryContextReset(bs->tmpCtx);
+        CHECK_FOR_INTERRUPTS();
+    } while (tuplesort_gettupleslot(bs->sort, true, false, bs->slot, NULL));
+}
+
+/* Rows (kmer, heap tid) of the sort */
+static TupleDesc
+kmer_build_desc(Relation index)
+{
+    TupleDesc   desc = CreateTemplateTupleDesc(2);
+
+    TupleDescInitEntry(desc, 1, "kmer", TupleDescAttr(RelationGetDescr(index), 0)->atttypid,
+                       -1, 0);
+    TupleDescInitEntry(desc, 2, "tid", TIDOID, -1, 0);
+    return desc;
+}
+
+/* Sort by kmer (kmer_btree_ops, with its abbreviated keys), nulls last */
+static Tuplesortstate *
+kmer_build_begin_sort(TupleDesc desc, int workMem, SortCoordinate coordinate)
+{
+    AttrNumber  attNum = 1;
+    Oid         sortOp = lookup_type_cache(TupleDescAttr(desc, 0)->atttypid,
+                                           TYPECACHE_LT_OPR)->lt_opr;
+    Oid         collation = InvalidOid;
+    bool        nullsFirst = false;
+
+    if (!OidIsValid(sortOp))
+        elog(ERROR, "could not find the ordering operator of type kmer");
+    return tuplesort_begin_heap(desc, 1, &attNum, &sortOp, &collation, &nullsFirst,
+                                workMem, coordinate, TUPLESORT_NONE);
+}
+
+static void
+kmer_build_callback(Relation index, ItemPointer tid, Datum *values,
+                    bool *isnull, bool tupleIsAlive, void *state)
+{
+    KmerBuildSpool *spool = (KmerBuildSpool *) state;
+    TupleTableSlot *slot = spool->slot;
+
+    ExecClearTuple(slot);
+    slot->tts_values[0] = values[0];
+    slot->tts_isnull[0] = isnull[0];
+    slot->tts_values[1] = PointerGetDatum(tid);
+    slot->tts_isnull[1] = false;
+    ExecStoreVirtualTuple(slot);
+    tuplesort_puttupleslot(spool->sort, slot);
+    spool->indtuples += 1;
+}
+
+/*
+ * Part of a parallel build done by each participant, the leader included:
+ * scans its share of the table into a worker sort, merged by the leader
+ */
+static void
+kmer_build_scan_and_sort(KmerBuildShared *shared, Sharedsort *sharedsort,
+                         Relation heap, Relation index, int sortmem, bool progress)
+{
+    SortCoordinate coordinate = (SortCoordinate) palloc0(sizeof(SortCoordinateData));
+    TupleDesc   desc = kmer_build_desc(index);
+    KmerBuildSpool spool;
+    IndexInfo  *indexInfo;
+    TableScanDesc scan;
+    double      reltuples;
+
+    coordinate->isWorker = true;
+    coordinate->nParticipants = -1;
+    coordinate->sharedsort = sharedsort;
+    spool.sort = kmer_build_begin_sort(desc, sortmem, coordinate);
+    spool.slot = MakeSingleTupleTableSlot(desc, &TTSOpsVirtual);
+    spool.indtuples = 0;
+
+    indexInfo = BuildIndexInfo(index);
+    indexInfo->ii_Concurrent = shared->isconcurrent;
+    scan = table_beginscan_parallel(heap, ParallelTableScanFromKmerBuildShared(shared));
+    reltuples = table_index_build_scan(heap, index, indexInfo, true, progress,
+                                       kmer_build_callback, &spool, scan);
+    tuplesort_performsort(spool.sort);
+
+    SpinLockAcquire(&shared->mutex);
+    shared->nparticipantsdone++;
+    shared->reltuples += reltuples;
+    shared->indtuples += spool.indtuples;
+    if (indexInfo->ii_BrokenHotChain)
+        shared->brokenhotchain = true;
+    SpinLockRelease(&shared->mutex);
+    ConditionVariableSignal(&shared->workersdonecv);
+
+    tuplesort_end(spool.sort);
+    ExecDropSingleTupleTableSlot(spool.slot);
+}
+
+/* Entry point of the parallel workers */
+void
+kmer_spgist_build_main(dsm_segment *seg, shm_toc *toc)
+{
+    KmerBuildShared *shared;
+    Sharedsort *sharedsort;
+    Relation    heap;
+    Relation    index;
+    LOCKMODE    heapLockmode;
+    LOCKMODE    indexLockmode;
+    WalUsage   *walusage;
+    BufferUsage *bufferusage;
+
+    debug_query_string = shm_toc_lookup(toc, PARALLEL_KEY_QUERY_TEXT, true);
+    pgstat_report_activity(STATE_RUNNING, debug_query_string);
+
+    shared = shm_toc_lookup(toc, PARALLEL_KEY_KMER_SHARED, false);
+    if (!shared->isconcurrent)
+    {
+        heapLockmode = ShareLock;
+        indexLockmode = AccessExclusiveLock;
+    }
+    else
+    {
+        heapLockmode = ShareUpdateExclusiveLock;
+        indexLockmode = RowExclusiveLock;
+    }
+    heap = table_open(shared->heaprelid, heapLockmode);
+    index = index_open(shared->indexrelid, indexLockmode);
+
+    sharedsort = shm_toc_lookup(toc, PARALLEL_KEY_TUPLESORT, false);
+    tuplesort_attach_shared(sharedsort, seg);
+
+    InstrStartParallelQuery();
+    kmer_build_scan_and_sort(shared, sharedsort, heap, index,
+                             maintenance_work_mem / shared->scantuplesortstates, false);
+    walusage = shm_toc_lookup(toc, PARALLEL_KEY_WAL_USAGE, false);
+    bufferusage = shm_toc_lookup(toc, PARALLEL_KEY_BUFFER_USAGE, false);
+    InstrEndParallelQuery(&bufferusage[ParallelWorkerNumber],
+                          &walusage[ParallelWorkerNumber]);
+
+    index_close(index, indexLockmode);
+    table_close(heap, heapLockmode);
+}
+
+static void
+kmer_build_end_parallel(KmerBuildLeader *leader)
+{
+    int     i;
+
+    WaitForParallelWorkersToFinish(leader->pcxt);
+    for (i = 0; i < leader->pcxt->nworkers_launched; i++)
+        InstrAccumParallelQuery(&leader->bufferusage[i], &leader->walusage[i]);
+    if (IsMVCCSnapshot(leader->snapshot))
+        UnregisterSnapshot(leader->snapshot);
+    DestroyParallelContext(leader->pcxt);
+    ExitParallelMode();
+}
+
+/*
+ * Launches the workers of a parallel sort, as for a B-tree. Returns NULL when
+ * none could be launched.
+ */
+static KmerBuildLeader *
+kmer_build_begin_parallel(Relation heap, Relation index, bool isconcurrent, int request)
+{
+    KmerBuildLeader *leader;
+    ParallelContext *pcxt;
+    Snapshot    snapshot;
+    Size        estshared;
+    Size        estsort;
+    int         scantuplesortstates = request + 1;
+    int         querylen = 0;
+    KmerBuildShared *shared;
+    Sharedsort *sharedsort;
+
+    EnterParallelMode();
+    pcxt = CreateParallelContext("dna_seq", "kmer_spgist_build_main", request);
+
+    /* As for a B-tree, a concurrent build only indexes what its snapshot sees */
+    if (!isconcurrent)
+        snapshot = SnapshotAny;
+    else
+        snapshot = RegisterSnapshot(GetTransactionSnapshot());
+
+    estshared = add_size(BUFFERALIGN(sizeof(KmerBuildShared)),
+                         table_parallelscan_estimate(heap, snapshot));
+    shm_toc_estimate_chunk(&pcxt->estimator, estshared);
+    estsort = tuplesort_estimate_shared(scantuplesortstates);
+    shm_toc_estimate_chunk(&pcxt->estimator, estsort);
+    shm_toc_estimate_chunk(&pcxt->estimator, mul_size(sizeof(WalUsage), pcxt->nworkers));
+    shm_toc_estimate_chunk(&pcxt->estimator, mul_size(sizeof(BufferUsage), pcxt->nworkers));
+    if (debug_query_string)
+    {
+        querylen = strlen(debug_query_string);
+        shm_toc_estimate_chunk(&pcxt->estimator, querylen + 1);
+        shm_toc_estimate_keys(&pcxt->estimator, 5);
+    }
+    else
+        shm_toc_estimate_keys(&pcxt->estimator, 4);
+
+    InitializeParallelDSM(pcxt);
+    if (pcxt->seg == NULL)
+    {
+        if (IsMVCCSnapshot(snapshot))
+            UnregisterSnapshot(snapshot);
+        DestroyParallelContext(pcxt);
+        ExitParallelMode();
+        return NULL;
+    }
+
+    shared = (KmerBuildShared *) shm_toc_allocate(pcxt->toc, estshared);
+    shared->heaprelid = RelationGetRelid(heap);
+    shared->indexrelid = RelationGetRelid(index);
+    shared->isconcurrent = isconcurrent;
+    shared->scantuplesortstates = scantuplesortstates;
+    ConditionVariableInit(&shared->workersdonecv);
+    SpinLockInit(&shared->mutex);
+    shared->nparticipantsdone = 0;
+    shared->reltuples = 0;
+    shared->indtuples = 0;
+    shared->brokenhotchain = false;
+    table_parallelscan_initialize(heap, ParallelTableScanFromKmerBuildShared(shared),
+                                  snapshot);
+    shm_toc_insert(pcxt->toc, PARALLEL_KEY_KMER_SHARED, shared);
+
+    sharedsort = (Sharedsort *) shm_toc_allocate(pcxt->toc, estsort);
+    tuplesort_initialize_shared(sharedsort, scantuplesortstates, pcxt->seg);
+    shm_toc_insert(pcxt->toc, PARALLEL_KEY_TUPLESORT, sharedsort);
+
+    if (debug_query_string)
+    {
+        char   *sharedquery = (char *) shm_toc_allocate(pcxt->toc, querylen + 1);
+
+        memcpy(sharedquery, debug_query_string, querylen + 1);
+        shm_toc_insert(pcxt->toc, PARALLEL_KEY_QUERY_TEXT, sharedquery);
+    }
+
+    leader = (KmerBuildLeader *) palloc0(sizeof(KmerBuildLeader));
+    leader->pcxt = pcxt;
+    leader->shared = shared;
+    leader->sharedsort = sharedsort;
+    leader->snapshot = snapshot;
+    leader->walusage = shm_toc_allocate(pcxt->toc, mul_size(sizeof(WalUsage), pcxt->nworkers));
+    shm_toc_insert(pcxt->toc, PARALLEL_KEY_WAL_USAGE, leader->walusage);
+    leader->bufferusage = shm_toc_allocate(pcxt->toc, mul_size(sizeof(BufferUsage), pcxt->nworkers));
+    shm_toc_insert(pcxt->toc, PARALLEL_KEY_BUFFER_USAGE, leader->bufferusage);
+
+    LaunchParallelWorkers(pcxt);
+    if (pcxt->nworkers_launched == 0)
+    {
+        kmer_build_end_parallel(leader);
+        return NULL;
+    }
+    leader->nparticipants = pcxt->nworkers_launched + 1;
+    WaitForParallelWorkersToAttach(pcxt);
+    return leader;
+}
+
+/* Scans the table along with the workers, and waits for them */
+static double
+kmer_build_leader_scan(KmerBuildLeader *leader, Relation heap, Relation index,
+                       IndexInfo *indexInfo, double *indtuples)
+{
+    KmerBuildShared *shared = leader->shared;
+    double      reltuples;
+
+    kmer_build_scan_and_sort(shared, leader->sharedsort, heap, index,
+                             maintenance_work_mem / shared->scantuplesortstates, true);
+    for (;;)
+    {
+        SpinLockAcquire(&shared->mutex);
+        if (shared->nparticipantsdone == leader->nparticipants)
+        {
+            reltuples = shared->reltuples;
+            *indtuples = shared->indtuples;
+            if (shared->brokenhotchain)
+                indexInfo->ii_BrokenHotChain = true;
+            SpinLockRelease(&shared->mutex);
+            break;
+        }
+        SpinLockRelease(&shared->mutex);
+        ConditionVariableSleep(&shared->workersdonecv,
+                               WAIT_EVENT_PARALLEL_CREATE_INDEX_SCAN);
+    }
+    ConditionVariableCancelSleep();
+    return reltuples;
+}
+
+static IndexBuildResult *
+kmer_spgist_build(Relation heap, Relation index, IndexInfo *indexInfo)
+{
+    IndexBuildResult *result;
+    KmerBuildState bs;
+    KmerBuildLeader *leader = NULL;
+    PGFunction  config;
+    TupleDesc   desc;
+    Buffer      metabuffer,
+                rootbuffer,
+                nullbuffer;
+    int         fillfactor;
+    int         nworkers;
+    double      reltuples;
+    double      indtuples;
+
+    if (IndexRelationGetNumberOfAttributes(index) != 1)
+        return spgbuild(heap, index, indexInfo);
+    memset(&bs, 0, sizeof(bs));
+    config = index_getprocinfo(index, 1, SPGIST_CONFIG_PROC)->fn_addr;
+    if (config == spg_kmer_radix_config)
+        bs.radix = true;
+    else if (config != spg_kmer_config)
+        return spgbuild(heap, index, indexInfo);
+
+    if (RelationGetNumberOfBlocks(index) != 0)
+        elog(ERROR, "index \"%s\" already contains data",
+             RelationGetRelationName(index));
+
+    /* Metapage, root and null root, as set up by the core build */
+    metabuffer = SpGistNewBuffer(index);
+    rootbuffer = SpGistNewBuffer(index);
+    nullbuffer = SpGistNewBuffer(index);
+    Assert(BufferGetBlockNumber(metabuffer) == SPGIST_METAPAGE_BLKNO);
+    Assert(BufferGetBlockNumber(rootbuffer) == SPGIST_ROOT_BLKNO);
+    Assert(BufferGetBlockNumber(nullbuffer) == SPGIST_NULL_BLKNO);
+
+    START_CRIT_SECTION();
+    SpGistInitMetapage(BufferGetPage(metabuffer));
+    MarkBufferDirty(metabuffer);
+    SpGistInitBuffer(rootbuffer, SPGIST_LEAF);
+    MarkBufferDirty(rootbuffer);
+    SpGistInitBuffer(nullbuffer, SPGIST_LEAF | SPGIST_NULLS);
+    MarkBufferDirty(nullbuffer);
+    END_CRIT_SECTION();
+
+    UnlockReleaseBuffer(metabuffer);
+    UnlockReleaseBuffer(rootbuffer);
+    UnlockReleaseBuffer(nullbuffer);
+
+    bs.index = index;
+    initSpGistState(&bs.spgstate, index);
+    bs.spgstate.isBuild = true;
+    bs.tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
+                                      "kmer index build temporary context",
+                                      ALLOCSET_DEFAULT_SIZES);
+
+    /* Pages are filled up to the fillfactor, as the core leaves them */
+    fillfactor = index->rd_options ?
+        ((SpGistOptions *) index->rd_options)->fillfactor : SPGIST_DEFAULT_FILLFACTOR;
+    bs.pageSlack = BLCKSZ * (100 - fillfactor) / 100;
+    bs.pageSpace = SPGIST_PAGE_CAPACITY - bs.pageSlack;
+    {
+        Kmer        empty = {0, 0};
+        Datum       datum = KmerPGetDatum(&empty);
+        bool        isnull = false;
+        ItemPointerData tid;
+
+        ItemPointerSetInvalid(&tid);
+        bs.leafSize = spgFormLeafTuple(&bs.spgstate, &tid, &datum, &isnull)->size +
+            sizeof(ItemIdData);
+    }
+    bs.chainMax = bs.pageSpace / bs.leafSize;
+    bs.items = (KmerBuildItem *) palloc(sizeof(KmerBuildItem) * (bs.chainMax + 1));
+    bs.prevCommon = -1;
+    bs.maxInners = 1024;
+    bs.inners = (KmerBuildInner *) palloc(sizeof(KmerBuildInner) * bs.maxInners);
+
+    /* Sort the kmers, with parallel workers if the planner grants some */
+    desc = kmer_build_desc(index);
+    nworkers = plan_create_index_workers(RelationGetRelid(heap), RelationGetRelid(index));
+    if (nworkers > 0)
+        leader = kmer_build_begin_parallel(heap, index, indexInfo->ii_Concurrent, nworkers);
+    if (leader != NULL)
+    {
+        SortCoordinate coordinate = (SortCoordinate) palloc0(sizeof(SortCoordinateData));
+
+        reltuples = kmer_build_leader_scan(leader, heap, index, indexInfo, &indtuples);
+        coordinate->isWorker = false;
+        coordinate->nParticipants = leader->nparticipants;
+        coordinate->sharedsort = leader->sharedsort;
+        bs.sort = kmer_build_begin_sort(desc, maintenance_work_mem, coordinate);
+    }
+    else
+    {
+        KmerBuildSpool spool;
+
+        spool.sort = kmer_build_begin_sort(desc, maintenance_work_mem, NULL);
+        spool.slot = MakeSingleTupleTableSlot(desc, &TTSOpsVirtual);
+        spool.indtuples = 0;
+        reltuples = table_index_build_scan(heap, index, indexInfo, true, true,
+                                           kmer_build_callback, &spool, NULL);
+        ExecDropSingleTupleTableSlot(spool.slot);
+        indtuples = spool.indtuples;
+        bs.sort = spool.sort;
+    }
+    tuplesort_performsort(bs.sort);
+
+    bs.slot = MakeSingleTupleTableSlot(desc, &TTSOpsMinimalTuple);
+    kmer_build_tree(&bs);
+    kmer_build_insert_nulls(&bs);
+    ExecDropSingleTupleTableSlot(bs.slot);
+    tuplesort_end(bs.sort);
+    if (leader != NULL)
+        kmer_build_end_parallel(leader);
+    MemoryContextDelete(bs.tmpCtx);
+
+    SpGistUpdateMetaPage(index);
+
+    /* The pages were written without WAL, log them all as the core does */
+    if (RelationNeedsWAL(index))
+        log_newpage_range(index, MAIN_FORKNUM, 0, RelationGetNumberOfBlocks(index),
+                          true);
+
+    result = (IndexBuildResult *) palloc0(sizeof(IndexBuildResult));
+    result->heap_tuples = reltuples;
+    result->index_tuples = indtuples;
+    return result;
+}
+
+/* SP-GiST, except for the build of the kmer operator classes */
+PG_FUNCTION_INFO_V1(kmer_spgist_handler);
+Datum
+kmer_spgist_handler(PG_FUNCTION_ARGS)
+{
+    IndexAmRoutine *amroutine = (IndexAmRoutine *)
+        DatumGetPointer(DirectFunctionCall1(spghandler, (Datum) 0));
+
+    amroutine->ambuild = kmer_spgist_build;
+    PG_RETURN_POINTER(amroutine);
+}
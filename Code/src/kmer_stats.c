@@ -0,0 +1,339 @@
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "catalog/pg_statistic.h"
+#include "commands/vacuum.h"
+#include "nodes/pathnodes.h"
+#include "port/pg_bitutils.h"
+#include "utils/lsyscache.h"
+#include "utils/selfuncs.h"
+
+#include "dna.h"
+#include "kmer.h"
+#include "kmer_planner.h"
+#include "qkmer.h"
+
+/*
+ * Planner statistics of kmer columns.
+ *
+ * On top of the standard statistics (most common kmers, histogram), ANALYZE
+ * stores a slot of kind STATISTIC_KIND_KMER_BASES whose numbers are, for the
+ * non-null sampled kmers, the fraction having base b at position i (entry
+ * 4 * i + b) followed by the fraction of each length 0..KMER_MAX_LENGTH.
+ * Prefix and qkmer selectivities are derived from them assuming the bases
+ * at different positions are independent.
+ */
+
+/* Outside of the ranges reserved by pg_statistic.h for core and PostGIS */
+#define STATISTIC_KIND_KMER_BASES   5801
+
+#define KMER_STATS_BASES            (4 * KMER_MAX_LENGTH)
+#define KMER_STATS_NUMBERS          (KMER_STATS_BASES + KMER_MAX_LENGTH + 1)
+
+/* Selectivity of a kmer pattern when the column has no statistics */
+#define DEFAULT_KMER_BASE_SEL       0.25
+
+/* State of std_typanalyze, swapped back in while its compute_stats runs */
+typedef struct KmerAnalyzeExtraData {
+    AnalyzeAttrComputeStatsFunc std_compute_stats;
+    void *std_extra_data;
+} KmerAnalyzeExtraData;
+
+static void
+compute_kmer_stats(VacAttrStats *stats, AnalyzeAttrFetchFunc fetchfunc,
+                   int samplerows, double totalrows)
+{
+    KmerAnalyzeExtraData *extra = (KmerAnalyzeExtraData *) stats->extra_data;
+    double  base_counts[KMER_STATS_BASES] = {0};
+    double  length_counts[KMER_MAX_LENGTH + 1] = {0};
+    int     nonnull = 0;
+    int     slot;
+    float4 *numbers;
+
+    /* Most common values, histogram and correlation first */
+    stats->extra_data = extra->std_extra_data;
+    extra->std_compute_stats(stats, fetchfunc, samplerows, totalrows);
+    stats->extra_data = extra;
+
+    if (!stats->stats_valid)
+        return;
+
+    for (int i = 0; i < samplerows; i++) {
+        bool    isnull;
+        Datum   value = fetchfunc(stats, i, &isnull);
+        const Kmer *kmer;
+
+        vacuum_delay_point();
+        if (isnull)
+            continue;
+
+        kmer = DatumGetKmerP(value);
+        for (int pos = 0; pos < kmer->length; pos++)
+            base_counts[4 * pos + KMER_GET_BASE(kmer, pos)] += 1;
+        length_counts[kmer->length] += 1;
+        nonnull++;
+    }
+
+    if (nonnull == 0)
+        return;
+
+    for (slot = 0; slot < STATISTIC_NUM_SLOTS; slot++)
+        if (stats->stakind[slot] == 0)
+            break;
+    if (slot == STATISTIC_NUM_SLOTS)
+        return;
+
+    numbers = (float4 *) palloc(KMER_STATS_NUMBERS * sizeof(float4));
+    for (int i = 0; i < KMER_STATS_BASES; i++)
+        numbers[i] = base_counts[i] / nonnull;
+    for (int len = 0; len <= KMER_MAX_LENGTH; len++)
+        numbers[KMER_STATS_BASES + len] = length_counts[len] / nonnull;
+
+    stats->stakind[slot] = STATISTIC_KIND_KMER_BASES;
+    stats->staop[slot] = InvalidOid;
+    stats->stacoll[slot] = InvalidOid;
+    stats->stanumbers[slot] = numbers;
+    stats->numnumbers[slot] = KMER_STATS_NUMBERS;
+}
+
+PG_FUNCTION_INFO_V1(kmer_typanalyze);
+Datum
+kmer_typanalyze(PG_FUNCTION_ARGS)
+{
+    VacAttrStats *stats = (VacAttrStats *) PG_GETARG_POINTER(0);
+    KmerAnalyzeExtraData *extra;
+
+    if (!std_typanalyze(stats))
+        PG_RETURN_BOOL(false);
+
+    extra = (KmerAnalyzeExtraData *) palloc(sizeof(KmerAnalyzeExtraData));
+    extra->std_compute_stats = stats->compute_stats;
+    extra->std_extra_data = stats->extra_data;
+    stats->compute_stats = compute_kmer_stats;
+    stats->extra_data = extra;
+
+    PG_RETURN_BOOL(true);
+}
+
+/*
+ * Fraction of the non-null kmers matching a pattern of len positions, where
+ * masks[i] holds the accepted bases at position i (bit 1 << code). With
+ * whole set the kmer must have exactly len bases, otherwise at least len.
+ */
+static double
+kmer_pattern_sel(const float4 *numbers, const uint8 *masks, int len, bool whole)
+{
+    double  sel;
+
+    if (numbers == NULL) {
+        sel = 1.0;
+        for (int i = 0; i < len; i++)
+            sel *= pg_popcount32(masks[i]) * DEFAULT_KMER_BASE_SEL;
+        return sel;
+    }
+
+    if (whole)
+        sel = numbers[KMER_STATS_BASES + len];
+    else {
+        sel = 0.0;
+        for (int l = len; l <= KMER_MAX_LENGTH; l++)
+            sel += numbers[KMER_STATS_BASES + l];
+    }
+
+    /* Probability of the accepted bases among the kmers reaching position i */
+    for (int i = 0; i < len && sel > 0.0; i++) {
+        const float4 *freq = numbers + 4 * i;
+        double  reached = freq[0] + freq[1] + freq[2] + freq[3];
+        double  accepted = 0.0;
+
+        if (reached <= 0.0)
+            return 0.0;
+        for (int b = 0; b < 4; b++)
+            if (masks[i] & (1 << b))
+                accepted += freq[b];
+        sel *= accepted / reached;
+    }
+    return sel;
+}
+
+/*
+ * Common part of the restriction estimators: the most common kmers are
+ * checked one by one against the pattern, the rest of the column is
+ * estimated from the positional base frequencies. match is called on the
+ * const operand and a most common value.
+ */
+static double
+kmer_restriction_sel(VariableStatData *vardata, Datum constval,
+                     bool (*match) (Datum constval, const Kmer *kmer),
+                     const uint8 *masks, int len, bool whole)
+{
+    Form_pg_statistic stats;
+    AttStatsSlot sslot;
+    double  nullfrac;
+    double  mcvsel = 0.0;
+    double  sumcommon = 0.0;
+    double  sel;
+
+    if (!HeapTupleIsValid(vardata->statsTuple))
+        return kmer_pattern_sel(NULL, masks, len, whole);
+
+    stats = (Form_pg_statistic) GETSTRUCT(vardata->statsTuple);
+    nullfrac = stats->stanullfrac;
+
+    if (get_attstatsslot(&sslot, vardata->statsTuple, STATISTIC_KIND_MCV,
+                         InvalidOid, ATTSTATSSLOT_VALUES | ATTSTATSSLOT_NUMBERS)) {
+        for (int i = 0; i < sslot.nvalues; i++) {
+            if (match(constval, DatumGetKmerP(sslot.values[i])))
+                mcvsel += sslot.numbers[i];
+            sumcommon += sslot.numbers[i];
+        }
+        free_attstatsslot(&sslot);
+    }
+
+    if (get_attstatsslot(&sslot, vardata->statsTuple, STATISTIC_KIND_KMER_BASES,
+                         InvalidOid, ATTSTATSSLOT_NUMBERS)) {
+        if (sslot.nnumbers == KMER_STATS_NUMBERS)
+            sel = kmer_pattern_sel(sslot.numbers, masks, len, whole);
+        else
+            sel = kmer_pattern_sel(NULL, masks, len, whole);
+        free_attstatsslot(&sslot);
+    }
+    else
+        sel = kmer_pattern_sel(NULL, masks, len, whole);
+
+    sel = mcvsel + sel * Max(0.0, 1.0 - nullfrac - sumcommon);
+    CLAMP_PROBABILITY(sel);
+    return sel;
+}
+
+static bool
+kmer_prefix_match(Datum constval, const Kmer *kmer)
+{
+    const Kmer *prefix = DatumGetKmerP(constval);
+
+    return prefix->length <= kmer->length &&
+           ((kmer->bases ^ prefix->bases) & KMER_PREFIX_MASK(prefix->length)) == 0;
+}
+
+static bool
+kmer_qkmer_match(Datum constval, const Kmer *kmer)
+{
+    return qkmer_matches(DatumGetQkmerP(constval), kmer);
+}
+
+/*
+ * Selectivity of a prefix test on a kmer column: the most common kmers having
+ * the prefix, plus for the others the probability of its p bases. kmer_arg is
+ * the position of the kmer in args, the other argument being the prefix.
+ */
+double
+kmer_prefix_selectivity(PlannerInfo *root, List *args, int varRelid, int kmer_arg)
+{
+    VariableStatData vardata;
+    Node   *other;
+    bool    varonleft;
+    const Kmer *prefix;
+    uint8   masks[KMER_MAX_LENGTH];
+    double  sel;
+
+    if (!get_restriction_variable(root, args, varRelid,
+                                  &vardata, &other, &varonleft))
+        return DEFAULT_MATCHING_SEL;
+
+    /* Only a column tested against a constant prefix is estimated */
+    if (varonleft != (kmer_arg == 0) || !IsA(other, Const)) {
+        ReleaseVariableStats(vardata);
+        return DEFAULT_MATCHING_SEL;
+    }
+    if (((Const *) other)->constisnull) {
+        ReleaseVariableStats(vardata);
+        return 0.0;
+    }
+
+    prefix = DatumGetKmerP(((Const *) other)->constvalue);
+    for (int i = 0; i < prefix->length; i++)
+        masks[i] = 1 << KMER_GET_BASE(prefix, i);
+
+    sel = kmer_restriction_sel(&vardata, ((Const *) other)->constvalue,
+                               kmer_prefix_match, masks, prefix->length, false);
+
+    ReleaseVariableStats(vardata);
+    return sel;
+}
+
+/*
+ * Selectivity of a qkmer matching a kmer column: every position contributes
+ * the frequency of the bases its IUPAC code accepts, so a degenerate position
+ * weighs less than a fixed one and N nothing at all. kmer_arg is the position
+ * of the kmer in args, the other argument being the qkmer.
+ */
+double
+kmer_contains_selectivity(PlannerInfo *root, List *args, int varRelid, int kmer_arg)
+{
+    VariableStatData vardata;
+    Node   *other;
+    bool    varonleft;
+    const Qkmer *qkmer;
+    uint8   masks[QKMER_MAX_LENGTH];
+    double  sel;
+
+    if (!get_restriction_variable(root, args, varRelid,
+                                  &vardata, &other, &varonleft))
+        return DEFAULT_MATCHING_SEL;
+
+    /* Only a kmer column tested against a constant qkmer is estimated */
+    if (varonleft != (kmer_arg == 0) || !IsA(other, Const)) {
+        ReleaseVariableStats(vardata);
+        return DEFAULT_MATCHING_SEL;
+    }
+    if (((Const *) other)->constisnull) {
+        ReleaseVariableStats(vardata);
+        return 0.0;
+    }
+
+    qkmer = DatumGetQkmerP(((Const *) other)->constvalue);
+    for (int i = 0; i < qkmer->length; i++)
+        masks[i] = QKMER_GET_MASK(qkmer, i);
+
+    sel = kmer_restriction_sel(&vardata, ((Const *) other)->constvalue,
+                               kmer_qkmer_match, masks, qkmer->length, true);
+
+    ReleaseVariableStats(vardata);
+    return sel;
+}
+
+/*Restriction estimator of kmer ^@ prefix*/
+PG_FUNCTION_INFO_V1(kmer_prefix_sel);
+Datum
+kmer_prefix_sel(PG_FUNCTION_ARGS)
+{
+    PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+    List   *args = (List *) PG_GETARG_POINTER(2);
+    int     varRelid = PG_GETARG_INT32(3);
+
+    PG_RETURN_FLOAT8(kmer_prefix_selectivity(root, args, varRelid, 0));
+}
+
+/*Restriction estimator of qkmer @> kmer*/
+PG_FUNCTION_INFO_V1(kmer_contains_sel);
+Datum
+kmer_contains_sel(PG_FUNCTION_ARGS)
+{
+    PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+    List   *args = (List *) PG_GETARG_POINTER(2);
+    int     varRelid = PG_GETARG_INT32(3);
+
+    PG_RETURN_FLOAT8(kmer_contains_selectivity(root, args, varRelid, 1));
+}
+
+/*Restriction estimator of kmer <@ qkmer*/
+PG_FUNCTION_INFO_V1(kmer_contained_sel);
+Datum
+kmer_contained_sel(PG_FUNCTION_ARGS)
+{
+    PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+    List   *args = (List *) PG_GETARG_POINTER(2);
+    int     varRelid = PG_GETARG_INT32(3);
+
+    PG_RETURN_FLOAT8(kmer_contains_selectivity(root, args, varRelid, 0));
+}
@@ -0,0 +1,42 @@
+#include "postgres.h"
+#include "fmgr.h"
+
+#include "kmer.h"
+#include "kmer_table.h"
+
+#define SH_PREFIX       kmer_table
+#define SH_ELEMENT_TYPE KmerCount
+#define SH_KEY_TYPE     uint64
+#define SH_KEY          bases
+#define SH_HASH_KEY(tb, key)    ((uint32) kmer_mix64(key))
+#define SH_EQUAL(tb, a, b)      ((a) == (b))
+#define SH_SCOPE        extern
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
+/* Largest initial size, the table grows past it when needed */
+#define KMER_TABLE_MAX_INITIAL_SIZE 65536
+
+uint32
+kmer_table_initial_size(int64 n, int k)
+{
+    int64 size = Min(n, KMER_TABLE_MAX_INITIAL_SIZE);
+
+    /* there are only 4^k distinct kmers of length k */
+    if (k < 8)
+        size = Min(size, INT64CONST(1) << (2 * k));
+    return (uint32) Max(size, 16);
+}
+
+/* Adds count occurrences of a kmer */
+void
+kmer_table_add(kmer_table_hash* table, uint64 bases, int64 count)
+{
+    bool found;
+    KmerCount *entry = kmer_table_insert(table, bases, &found);
+
+    if (found)
+        entry->count += count;
+    else
+        entry->count = count;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+/* Hash table counting kmers of a same length */
+
+/*
+ * Open addressing table (lib/simplehash.h) keyed on the packed bases of the
+ * kmers, all the kmers of a table having the same length. The entries are
+ * small and stored inline, so probing stays within a few cache lines.
+ */
+typedef struct KmerCount {
+    uint64 bases;   /* packed bases, left-aligned as in Kmer */
+    int64 count;    /* number of occurrences */
+    char status;    /* used by simplehash */
+} KmerCount;
+
+#define SH_PREFIX       kmer_table
+#define SH_ELEMENT_TYPE KmerCount
+#define SH_KEY_TYPE     uint64
+#define SH_SCOPE        extern
+#define SH_DECLARE
+#include "lib/simplehash.h"
+
+/* Initial number of entries of a table expected to hold up to n kmers of length k */
+uint32 kmer_table_initial_size(int64 n, int k);
+void kmer_table_add(kmer_table_hash* table, uint64 bases, int64 count);
@@ -23,35 +23,66 @@
 
 /*QKMER CREATION*/
 
+/* IUPAC symbol of every 4-bit mask (A=1, C=2, G=4, T=8); 0 is not a valid mask */
+static const char qkmer_symbols[16] = {
+    '?', 'A', 'C', 'M', 'G', 'R', 'S', 'V',
+    'T', 'W', 'Y', 'H', 'K', 'D', 'B', 'N'
+};
+
+/* 4-bit mask of an IUPAC symbol, 0 if the symbol is not valid */
+static uint8
+qkmer_symbol_mask(char c)
+{
+  switch (c)
+  {
+    case 'A': return 0x1;
+    case 'C': return 0x2;
+    case 'G': return 0x4;
+    case 'T': return 0x8;
+    case 'R': return 0x5;   /* A or G */
+    case 'Y': return 0xA;   /* C or T */
+    case 'S': return 0x6;   /* C or G */
+    case 'W': return 0x9;   /* A or T */
+    case 'K': return 0xC;   /* G or T */
+    case 'M': return 0x3;   /* A or C */
+    case 'B': return 0xE;   /* not A */
+    case 'D': return 0xD;   /* not C */
+    case 'H': return 0xB;   /* not G */
+    case 'V': return 0x7;   /* not T */
+    case 'N': return 0xF;   /* any */
+    default:  return 0;
+  }
+}
 
 /*Qkmer creation from str (internal) (with checks)*/
 Qkmer*
 qkmer_parse(const char* str)
 {
-  int32 len = strlen(str);
+  int32 len;
   Qkmer *qkmer;
 
   if (str == NULL ||str[0] == '\0'){
         ereport(ERROR, (errmsg("Input array cannot be NULL or empty")));
     }
 
-  if(strlen(str) > 32){
+  len = strlen(str);
+  if(len > QKMER_MAX_LENGTH){
         ereport(ERROR, (errmsg("Input array cannot be longer than 32 nucleotides.")));
     }
 
-
+  qkmer = (Qkmer*) palloc0(sizeof(Qkmer));
+  qkmer->length = len;
   for (int i = 0; i < len; i++) {
-    if (!(str[i]== 'A' || str[i] == 'C' || str[i] == 'G' || str[i]== 'T' || str[i]=='R' || str[i]=='Y' || str[i]=='N' || str[i]=='W' || str[i]=='S' || str[i]=='M' || str[i]=='K' || str[i]=='B' || str[i]=='D' || str[i]=='H' || str[i]=='V'  )) {
+    uint8 mask = qkmer_symbol_mask(str[i]);
+
+    if (mask == 0) {
 			ereport(
             ERROR,
             (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
             errmsg("Error: Invalid nucleotide '%c' in sequence.\n", str[i])));
     }
+    qkmer->masks[i >> 4] |= (uint64) mask << (60 - 4 * (i & 15));
   }
-  
-  qkmer = (Qkmer*) palloc(VARHDRSZ + len  + 1 );
-  SET_VARSIZE(qkmer, VARHDRSZ +  len  + 1 );
-  memcpy(qkmer->sequence, str, len + 1);
 
   return qkmer;
 }
@@ -62,7 +93,12 @@ qkmer_parse(const char* str)
 static char *
 qkmer_to_str(const Qkmer* qkmer)
 {
-  return pstrdup(qkmer->sequence);
+  char *str = palloc(qkmer->length + 1);
+
+  for (int i = 0; i < qkmer->length; i++)
+    str[i] = qkmer_symbols[QKMER_GET_MASK(qkmer, i)];
+  str[qkmer->length] = '\0';
+  return str;
 }
 
 /********************************************************/
@@ -75,7 +111,7 @@ Datum
 qkmer_in(PG_FUNCTION_ARGS)
 {
   const char * str = PG_GETARG_CSTRING(0);
-  PG_RETURN_POINTER(qkmer_parse(str));
+  PG_RETURN_QKMER_P(qkmer_parse(str));
   
 }
 
@@ -84,7 +120,7 @@ PG_FUNCTION_INFO_V1(qkmer_out);
 Datum
 qkmer_out(PG_FUNCTION_ARGS)
 {
-  const Qkmer *qkmer = (Qkmer *) PG_GETARG_POINTER(0);
+  const Qkmer *qkmer = PG_GETARG_QKMER_P(0);
   PG_RETURN_CSTRING(qkmer_to_str(qkmer));
 }
 
@@ -96,11 +132,14 @@ qkmer_recv(PG_FUNCTION_ARGS)
 {
     StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
     int32 len = pq_getmsgint(buf, sizeof(int32));
-    Qkmer *qkmer = (Qkmer *) palloc(VARHDRSZ + len + 1); 
-    SET_VARSIZE(qkmer, VARHDRSZ + len + 1);  
-    pq_copymsgbytes(buf, qkmer->sequence, len);
-    qkmer->sequence[len] = '\0';
-    PG_RETURN_POINTER(qkmer);
+    char str[QKMER_MAX_LENGTH + 2];
+
+    if (len < 0 || len > QKMER_MAX_LENGTH + 1)
+        ereport(ERROR, (errmsg("Input array cannot be longer than 32 nucleotides.")));
+
+    pq_copymsgbytes(buf, str, len);
+    str[len] = '\0';
+    PG_RETURN_QKMER_P(qkmer_parse(str));
 }
 
 
@@ -110,13 +149,11 @@ PG_FUNCTION_INFO_V1(qkmer_send);
 Datum
 qkmer_send(PG_FUNCTION_ARGS)
 {
-    Qkmer *qkmer = (Qkmer *) PG_GETARG_POINTER(0);
-    int32 len = VARSIZE(qkmer) - VARHDRSZ; 
+    Qkmer *qkmer = PG_GETARG_QKMER_P(0);
     StringInfoData buf;
     pq_begintypsend(&buf);
-    pq_sendint32(&buf, len);
-    pq_sendbytes(&buf, qkmer->sequence, len);
-    PG_FREE_IF_COPY(qkmer, 0);
+    pq_sendint32(&buf, qkmer->length);
+    pq_sendbytes(&buf, qkmer_to_str(qkmer), qkmer->length);
     PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
 }
 
@@ -130,7 +167,7 @@ qkmer_cast_from_text(PG_FUNCTION_ARGS)
   text *txt = PG_GETARG_TEXT_P(0);
   char *str = DatumGetCString(DirectFunctionCall1(textout,
                PointerGetDatum(txt))); /*Postgre text to C string*/
-  PG_RETURN_POINTER(qkmer_parse(str));
+  PG_RETURN_QKMER_P(qkmer_parse(str));
 }
 
 /* qKmer -> text (external)*/
@@ -138,7 +175,7 @@ PG_FUNCTION_INFO_V1(qkmer_cast_to_text);
 Datum
 qkmer_cast_to_text(PG_FUNCTION_ARGS)
 {
-  const Qkmer *qkmer  = (Qkmer *) PG_GETARG_POINTER(0); 
+  const Qkmer *qkmer  = PG_GETARG_QKMER_P(0);
   text *out = (text *)DirectFunctionCall1(textin,
             PointerGetDatum(qkmer_to_str(qkmer)));
   PG_RETURN_TEXT_P(out);
@@ -149,6 +186,6 @@ PG_FUNCTION_INFO_V1(qkmer_len);
 Datum
 qkmer_len(PG_FUNCTION_ARGS)
 {
-  const Qkmer *qkmer  = (Qkmer *) PG_GETARG_POINTER(0);
-  PG_RETURN_INT32(strlen(qkmer->sequence)); 
+  const Qkmer *qkmer  = PG_GETARG_QKMER_P(0);
+  PG_RETURN_INT32(qkmer->length);
 }
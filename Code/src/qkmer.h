@@ -1,11 +1,31 @@
+#pragma once
+
 /* Structure to represent Qkmer */
 
+/*
+ * Every position of a qkmer is a 4-bit IUPAC mask of the nucleotides it
+ * accepts (A=1, C=2, G=4, T=8, N=15, ...). Positions 0-15 are packed in
+ * masks[0] and 16-31 in masks[1], the first one in the most significant
+ * nibble; unused nibbles are zero.
+ */
 typedef struct Qkmer {
-    int32 size;
-    char sequence[FLEXIBLE_ARRAY_MEMBER];
+    uint64 masks[2];
+    int32 length;   /* number of positions */
 } Qkmer;
 
+#define QKMER_MAX_LENGTH        32
+#define QKMER_GET_MASK(qkmer, i) \
+    (((qkmer)->masks[(i) >> 4] >> (60 - 4 * ((i) & 15))) & 0xF)
+
+#define DatumGetQkmerP(X)       ((Qkmer *) DatumGetPointer(X))
+#define QkmerPGetDatum(X)       PointerGetDatum(X)
+#define PG_GETARG_QKMER_P(n)    DatumGetQkmerP(PG_GETARG_DATUM(n))
+#define PG_RETURN_QKMER_P(x)    return QkmerPGetDatum(x)
+
+struct Kmer;
+
 Qkmer* qkmer_parse(const char* str);
+bool qkmer_matches(const Qkmer* qkmer, const struct Kmer* kmer);
 Datum qkmer_in(PG_FUNCTION_ARGS);
 Datum qkmer_out(PG_FUNCTION_ARGS);
 Datum qkmer_recv(PG_FUNCTION_ARGS);
@@ -14,4 +34,3 @@ Datum qkmer_cast_from_text(PG_FUNCTION_ARGS);
 Datum qkmer_cast_to_text(PG_FUNCTION_ARGS);
 Datum qkmer_size(PG_FUNCTION_ARGS);
 Datum qkmer_len(PG_FUNCTION_ARGS);
-
@@ -0,0 +1,306 @@
+#include "postgres.h"
+
+#include "libpq/pqformat.h"
+#include "utils/builtins.h"
+#include "varatt.h"
+
+#include "dna.h"
+
+/*
+ * The read type: the bases and qualities of a sequencing read in one value,
+ * written 'SEQUENCE QUALITIES' in text, the qualities in Phred+33 like in a
+ * FASTQ file. The qualities are binned (see dna.h), so the ones given back
+ * are the values standing for the bins, not the original ones.
+ */
+
+const uint8 read_qual_values[READ_QUAL_BINS] = {2, 6, 15, 22, 27, 33, 37, 40};
+
+/* Bin of a Phred score */
+static inline int
+read_qual_bin(int qual)
+{
+    if (qual < 3)
+        return 0;
+    if (qual < 10)
+        return 1;
+    if (qual < 20)
+        return 2;
+    if (qual >= 40)
+        return 7;
+    return 3 + (qual - 20) / 5;
+}
+
+/*Read from the len bases of seq and their qualities qual (internal) (with checks)*/
+static Read *
+read_build(const char *seq, const char *qual, int32 len)
+{
+    char   *bases = palloc(len);
+    int32  *missing = palloc(sizeof(int32) * len);
+    int32   nmissing = 0;
+    int32   nruns = 0;
+    Read   *read;
+    uint8  *runs;
+    int     run_bin = -1;
+    int     run_len = 0;
+
+    if (len == 0)
+        ereport(ERROR, (errmsg("Input array cannot be NULL or empty")));
+
+    /* the N bases are packed as A, the other characters are checked by dna_pack */
+    for (int32 i = 0; i < len; i++) {
+        bases[i] = seq[i];
+        if (seq[i] == 'N' || (seq[i] == 'n' && dna_soft_masked)) {
+            missing[nmissing++] = i;
+            bases[i] = 'A';
+        }
+    }
+
+    for (int32 i = 0; i < len; i++) {
+        int bin;
+
+        if (qual[i] < '!' || qual[i] > '~')
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("Invalid quality '%c' in read.", qual[i]),
+                     errdetail("Invalid character at offset %d of the qualities.", i)));
+        bin = read_qual_bin(qual[i] - '!');
+        if (bin != run_bin || run_len == READ_MAX_RUN) {
+            nruns++;
+            run_bin = bin;
+            run_len = 0;
+        }
+        run_len++;
+    }
+
+    read = (Read *) palloc0(READ_HDRSZ + sizeof(int32) * nmissing + DNA_PACKED_SIZE(len) + nruns);
+    SET_VARSIZE(read, READ_HDRSZ + sizeof(int32) * nmissing + DNA_PACKED_SIZE(len) + nruns);
+    read->length = len;
+    read->nmissing = nmissing;
+    read->nruns = nruns;
+    memcpy(READ_MISSING(read), missing, sizeof(int32) * nmissing);
+    dna_pack(bases, len, READ_BASES(read));
+
+    runs = READ_RUNS(read);
+    run_bin = read_qual_bin(qual[0] - '!');
+    run_len = 0;
+    for (int32 i = 0; i < len; i++) {
+        int bin = read_qual_bin(qual[i] - '!');
+
+        if (bin != run_bin || run_len == READ_MAX_RUN) {
+            *runs++ = READ_RUN(run_bin, run_len);
+            run_bin = bin;
+            run_len = 0;
+        }
+        run_len++;
+    }
+    *runs = READ_RUN(run_bin, run_len);
+
+    pfree(bases);
+    pfree(missing);
+    return read;
+}
+
+/*Bases of a read, N included (internal)*/
+static char *
+read_seq_to_str(const Read *read, char *str)
+{
+    const uint8 *bases = READ_BASES(read);
+    const int32 *missing = READ_MISSING(read);
+
+    for (int32 i = 0; i < read->length; i++)
+        str[i] = dna_nucleotides[(bases[i >> 2] >> (6 - 2 * (i & 3))) & 3];
+    for (int32 i = 0; i < read->nmissing; i++)
+        str[missing[i]] = 'N';
+    return str + read->length;
+}
+
+/*Qualities of a read in Phred+33 (internal)*/
+static char *
+read_qual_to_str(const Read *read, char *str)
+{
+    const uint8 *runs = READ_RUNS(read);
+
+    for (int32 i = 0; i < read->nruns; i++) {
+        memset(str, '!' + read_qual_values[READ_RUN_BIN(runs[i])], READ_RUN_LENGTH(runs[i]));
+        str += READ_RUN_LENGTH(runs[i]);
+    }
+    return str;
+}
+
+/********************************************************/
+
+/*Internal function for Postgre to create the Read datatype*/
+
+/*In function (str -> Read)*/
+PG_FUNCTION_INFO_V1(read_in);
+Datum
+read_in(PG_FUNCTION_ARGS)
+{
+    const char *str = PG_GETARG_CSTRING(0);
+    const char *space = strchr(str, ' ');
+
+    if (space == NULL || strlen(space + 1) != space - str)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                 errmsg("invalid input syntax for type read: \"%s\"", str),
+                 errdetail("A read is its bases and as many qualities, separated by a space.")));
+    PG_RETURN_POINTER(read_build(str, space + 1, space - str));
+}
+
+/*Out function (Read -> str)*/
+PG_FUNCTION_INFO_V1(read_out);
+Datum
+read_out(PG_FUNCTION_ARGS)
+{
+    const Read *read = PG_GETARG_READ_P(0);
+    char   *str = palloc(2 * read->length + 2);
+    char   *end;
+
+    end = read_seq_to_str(read, str);
+    *end++ = ' ';
+    end = read_qual_to_str(read, end);
+    *end = '\0';
+    PG_RETURN_CSTRING(str);
+}
+
+/*
+ * Binary in (binary -> Read): the version byte, the length, the numbers of N
+ * bases and of quality runs, then the data of the value as described in
+ * dna.h, checked before it is accepted.
+ */
+PG_FUNCTION_INFO_V1(read_recv);
+Datum
+read_recv(PG_FUNCTION_ARGS)
+{
+    StringInfo buf = (StringInfo) PG_GETARG_POINTER(0);
+    int32   len;
+    int32   nmissing;
+    int32   nruns;
+    int64   size;
+    int64   total = 0;
+    Read   *read;
+
+    dna_recv_version(buf);
+    len = pq_getmsgint(buf, sizeof(int32));
+    nmissing = pq_getmsgint(buf, sizeof(int32));
+    nruns = pq_getmsgint(buf, sizeof(int32));
+    if (len <= 0)
+        ereport(ERROR, (errmsg("Input array cannot be NULL or empty")));
+    size = sizeof(int32) * (int64) nmissing + DNA_PACKED_SIZE((int64) len) + nruns;
+    if (nmissing < 0 || nmissing > len || nruns <= 0 || nruns > len ||
+        size > buf->len - buf->cursor)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                 errmsg("invalid read length, number of N bases or of quality runs")));
+
+    read = (Read *) palloc0(READ_HDRSZ + size);
+    SET_VARSIZE(read, READ_HDRSZ + size);
+    read->length = len;
+    read->nmissing = nmissing;
+    read->nruns = nruns;
+
+    for (int32 i = 0; i < nmissing; i++) {
+        READ_MISSING(read)[i] = pq_getmsgint(buf, sizeof(int32));
+        if (READ_MISSING(read)[i] < 0 || READ_MISSING(read)[i] >= len ||
+            (i > 0 && READ_MISSING(read)[i] <= READ_MISSING(read)[i - 1]))
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                     errmsg("invalid position of N base in read")));
+    }
+    dna_recv_bases(buf, len, READ_BASES(read));
+    pq_copymsgbytes(buf, (char *) READ_RUNS(read), nruns);
+    for (int32 i = 0; i < nruns; i++)
+        total += READ_RUN_LENGTH(READ_RUNS(read)[i]);
+    if (total != len)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                 errmsg("quality runs do not cover the %d bases of the read", len)));
+    PG_RETURN_POINTER(read);
+}
+
+/*Binary out (Read --> out)*/
+PG_FUNCTION_INFO_V1(read_send);
+Datum
+read_send(PG_FUNCTION_ARGS)
+{
+    Read   *read = PG_GETARG_READ_P(0);
+    StringInfoData buf;
+
+    pq_begintypsend(&buf);
+    pq_sendbyte(&buf, DNA_BINARY_VERSION);
+    pq_sendint32(&buf, read->length);
+    pq_sendint32(&buf, read->nmissing);
+    pq_sendint32(&buf, read->nruns);
+    for (int32 i = 0; i < read->nmissing; i++)
+        pq_sendint32(&buf, READ_MISSING(read)[i]);
+    pq_sendbytes(&buf, (char *) READ_BASES(read), DNA_PACKED_SIZE(read->length) + read->nruns);
+    PG_FREE_IF_COPY(read, 0);
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*******************************************************/
+
+/* Functions */
+
+/*Read from its bases and qualities, e.g. the columns given by read_fastq*/
+PG_FUNCTION_INFO_V1(read_make);
+Datum
+read_make(PG_FUNCTION_ARGS)
+{
+    text   *seq = PG_GETARG_TEXT_PP(0);
+    text   *qual = PG_GETARG_TEXT_PP(1);
+
+    if (VARSIZE_ANY_EXHDR(seq) != VARSIZE_ANY_EXHDR(qual))
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("a read must have as many qualities as bases")));
+    PG_RETURN_POINTER(read_build(VARDATA_ANY(seq), VARDATA_ANY(qual), VARSIZE_ANY_EXHDR(seq)));
+}
+
+/*Length (only the header is fetched)*/
+PG_FUNCTION_INFO_V1(read_len);
+Datum
+read_len(PG_FUNCTION_ARGS)
+{
+    const Read *read = (Read *) PG_DETOAST_DATUM_SLICE(PG_GETARG_DATUM(0), 0, sizeof(int32));
+
+    PG_RETURN_INT32(read->length);
+}
+
+PG_FUNCTION_INFO_V1(read_seq);
+Datum
+read_seq(PG_FUNCTION_ARGS)
+{
+    const Read *read = PG_GETARG_READ_P(0);
+    text   *out = (text *) palloc(VARHDRSZ + read->length);
+
+    SET_VARSIZE(out, VARHDRSZ + read->length);
+    read_seq_to_str(read, VARDATA(out));
+    PG_RETURN_TEXT_P(out);
+}
+
+PG_FUNCTION_INFO_V1(read_qual);
+Datum
+read_qual(PG_FUNCTION_ARGS)
+{
+    const Read *read = PG_GETARG_READ_P(0);
+    text   *out = (text *) palloc(VARHDRSZ + read->length);
+
+    SET_VARSIZE(out, VARHDRSZ + read->length);
+    read_qual_to_str(read, VARDATA(out));
+    PG_RETURN_TEXT_P(out);
+}
+
+/*Mean of the (binned) qualities, computed on the runs*/
+PG_FUNCTION_INFO_V1(mean_quality);
+Datum
+mean_quality(PG_FUNCTION_ARGS)
+{
+    const Read *read = PG_GETARG_READ_P(0);
+    const uint8 *runs = READ_RUNS(read);
+    int64   sum = 0;
+
+    for (int32 i = 0; i < read->nruns; i++)
+        sum += (int64) read_qual_values[READ_RUN_BIN(runs[i])] * READ_RUN_LENGTH(runs[i]);
+    PG_RETURN_FLOAT8((double) sum / read->length);
+}
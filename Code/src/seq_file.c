@@ -0,0 +1,590 @@
+#include "postgres.h"
+
+#include "catalog/pg_authid_d.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/tuplestore.h"
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+#include "dna.h"
+
+/*
+ * read_fasta and read_fastq: the records of a FASTA or FASTQ file of the
+ * server, as (id, sequence[, quality]) rows. write_fasta: the reverse, an
+ * aggregate writing its rows to a FASTA file.
+ *
+ * The file is read in blocks of SEQ_FILE_BUFSIZE bytes and every record goes
+ * to the tuplestore as soon as it is parsed, so memory does not depend on the
+ * size of the file. When the server is built with zlib, gzip-compressed files
+ * are decompressed on the fly (plain files are read as they are).
+ *
+ * The id of a record is the first word of its header line. A FASTA sequence
+ * may span several lines, a FASTQ record is the usual four lines. With
+ * skip_invalid, the records holding something else than nucleotides (for
+ * instance N) are skipped instead of failing the whole load.
+ */
+
+#define SEQ_FILE_BUFSIZE    65536
+#define FASTA_WRITE_BUFSIZE (1024 * 1024)
+#define FASTA_LINE_WIDTH    60
+
+typedef struct SeqFile {
+    const char *path;
+    int fd;                         /* transient file, closed on error by fd.c */
+    char *buf;                      /* file data, decompressed if needed */
+    int len;                        /* bytes in buf */
+    int pos;                        /* next byte to read in buf */
+    int64 lineno;                   /* number of lines read */
+#ifdef HAVE_LIBZ
+    bool compressed;                /* gzip file, read through zs */
+    z_stream zs;                    /* inflate state, allocated with palloc */
+    char *raw;                      /* compressed bytes read from the file */
+    bool raw_eof;                   /* the whole file has been read */
+    bool in_member;                 /* inside a gzip member (bgzip has many) */
+#endif
+} SeqFile;
+
+/* Only roles allowed to read any file of the server may use the readers */
+static void
+check_read_server_files(void)
+{
+    if (!superuser() && !has_privs_of_role(GetUserId(), ROLE_PG_READ_SERVER_FILES))
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("permission denied to read sequence files"),
+                 errdetail("Only roles with privileges of the \"pg_read_server_files\" role may read files of the server.")));
+}
+
+/* Reads up to len bytes of the file itself */
+static int
+seq_file_read(SeqFile *file, char *buf, int len)
+{
+    int n = read(file->fd, buf, len);
+
+    if (n < 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not read file \"%s\": %m", file->path)));
+    return n;
+}
+
+#ifdef HAVE_LIBZ
+static voidpf
+seq_file_zalloc(voidpf opaque, uInt items, uInt size)
+{
+    return palloc((Size) items * size);
+}
+
+static void
+seq_file_zfree(voidpf opaque, voidpf address)
+{
+    pfree(address);
+}
+
+/* Decompresses the next block into buf, 0 at the end of the file */
+static int
+seq_file_inflate(SeqFile *file)
+{
+    for (;;) {
+        int ret;
+
+        if (file->zs.avail_in == 0 && !file->raw_eof) {
+            file->zs.next_in = (Bytef *) file->raw;
+            file->zs.avail_in = seq_file_read(file, file->raw, SEQ_FILE_BUFSIZE);
+            file->raw_eof = file->zs.avail_in == 0;
+        }
+        if (file->zs.avail_in == 0) {
+            if (file->in_member)
+                ereport(ERROR,
+                        (errcode(ERRCODE_DATA_CORRUPTED),
+                         errmsg("unexpected end of compressed file \"%s\"", file->path)));
+            return 0;
+        }
+
+        file->in_member = true;
+        file->zs.next_out = (Bytef *) file->buf;
+        file->zs.avail_out = SEQ_FILE_BUFSIZE;
+        ret = inflate(&file->zs, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            /* concatenated members (bgzip) follow each other */
+            inflateReset(&file->zs);
+            file->in_member = false;
+        }
+        else if (ret != Z_OK && ret != Z_BUF_ERROR)
+            ereport(ERROR,
+                    (errcode(ERRCODE_DATA_CORRUPTED),
+                     errmsg("could not decompress file \"%s\": %s", file->path,
+                            file->zs.msg != NULL ? file->zs.msg : "invalid data")));
+
+        if (file->zs.avail_out < SEQ_FILE_BUFSIZE)
+            return SEQ_FILE_BUFSIZE - file->zs.avail_out;
+    }
+}
+#endif
+
+/*
+ * Opens the file, as a transient file so it is closed if the load fails. The
+ * first block tells whether it is gzip-compressed (magic bytes 1f 8b).
+ */
+static SeqFile *
+seq_file_open(text *path)
+{
+    SeqFile *file = (SeqFile *) palloc0(sizeof(SeqFile));
+    bool    gzip;
+
+    file->path = text_to_cstring(path);
+    file->buf = palloc(SEQ_FILE_BUFSIZE);
+    file->fd = OpenTransientFile(file->path, O_RDONLY | PG_BINARY);
+    if (file->fd < 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not open file \"%s\" for reading: %m", file->path)));
+
+    file->len = seq_file_read(file, file->buf, SEQ_FILE_BUFSIZE);
+    gzip = file->len >= 2 && (uint8) file->buf[0] == 0x1f && (uint8) file->buf[1] == 0x8b;
+#ifdef HAVE_LIBZ
+    if (gzip) {
+        /* the block read is compressed input, decompressed data goes to a new buf */
+        file->compressed = true;
+        file->raw = file->buf;
+        file->buf = palloc(SEQ_FILE_BUFSIZE);
+        file->zs.zalloc = seq_file_zalloc;
+        file->zs.zfree = seq_file_zfree;
+        file->zs.next_in = (Bytef *) file->raw;
+        file->zs.avail_in = file->len;
+        file->len = 0;
+        /* 15 + 16: window of 32 kB, gzip header */
+        if (inflateInit2(&file->zs, 15 + 16) != Z_OK)
+            ereport(ERROR,
+                    (errcode(ERRCODE_OUT_OF_MEMORY),
+                     errmsg("could not initialize decompression of file \"%s\"", file->path)));
+    }
+#else
+    if (gzip)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("file \"%s\" is gzip-compressed", file->path),
+                 errdetail("The server was built without zlib.")));
+#endif
+    return file;
+}
+
+static void
+seq_file_close(SeqFile *file)
+{
+#ifdef HAVE_LIBZ
+    if (file->compressed)
+        inflateEnd(&file->zs);
+#endif
+    if (CloseTransientFile(file->fd) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not close file \"%s\": %m", file->path)));
+}
+
+/* Reads the next block of the file, false at the end */
+static bool
+seq_file_fill(SeqFile *file)
+{
+#ifdef HAVE_LIBZ
+    if (file->compressed)
+        file->len = seq_file_inflate(file);
+    else
+#endif
+        file->len = seq_file_read(file, file->buf, SEQ_FILE_BUFSIZE);
+    file->pos = 0;
+    return file->len > 0;
+}
+
+/* Reads the next line into line, without its end of line; false at the end */
+static bool
+seq_file_gets(SeqFile *file, StringInfo line)
+{
+    resetStringInfo(line);
+    for (;;) {
+        char   *start;
+        char   *newline;
+
+        if (file->pos >= file->len && !seq_file_fill(file)) {
+            if (line->len == 0)
+                return false;
+            break;
+        }
+
+        start = file->buf + file->pos;
+        newline = memchr(start, '\n', file->len - file->pos);
+        if (newline != NULL) {
+            appendBinaryStringInfo(line, start, newline - start);
+            file->pos += newline - start + 1;
+            break;
+        }
+        appendBinaryStringInfo(line, start, file->len - file->pos);
+        file->pos = file->len;
+    }
+
+    if (line->len > 0 && line->data[line->len - 1] == '\r')
+        line->data[--line->len] = '\0';
+    file->lineno++;
+    return true;
+}
+
+static void
+seq_file_error(SeqFile *file, const char *format, const char *detail)
+{
+    ereport(ERROR,
+            (errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+             errmsg("invalid %s file \"%s\" at line %lld", format, file->path,
+                    (long long) file->lineno),
+             errdetail("%s", detail)));
+}
+
+/* First word of a header line, after its marker (> or @) */
+static text *
+record_id(const StringInfo header)
+{
+    int len = 1;
+
+    while (len < header->len && !isspace((unsigned char) header->data[len]))
+        len++;
+    return cstring_to_text_with_len(header->data + 1, len - 1);
+}
+
+/*
+ * Dna of a record, or NULL when the record holds an invalid character and
+ * skip_invalid is set.
+ */
+static Dna *
+record_dna(SeqFile *file, const text *id, const StringInfo seq, bool skip_invalid)
+{
+    Dna    *dna;
+    int32   bad;
+
+    if (seq->len == 0) {
+        if (skip_invalid)
+            return NULL;
+        ereport(ERROR,
+                (errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+                 errmsg("empty sequence in record \"%s\" of file \"%s\"",
+                        text_to_cstring(id), file->path)));
+    }
+
+    dna = dna_alloc(seq->len);
+    bad = dna_try_pack(seq->data, seq->len, dna->data);
+    if (bad < seq->len) {
+        if (skip_invalid)
+            return NULL;
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("Error: Invalid nucleotide '%c' in sequence.\n", seq->data[bad]),
+                 errdetail("Invalid character at offset %d of record \"%s\" in file \"%s\".",
+                           bad, text_to_cstring(id), file->path),
+                 errhint("Use skip_invalid to skip such records.")));
+    }
+    return dna;
+}
+
+static void
+report_skipped(SeqFile *file, int64 skipped)
+{
+    if (skipped > 0)
+        ereport(NOTICE,
+                (errmsg("skipped %lld invalid records of file \"%s\"",
+                        (long long) skipped, file->path)));
+}
+
+PG_FUNCTION_INFO_V1(read_fasta);
+Datum
+read_fasta(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    bool        skip_invalid = PG_GETARG_BOOL(1);
+    SeqFile    *file;
+    StringInfoData line;
+    StringInfoData seq;
+    text       *id = NULL;
+    bool        more;
+    int64       skipped = 0;
+    MemoryContext record_cxt;
+    MemoryContext oldcontext;
+
+    check_read_server_files();
+    InitMaterializedSRF(fcinfo, 0);
+    file = seq_file_open(PG_GETARG_TEXT_PP(0));
+    initStringInfo(&line);
+    initStringInfo(&seq);
+    record_cxt = AllocSetContextCreate(CurrentMemoryContext, "read_fasta record",
+                                       ALLOCSET_DEFAULT_SIZES);
+
+    do {
+        more = seq_file_gets(file, &line);
+
+        /* a header or the end of the file closes the current record */
+        if (!more || line.data[0] == '>') {
+            if (id != NULL) {
+                Dna    *dna;
+
+                oldcontext = MemoryContextSwitchTo(record_cxt);
+                dna = record_dna(file, id, &seq, skip_invalid);
+                if (dna != NULL) {
+                    Datum   values[2] = {PointerGetDatum(id), PointerGetDatum(dna)};
+                    bool    nulls[2] = {false, false};
+
+                    tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+                }
+                else
+                    skipped++;
+                MemoryContextSwitchTo(oldcontext);
+                MemoryContextReset(record_cxt);
+            }
+            if (more) {
+                oldcontext = MemoryContextSwitchTo(record_cxt);
+                id = record_id(&line);
+                MemoryContextSwitchTo(oldcontext);
+                resetStringInfo(&seq);
+            }
+        }
+        else if (line.len == 0 || line.data[0] == ';')
+            continue;
+        else if (id == NULL)
+            seq_file_error(file, "FASTA", "Sequence data before the first header line.");
+        else
+            appendBinaryStringInfo(&seq, line.data, line.len);
+
+        CHECK_FOR_INTERRUPTS();
+    } while (more);
+
+    seq_file_close(file);
+    report_skipped(file, skipped);
+    return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(read_fastq);
+Datum
+read_fastq(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    bool        skip_invalid = PG_GETARG_BOOL(1);
+    SeqFile    *file;
+    StringInfoData header;
+    StringInfoData seq;
+    StringInfoData line;
+    int64       skipped = 0;
+    MemoryContext record_cxt;
+
+    check_read_server_files();
+    InitMaterializedSRF(fcinfo, 0);
+    file = seq_file_open(PG_GETARG_TEXT_PP(0));
+    initStringInfo(&header);
+    initStringInfo(&seq);
+    initStringInfo(&line);
+    record_cxt = AllocSetContextCreate(CurrentMemoryContext, "read_fastq record",
+                                       ALLOCSET_DEFAULT_SIZES);
+
+    while (seq_file_gets(file, &header)) {
+        MemoryContext oldcontext;
+        text   *id;
+        Dna    *dna;
+
+        if (header.len == 0)
+            continue;
+        if (header.data[0] != '@')
+            seq_file_error(file, "FASTQ", "A record must start with a line beginning with \"@\".");
+        if (!seq_file_gets(file, &seq) || !seq_file_gets(file, &line) ||
+            line.data[0] != '+')
+            seq_file_error(file, "FASTQ", "A record must have a sequence line followed by a line beginning with \"+\".");
+        if (!seq_file_gets(file, &line) || line.len != seq.len)
+            seq_file_error(file, "FASTQ", "The quality line must be as long as the sequence.");
+
+        oldcontext = MemoryContextSwitchTo(record_cxt);
+        id = record_id(&header);
+        dna = record_dna(file, id, &seq, skip_invalid);
+        if (dna != NULL) {
+            Datum   values[3] = {PointerGetDatum(id), PointerGetDatum(dna),
+                                 PointerGetDatum(cstring_to_text_with_len(line.data, line.len))};
+            bool    nulls[3] = {false, false, false};
+
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+        }
+        else
+            skipped++;
+        MemoryContextSwitchTo(oldcontext);
+        MemoryContextReset(record_cxt);
+
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    seq_file_close(file);
+    report_skipped(file, skipped);
+    return (Datum) 0;
+}
+
+/*
+ * write_fasta(path, id, sequence [, line_width]): writes the rows to a FASTA
+ * file and returns their number. The file is opened at the first row (the
+ * path of the other rows is ignored), or by the final function when there is
+ * no row, and written in blocks of
+ * FASTA_WRITE_BUFSIZE bytes; the bases are unpacked straight into the block,
+ * line_width per line (0 for a single line). Rows with a NULL sequence are
+ * skipped.
+ */
+typedef struct FastaWriter {
+    FILE *file;
+    char *path;
+    int32 width;
+    int64 records;
+    int len;                        /* bytes in buf */
+    char buf[FASTA_WRITE_BUFSIZE];
+} FastaWriter;
+
+static void
+fasta_flush(FastaWriter *writer)
+{
+    if (writer->len > 0 && fwrite(writer->buf, 1, writer->len, writer->file) != writer->len)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not write file \"%s\": %m", writer->path)));
+    writer->len = 0;
+}
+
+static inline void
+fasta_putc(FastaWriter *writer, char c)
+{
+    if (writer->len == FASTA_WRITE_BUFSIZE)
+        fasta_flush(writer);
+    writer->buf[writer->len++] = c;
+}
+
+static void
+fasta_write(FastaWriter *writer, const char *data, int len)
+{
+    while (len > 0) {
+        int n;
+
+        if (writer->len == FASTA_WRITE_BUFSIZE)
+            fasta_flush(writer);
+        n = Min(len, FASTA_WRITE_BUFSIZE - writer->len);
+        memcpy(writer->buf + writer->len, data, n);
+        writer->len += n;
+        data += n;
+        len -= n;
+    }
+}
+
+/* Creates (or truncates) the file at path, in the aggregate context */
+static FastaWriter *
+fasta_writer_open(MemoryContext aggcontext, text *path, int32 width)
+{
+    FastaWriter *writer;
+
+    if (!superuser() && !has_privs_of_role(GetUserId(), ROLE_PG_WRITE_SERVER_FILES))
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("permission denied to write sequence files"),
+                 errdetail("Only roles with privileges of the \"pg_write_server_files\" role may write files of the server.")));
+
+    writer = (FastaWriter *) MemoryContextAlloc(aggcontext, sizeof(FastaWriter));
+    writer->path = MemoryContextStrdup(aggcontext, text_to_cstring(path));
+    writer->width = width;
+    writer->records = 0;
+    writer->len = 0;
+    writer->file = AllocateFile(writer->path, PG_BINARY_W);
+    if (writer->file == NULL)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not open file \"%s\" for writing: %m", writer->path)));
+    return writer;
+}
+
+PG_FUNCTION_INFO_V1(write_fasta_transfn);
+Datum
+write_fasta_transfn(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    FastaWriter *writer = PG_ARGISNULL(0) ? NULL : (FastaWriter *) PG_GETARG_POINTER(0);
+    DnaReader   reader;
+    int32       col = 0;
+
+    if (!AggCheckCallContext(fcinfo, &aggcontext))
+        elog(ERROR, "write_fasta_transfn called in non-aggregate context");
+
+    if (writer == NULL) {
+        int32   width = PG_NARGS() > 4 && !PG_ARGISNULL(4) ? PG_GETARG_INT32(4) : FASTA_LINE_WIDTH;
+
+        if (PG_ARGISNULL(1))
+            ereport(ERROR,
+                    (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                     errmsg("path cannot be NULL")));
+        if (width < 0)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("line width cannot be negative")));
+        writer = fasta_writer_open(aggcontext, PG_GETARG_TEXT_PP(1), width);
+    }
+
+    if (PG_ARGISNULL(3))
+        PG_RETURN_POINTER(writer);
+
+    fasta_putc(writer, '>');
+    if (!PG_ARGISNULL(2)) {
+        text   *id = PG_GETARG_TEXT_PP(2);
+
+        fasta_write(writer, VARDATA_ANY(id), VARSIZE_ANY_EXHDR(id));
+    }
+    fasta_putc(writer, '\n');
+
+    dna_reader_init(&reader, PG_GETARG_DATUM(3));
+    while (reader.pos < reader.length) {
+        fasta_putc(writer, dna_nucleotides[dna_reader_next(&reader)]);
+        if (++col == writer->width) {
+            fasta_putc(writer, '\n');
+            col = 0;
+        }
+    }
+    if (col > 0)
+        fasta_putc(writer, '\n');
+    dna_reader_end(&reader);
+
+    writer->records++;
+    PG_RETURN_POINTER(writer);
+}
+
+/*
+ * Flushes and closes the file, so the state cannot be finalized twice.
+ * Without any row the file has not been opened: it is created empty (or
+ * truncated) all the same when the path is a constant of the call, so no
+ * output from an earlier run is left behind.
+ */
+PG_FUNCTION_INFO_V1(write_fasta_finalfn);
+Datum
+write_fasta_finalfn(PG_FUNCTION_ARGS)
+{
+    FastaWriter *writer = PG_ARGISNULL(0) ? NULL : (FastaWriter *) PG_GETARG_POINTER(0);
+    MemoryContext aggcontext;
+
+    if (writer == NULL) {
+        Aggref *aggref = AggGetAggref(fcinfo);
+        Node   *path;
+
+        if (!AggCheckCallContext(fcinfo, &aggcontext) || aggref == NULL)
+            elog(ERROR, "write_fasta_finalfn called in non-aggregate context");
+        path = (Node *) ((TargetEntry *) linitial(aggref->args))->expr;
+        if (!IsA(path, Const) || ((Const *) path)->constisnull)
+            PG_RETURN_INT64(0);
+        writer = fasta_writer_open(aggcontext, DatumGetTextPP(((Const *) path)->constvalue), 0);
+    }
+
+    fasta_flush(writer);
+    if (FreeFile(writer->file) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not close file \"%s\": %m", writer->path)));
+    writer->file = NULL;
+    PG_RETURN_INT64(writer->records);
+}
@@ -122,18 +122,18 @@ SELECT dna, text(dna), dna(text(dna)), kmer(dna), dna(kmer(dna)), size(dna), len
 /*Output
      dna     |    text     |     dna     |    kmer     |     dna     | size | length 
 -------------+-------------+-------------+-------------+-------------+------+--------
- ACGT        | ACGT        | ACGT        | ACGT        | ACGT        |   36 |      4
- CT          | CT          | CT          | CT          | CT          |   28 |      2
- AAA         | AAA         | AAA         | AAA         | AAA         |   32 |      3
- AGTTTTGAAAA | AGTTTTGAAAA | AGTTTTGAAAA | AGTTTTGAAAA | AGTTTTGAAAA |   64 |     11
- ACGTC       | ACGTC       | ACGTC       | ACGTC       | ACGTC       |   40 |      5
- AAGTC       | AAGTC       | AAGTC       | AAGTC       | AAGTC       |   40 |      5
- AGGTC       | AGGTC       | AGGTC       | AGGTC       | AGGTC       |   40 |      5
- ATGTC       | ATGTC       | ATGTC       | ATGTC       | ATGTC       |   40 |      5
- ATGT        | ATGT        | ATGT        | ATGT        | ATGT        |   36 |      4
- ATG         | ATG         | ATG         | ATG         | ATG         |   32 |      3
- ATG         | ATG         | ATG         | ATG         | ATG         |   32 |      3
- ATG         | ATG         | ATG         | ATG         | ATG         |   32 |      3
+ ACGT        | ACGT        | ACGT        | ACGT        | ACGT        |    9 |      4
+ CT          | CT          | CT          | CT          | CT          |    9 |      2
+ AAA         | AAA         | AAA         | AAA         | AAA         |    9 |      3
+ AGTTTTGAAAA | AGTTTTGAAAA | AGTTTTGAAAA | AGTTTTGAAAA | AGTTTTGAAAA |   11 |     11
+ ACGTC       | ACGTC       | ACGTC       | ACGTC       | ACGTC       |   10 |      5
+ AAGTC       | AAGTC       | AAGTC       | AAGTC       | AAGTC       |   10 |      5
+ AGGTC       | AGGTC       | AGGTC       | AGGTC       | AGGTC       |   10 |      5
+ ATGTC       | ATGTC       | ATGTC       | ATGTC       | ATGTC       |   10 |      5
+ ATGT        | ATGT        | ATGT        | ATGT        | ATGT        |    9 |      4
+ ATG         | ATG         | ATG         | ATG         | ATG         |    9 |      3
+ ATG         | ATG         | ATG         | ATG         | ATG         |    9 |      3
+ ATG         | ATG         | ATG         | ATG         | ATG         |    9 |      3
 (12 rows)
 */
 
@@ -142,18 +142,18 @@ SELECT kmer, text(kmer), kmer(text(kmer)), dna(kmer), kmer(dna(kmer)), size(kmer
 /* Output
     kmer     |    text     |    kmer     |     dna     |    kmer     | size | length 
 -------------+-------------+-------------+-------------+-------------+------+--------
- ACGT        | ACGT        | ACGT        | ACGT        | ACGT        |   36 |      4
- CT          | CT          | CT          | CT          | CT          |   28 |      2
- AAA         | AAA         | AAA         | AAA         | AAA         |   32 |      3
- AGTTTTGAAAA | AGTTTTGAAAA | AGTTTTGAAAA | AGTTTTGAAAA | AGTTTTGAAAA |   64 |     11
- ACGTC       | ACGTC       | ACGTC       | ACGTC       | ACGTC       |   40 |      5
- AAGTC       | AAGTC       | AAGTC       | AAGTC       | AAGTC       |   40 |      5
- AGGTC       | AGGTC       | AGGTC       | AGGTC       | AGGTC       |   40 |      5
- ATGTC       | ATGTC       | ATGTC       | ATGTC       | ATGTC       |   40 |      5
- ATGT        | ATGT        | ATGT        | ATGT        | ATGT        |   36 |      4
- ATG         | ATG         | ATG         | ATG         | ATG         |   32 |      3
- ATG         | ATG         | ATG         | ATG         | ATG         |   32 |      3
- ATG         | ATG         | ATG         | ATG         | ATG         |   32 |      3
+ ACGT        | ACGT        | ACGT        | ACGT        | ACGT        |   16 |      4
+ CT          | CT          | CT          | CT          | CT          |   16 |      2
+ AAA         | AAA         | AAA         | AAA         | AAA         |   16 |      3
+ AGTTTTGAAAA | AGTTTTGAAAA | AGTTTTGAAAA | AGTTTTGAAAA | AGTTTTGAAAA |   16 |     11
+ ACGTC       | ACGTC       | ACGTC       | ACGTC       | ACGTC       |   16 |      5
+ AAGTC       | AAGTC       | AAGTC       | AAGTC       | AAGTC       |   16 |      5
+ AGGTC       | AGGTC       | AGGTC       | AGGTC       | AGGTC       |   16 |      5
+ ATGTC       | ATGTC       | ATGTC       | ATGTC       | ATGTC       |   16 |      5
+ ATGT        | ATGT        | ATGT        | ATGT        | ATGT        |   16 |      4
+ ATG         | ATG         | ATG         | ATG         | ATG         |   16 |      3
+ ATG         | ATG         | ATG         | ATG         | ATG         |   16 |      3
+ ATG         | ATG         | ATG         | ATG         | ATG         |   16 |      3
 (12 rows)
 */
 
@@ -315,7 +315,7 @@ END $$;
 
 -- Returns 2 tables with 2 rows (ACGT and ACGTC) - these 2 queries are equivalent
 SELECT * FROM t WHERE starts_with('ACG', kmer);
-SELECT * FROM t WHERE 'ACG' ^@ kmer;
+SELECT * FROM t WHERE kmer ^@ 'ACG';
 
 /* Output
  id |  dna  | kmer  
@@ -430,6 +430,49 @@ ORDER BY count(*) DESC;
 (4 rows)
 */
 
+-- Same counts computed inside the extension, only distinct kmers are returned
+SELECT kmer, count
+FROM kmer_counts('ACGTACGT', 4)
+ORDER BY count DESC, kmer;
+
+/* Output
+ kmer | count 
+------+-------
+ ACGT |     2
+ CGTA |     1
+ GTAC |     1
+ TACG |     1
+(4 rows)
+*/
+
+-- Kmer counts over all the rows of a table (the aggregate runs in parallel
+-- workers on large tables), returned as an array of (kmer, count)
+SELECT (c).kmer, (c).count
+FROM (SELECT unnest(kmer_count_agg(dna, 4)) AS c FROM t WHERE id IN (1, 5)) AS counts
+ORDER BY (c).count DESC, (c).kmer;
+
+/* Output
+ kmer | count 
+------+-------
+ ACGT |     2
+ CGTC |     1
+(2 rows)
+*/
+
+-- Strand-independent counts: each kmer is merged with its reverse complement
+SELECT kmer, count
+FROM kmer_counts('ACGTACGT', 4, canonical => true)
+ORDER BY count DESC, kmer;
+
+/* Output
+ kmer | count 
+------+-------
+ ACGT |     2
+ CGTA |     2
+ GTAC |     1
+(3 rows)
+*/
+
 -- Return the total, distinct and unique count of 4-mers in 'ACGTACGT'
 -- Returns a table with one row
 WITH kmers AS (
@@ -531,6 +574,9 @@ SELECT * FROM q LIMIT 20;
 DROP INDEX IF EXISTS spgist_index;
 CREATE INDEX spgist_index ON q USING spgist (kmer kmer_index_support);
 
+-- Collect the statistics used to estimate the rows matched by =, ^@ and @>
+ANALYZE q;
+
 SET enable_seqscan = OFF;
 
 EXPLAIN (SELECT * FROM q WHERE 'ACGT'= kmer);
@@ -541,28 +587,79 @@ EXPLAIN (SELECT * FROM q WHERE  'ANGTA' @> kmer);
 psql:example.sql:255: NOTICE:  index "spgist_index" does not exist, skipping
 DROP INDEX
 CREATE INDEX
+ANALYZE
 SET
-                                     QUERY PLAN                                      
--------------------------------------------------------------------------------------
- Bitmap Heap Scan on q  (cost=25305.28..43211.29 rows=500000 width=32)
-   Filter: ('ACGT'::kmer = kmer)
-   ->  Bitmap Index Scan on spgist_index  (cost=0.00..25180.28 rows=1000000 width=0)
+                                 QUERY PLAN                                 
+----------------------------------------------------------------------------
+ Index Only Scan using spgist_index on q  (cost=0.29..8.30 rows=1 width=16)
+   Index Cond: (kmer = 'ACGT'::kmer)
+(2 rows)
+
+                                 QUERY PLAN                                 
+----------------------------------------------------------------------------
+ Index Only Scan using spgist_index on q  (cost=0.29..8.30 rows=1 width=16)
+   Index Cond: (kmer ^@ 'ACG'::kmer)
+(2 rows)
+
+                                 QUERY PLAN                                 
+----------------------------------------------------------------------------
+ Index Only Scan using spgist_index on q  (cost=0.29..8.30 rows=1 width=16)
+   Index Cond: (kmer <@ 'ANGTA'::qkmer)
+(2 rows)
+*/
+
+-- Nearest kmers by Hamming distance, read from the index in distance order
+EXPLAIN (COSTS OFF) SELECT kmer, kmer <-> 'ACGTACGTAC' FROM q ORDER BY kmer <-> 'ACGTACGTAC' LIMIT 10;
+
+/* Output
+                   QUERY PLAN                    
+-------------------------------------------------
+ Limit
+   ->  Index Only Scan using spgist_index on q
+         Order By: (kmer <-> 'ACGTACGTAC'::kmer)
 (3 rows)
+*/
+
+-- Kmers within 1 mismatch of a query, the index prunes the branches over budget
+SELECT id, kmer, kmer <-> 'ACGTA' AS distance FROM t WHERE kmer %> ('ACGTA', 1);
 
-                                     QUERY PLAN                                     
-------------------------------------------------------------------------------------
- Bitmap Heap Scan on q  (cost=13967.28..25623.28 rows=500000 width=32)
-   Recheck Cond: (kmer ^@ 'ACG'::kmer)
-   ->  Bitmap Index Scan on spgist_index  (cost=0.00..13842.28 rows=500000 width=0)
-         Index Cond: (kmer ^@ 'ACG'::kmer)
+/* Output
+ id | kmer  | distance 
+----+-------+----------
+  1 | ACGT  |        1
+  5 | ACGTC |        1
+(2 rows)
+*/
+
+-- GIN index finding the dna sequences that contain a kmer or a sequence
+CREATE INDEX dna_gin_index ON t USING gin (dna dna_kmer_ops (k = 4));
+
+SELECT id, dna FROM t WHERE dna @> 'GTC'::kmer;
+SELECT id, dna FROM t WHERE dna @> 'TTTTGA'::dna;
+EXPLAIN (COSTS OFF) SELECT id, dna FROM t WHERE dna @> 'AGTC'::kmer;
+
+/* Output
+CREATE INDEX
+ id |  dna  
+----+-------
+  5 | ACGTC
+  6 | AAGTC
+  7 | AGGTC
+  8 | ATGTC
 (4 rows)
 
-                                     QUERY PLAN                                      
--------------------------------------------------------------------------------------
- Bitmap Heap Scan on q  (cost=25305.28..43211.29 rows=500000 width=32)
-   Filter: ('ANGTA'::qkmer @> kmer)
-   ->  Bitmap Index Scan on spgist_index  (cost=0.00..25180.28 rows=1000000 width=0)
-(3 rows)
+ id |     dna     
+----+-------------
+  4 | AGTTTTGAAAA
+(1 row)
+
+                QUERY PLAN                 
+-------------------------------------------
+ Bitmap Heap Scan on t
+   Recheck Cond: (dna @> 'AGTC'::kmer)
+   ->  Bitmap Index Scan on dna_gin_index
+         Index Cond: (dna @> 'AGTC'::kmer)
+(4 rows)
 */
 
 
@@ -571,3 +668,4 @@ SET
 
 
 
+
@@ -24,7 +24,7 @@ WHERE typname = 'kmer';
 
 --  typname | typlen | typinput | typoutput | typreceive |  typsend
 -- ---------+--------+----------+-----------+------------+-----------
---  kmer    |     -1 | kmer_in  | kmer_out  | kmer_recv  | kmer_send
+--  kmer    |     16 | kmer_in  | kmer_out  | kmer_recv  | kmer_send
 -- (1 Zeile)
 
 SELECT typname, typlen, typinput, typoutput, typreceive, typsend
@@ -33,7 +33,7 @@ WHERE typname = 'qkmer';
 
 --  typname | typlen | typinput | typoutput | typreceive |  typsend
 -- ---------+--------+----------+-----------+------------+------------
---  qkmer   |     -1 | qkmer_in | qkmer_out | qkmer_recv | qkmer_send
+--  qkmer   |     24 | qkmer_in | qkmer_out | qkmer_recv | qkmer_send
 -- (1 Zeile)
 
 --------------------------------------------------------------------------------------
@@ -101,14 +101,14 @@ SELECT * FROM dna_sequences LIMIT 10;
 SELECT dna, text(dna), dna(text(dna)), size(dna), length(dna) FROM dna_sequences LIMIT 10;
 /*Output
                                   dna                                    |                                   text                                   |                                   dna                                    | size | length 
- ATAAAATCAGGGGTGTTGGAGATGGGATGCCTATTTCTGCACACCTTGGCCTCCCAAATTGCTGGGATTACA | ATAAAATCAGGGGTGTTGGAGATGGGATGCCTATTTCTGCACACCTTGGCCTCCCAAATTGCTGGGATTACA | ATAAAATCAGGGGTGTTGGAGATGGGATGCCTATTTCTGCACACCTTGGCCTCCCAAATTGCTGGGATTACA |  308 |     72
- TTAAGAAATTTTTGCTCAAACCATGCCCTAAAGGGTTCTGTAATAAATAGGGCTGGGAAAACTGGCAAGCCA | TTAAGAAATTTTTGCTCAAACCATGCCCTAAAGGGTTCTGTAATAAATAGGGCTGGGAAAACTGGCAAGCCA | TTAAGAAATTTTTGCTCAAACCATGCCCTAAAGGGTTCTGTAATAAATAGGGCTGGGAAAACTGGCAAGCCA |  308 |     72
- TCTTATAACAATTTTCCACTCATTTGTGCCAATTTTGTGATGTGCAAGATTCTGCTTCAACTTTTGCCATGA | TCTTATAACAATTTTCCACTCATTTGTGCCAATTTTGTGATGTGCAAGATTCTGCTTCAACTTTTGCCATGA | TCTTATAACAATTTTCCACTCATTTGTGCCAATTTTGTGATGTGCAAGATTCTGCTTCAACTTTTGCCATGA |  308 |     72
- GCTTTTCTACTTTTCAATAAAACCTTCTTTATTTTTGTGTTTCACCATGTTGGTCAGGCTTATCTCTAATTC | GCTTTTCTACTTTTCAATAAAACCTTCTTTATTTTTGTGTTTCACCATGTTGGTCAGGCTTATCTCTAATTC | GCTTTTCTACTTTTCAATAAAACCTTCTTTATTTTTGTGTTTCACCATGTTGGTCAGGCTTATCTCTAATTC |  308 |     72
- AGAACCTAGAAATAAGGCCAAATACTTACAACCAACTTTCTTCTAGAATTTTTATGGTTTTTTTTTTTATAT | AGAACCTAGAAATAAGGCCAAATACTTACAACCAACTTTCTTCTAGAATTTTTATGGTTTTTTTTTTTATAT | AGAACCTAGAAATAAGGCCAAATACTTACAACCAACTTTCTTCTAGAATTTTTATGGTTTTTTTTTTTATAT |  308 |     72
- TTCCTTTGCTCTGGGAAGAAGTCTTAACTTCCTTTGGGACGGTAGGGGTTGGAGCCACAGTGAGTCTTACAC | TTCCTTTGCTCTGGGAAGAAGTCTTAACTTCCTTTGGGACGGTAGGGGTTGGAGCCACAGTGAGTCTTACAC | TTCCTTTGCTCTGGGAAGAAGTCTTAACTTCCTTTGGGACGGTAGGGGTTGGAGCCACAGTGAGTCTTACAC |  308 |     72
- TAAAAACCTTGAAAAAAGATTAGACGGATGGCTAACAAGACTTTGCTCATTTCTTTTTACTCTCTTTTCTCT | TAAAAACCTTGAAAAAAGATTAGACGGATGGCTAACAAGACTTTGCTCATTTCTTTTTACTCTCTTTTCTCT | TAAAAACCTTGAAAAAAGATTAGACGGATGGCTAACAAGACTTTGCTCATTTCTTTTTACTCTCTTTTCTCT |  308 |     72
- GAATGAAATAAATCCACAAGAGGAGTTTAGAGAAAATCTGTATTTCCTGAATCTGAATGTTGGCCTGCCTTG | GAATGAAATAAATCCACAAGAGGAGTTTAGAGAAAATCTGTATTTCCTGAATCTGAATGTTGGCCTGCCTTG | GAATGAAATAAATCCACAAGAGGAGTTTAGAGAAAATCTGTATTTCCTGAATCTGAATGTTGGCCTGCCTTG |  308 |     72
+ ATAAAATCAGGGGTGTTGGAGATGGGATGCCTATTTCTGCACACCTTGGCCTCCCAAATTGCTGGGATTACA | ATAAAATCAGGGGTGTTGGAGATGGGATGCCTATTTCTGCACACCTTGGCCTCCCAAATTGCTGGGATTACA | ATAAAATCAGGGGTGTTGGAGATGGGATGCCTATTTCTGCACACCTTGGCCTCCCAAATTGCTGGGATTACA |   26 |     72
+ TTAAGAAATTTTTGCTCAAACCATGCCCTAAAGGGTTCTGTAATAAATAGGGCTGGGAAAACTGGCAAGCCA | TTAAGAAATTTTTGCTCAAACCATGCCCTAAAGGGTTCTGTAATAAATAGGGCTGGGAAAACTGGCAAGCCA | TTAAGAAATTTTTGCTCAAACCATGCCCTAAAGGGTTCTGTAATAAATAGGGCTGGGAAAACTGGCAAGCCA |   26 |     72
+ TCTTATAACAATTTTCCACTCATTTGTGCCAATTTTGTGATGTGCAAGATTCTGCTTCAACTTTTGCCATGA | TCTTATAACAATTTTCCACTCATTTGTGCCAATTTTGTGATGTGCAAGATTCTGCTTCAACTTTTGCCATGA | TCTTATAACAATTTTCCACTCATTTGTGCCAATTTTGTGATGTGCAAGATTCTGCTTCAACTTTTGCCATGA |   26 |     72
+ GCTTTTCTACTTTTCAATAAAACCTTCTTTATTTTTGTGTTTCACCATGTTGGTCAGGCTTATCTCTAATTC | GCTTTTCTACTTTTCAATAAAACCTTCTTTATTTTTGTGTTTCACCATGTTGGTCAGGCTTATCTCTAATTC | GCTTTTCTACTTTTCAATAAAACCTTCTTTATTTTTGTGTTTCACCATGTTGGTCAGGCTTATCTCTAATTC |   26 |     72
+ AGAACCTAGAAATAAGGCCAAATACTTACAACCAACTTTCTTCTAGAATTTTTATGGTTTTTTTTTTTATAT | AGAACCTAGAAATAAGGCCAAATACTTACAACCAACTTTCTTCTAGAATTTTTATGGTTTTTTTTTTTATAT | AGAACCTAGAAATAAGGCCAAATACTTACAACCAACTTTCTTCTAGAATTTTTATGGTTTTTTTTTTTATAT |   26 |     72
+ TTCCTTTGCTCTGGGAAGAAGTCTTAACTTCCTTTGGGACGGTAGGGGTTGGAGCCACAGTGAGTCTTACAC | TTCCTTTGCTCTGGGAAGAAGTCTTAACTTCCTTTGGGACGGTAGGGGTTGGAGCCACAGTGAGTCTTACAC | TTCCTTTGCTCTGGGAAGAAGTCTTAACTTCCTTTGGGACGGTAGGGGTTGGAGCCACAGTGAGTCTTACAC |   26 |     72
+ TAAAAACCTTGAAAAAAGATTAGACGGATGGCTAACAAGACTTTGCTCATTTCTTTTTACTCTCTTTTCTCT | TAAAAACCTTGAAAAAAGATTAGACGGATGGCTAACAAGACTTTGCTCATTTCTTTTTACTCTCTTTTCTCT | TAAAAACCTTGAAAAAAGATTAGACGGATGGCTAACAAGACTTTGCTCATTTCTTTTTACTCTCTTTTCTCT |   26 |     72
+ GAATGAAATAAATCCACAAGAGGAGTTTAGAGAAAATCTGTATTTCCTGAATCTGAATGTTGGCCTGCCTTG | GAATGAAATAAATCCACAAGAGGAGTTTAGAGAAAATCTGTATTTCCTGAATCTGAATGTTGGCCTGCCTTG | GAATGAAATAAATCCACAAGAGGAGTTTAGAGAAAATCTGTATTTCCTGAATCTGAATGTTGGCCTGCCTTG |   26 |     72
 (10 Zeilen)
 */
 
@@ -133,16 +133,16 @@ SELECT kmer, text(kmer), kmer(text(kmer)), dna(kmer), kmer(dna(kmer)), size(kmer
 /* Output
                kmer               |               text               |               kmer               |               dna                |               kmer               | size | length
 ----------------------------------+----------------------------------+----------------------------------+----------------------------------+----------------------------------+------+--------
- CATTCTTCACGTAGTTCTCGAGCCTTGGTTTT | CATTCTTCACGTAGTTCTCGAGCCTTGGTTTT | CATTCTTCACGTAGTTCTCGAGCCTTGGTTTT | CATTCTTCACGTAGTTCTCGAGCCTTGGTTTT | CATTCTTCACGTAGTTCTCGAGCCTTGGTTTT |  148 |     32
- CAGCGATGGAGAATGACTTTGACAAGCTGAGA | CAGCGATGGAGAATGACTTTGACAAGCTGAGA | CAGCGATGGAGAATGACTTTGACAAGCTGAGA | CAGCGATGGAGAATGACTTTGACAAGCTGAGA | CAGCGATGGAGAATGACTTTGACAAGCTGAGA |  148 |     32
- GGAGAATTGCTTGAACCTGGGAGCCAGAGGTT | GGAGAATTGCTTGAACCTGGGAGCCAGAGGTT | GGAGAATTGCTTGAACCTGGGAGCCAGAGGTT | GGAGAATTGCTTGAACCTGGGAGCCAGAGGTT | GGAGAATTGCTTGAACCTGGGAGCCAGAGGTT |  148 |     32
- GGGAGAAT                         | GGGAGAAT                         | GGGAGAAT                         | GGGAGAAT                         | GGGAGAAT                         |   52 |      8
- TTTTTGAGCAGCAGCAAGATTTATTGTGAAGA | TTTTTGAGCAGCAGCAAGATTTATTGTGAAGA | TTTTTGAGCAGCAGCAAGATTTATTGTGAAGA | TTTTTGAGCAGCAGCAAGATTTATTGTGAAGA | TTTTTGAGCAGCAGCAAGATTTATTGTGAAGA |  148 |     32
- TGGATATAACACATTTTGTTTATCCATTCATC | TGGATATAACACATTTTGTTTATCCATTCATC | TGGATATAACACATTTTGTTTATCCATTCATC | TGGATATAACACATTTTGTTTATCCATTCATC | TGGATATAACACATTTTGTTTATCCATTCATC |  148 |     32
- AGTTATTGTTAGTCATCAGTCACTGTAGAAAC | AGTTATTGTTAGTCATCAGTCACTGTAGAAAC | AGTTATTGTTAGTCATCAGTCACTGTAGAAAC | AGTTATTGTTAGTCATCAGTCACTGTAGAAAC | AGTTATTGTTAGTCATCAGTCACTGTAGAAAC |  148 |     32
- CTACATTTGATACCTAAACATTCTAATTTCCT | CTACATTTGATACCTAAACATTCTAATTTCCT | CTACATTTGATACCTAAACATTCTAATTTCCT | CTACATTTGATACCTAAACATTCTAATTTCCT | CTACATTTGATACCTAAACATTCTAATTTCCT |  148 |     32
- ATACATTTATTAAACAATGTTAAGACATTAAA | ATACATTTATTAAACAATGTTAAGACATTAAA | ATACATTTATTAAACAATGTTAAGACATTAAA | ATACATTTATTAAACAATGTTAAGACATTAAA | ATACATTTATTAAACAATGTTAAGACATTAAA |  148 |     32
- AGCCCAACCCCGTAGGCCATGAGGGAGGGGCA | AGCCCAACCCCGTAGGCCATGAGGGAGGGGCA | AGCCCAACCCCGTAGGCCATGAGGGAGGGGCA | AGCCCAACCCCGTAGGCCATGAGGGAGGGGCA | AGCCCAACCCCGTAGGCCATGAGGGAGGGGCA |  148 |     32
+ CATTCTTCACGTAGTTCTCGAGCCTTGGTTTT | CATTCTTCACGTAGTTCTCGAGCCTTGGTTTT | CATTCTTCACGTAGTTCTCGAGCCTTGGTTTT | CATTCTTCACGTAGTTCTCGAGCCTTGGTTTT | CATTCTTCACGTAGTTCTCGAGCCTTGGTTTT |   16 |     32
+ CAGCGATGGAGAATGACTTTGACAAGCTGAGA | CAGCGATGGAGAATGACTTTGACAAGCTGAGA | CAGCGATGGAGAATGACTTTGACAAGCTGAGA | CAGCGATGGAGAATGACTTTGACAAGCTGAGA | CAGCGATGGAGAATGACTTTGACAAGCTGAGA |   16 |     32
+ GGAGAATTGCTTGAACCTGGGAGCCAGAGGTT | GGAGAATTGCTTGAACCTGGGAGCCAGAGGTT | GGAGAATTGCTTGAACCTGGGAGCCAGAGGTT | GGAGAATTGCTTGAACCTGGGAGCCAGAGGTT | GGAGAATTGCTTGAACCTGGGAGCCAGAGGTT |   16 |     32
+ GGGAGAAT                         | GGGAGAAT                         | GGGAGAAT                         | GGGAGAAT                         | GGGAGAAT                         |   16 |      8
+ TTTTTGAGCAGCAGCAAGATTTATTGTGAAGA | TTTTTGAGCAGCAGCAAGATTTATTGTGAAGA | TTTTTGAGCAGCAGCAAGATTTATTGTGAAGA | TTTTTGAGCAGCAGCAAGATTTATTGTGAAGA | TTTTTGAGCAGCAGCAAGATTTATTGTGAAGA |   16 |     32
+ TGGATATAACACATTTTGTTTATCCATTCATC | TGGATATAACACATTTTGTTTATCCATTCATC | TGGATATAACACATTTTGTTTATCCATTCATC | TGGATATAACACATTTTGTTTATCCATTCATC | TGGATATAACACATTTTGTTTATCCATTCATC |   16 |     32
+ AGTTATTGTTAGTCATCAGTCACTGTAGAAAC | AGTTATTGTTAGTCATCAGTCACTGTAGAAAC | AGTTATTGTTAGTCATCAGTCACTGTAGAAAC | AGTTATTGTTAGTCATCAGTCACTGTAGAAAC | AGTTATTGTTAGTCATCAGTCACTGTAGAAAC |   16 |     32
+ CTACATTTGATACCTAAACATTCTAATTTCCT | CTACATTTGATACCTAAACATTCTAATTTCCT | CTACATTTGATACCTAAACATTCTAATTTCCT | CTACATTTGATACCTAAACATTCTAATTTCCT | CTACATTTGATACCTAAACATTCTAATTTCCT |   16 |     32
+ ATACATTTATTAAACAATGTTAAGACATTAAA | ATACATTTATTAAACAATGTTAAGACATTAAA | ATACATTTATTAAACAATGTTAAGACATTAAA | ATACATTTATTAAACAATGTTAAGACATTAAA | ATACATTTATTAAACAATGTTAAGACATTAAA |   16 |     32
+ AGCCCAACCCCGTAGGCCATGAGGGAGGGGCA | AGCCCAACCCCGTAGGCCATGAGGGAGGGGCA | AGCCCAACCCCGTAGGCCATGAGGGAGGGGCA | AGCCCAACCCCGTAGGCCATGAGGGAGGGGCA | AGCCCAACCCCGTAGGCCATGAGGGAGGGGCA |   16 |     32
 (10 Zeilen)
 */
 
@@ -316,7 +316,7 @@ END $$;
 
 -- Returns 2 tables with 2 rows (ACGT and ACGTC) - these 2 queries are equivalent
 SELECT * FROM kmer_sequences WHERE starts_with('ACG', kmer) LIMIT 10;
-SELECT * FROM kmer_sequences WHERE 'ACG' ^@ kmer LIMIT 10;
+SELECT * FROM kmer_sequences WHERE kmer ^@ 'ACG' LIMIT 10;
 
 /* Output
                 kmer
@@ -501,6 +501,11 @@ END $$;
 DROP INDEX IF EXISTS spgist_index;
 CREATE INDEX spgist_index ON kmer_sequences USING spgist (kmer kmer_index_support);
 
+-- Collect the statistics used to estimate the rows matched by =, ^@ and @>
+-- (the plans below were captured before kmer had statistics, hence the
+-- whole table as estimate)
+ANALYZE kmer_sequences;
+
 SET enable_seqscan = OFF;
 
 EXPLAIN (SELECT * FROM kmer_sequences WHERE 'ACGCACTC'= kmer);